@@ -59,6 +59,21 @@ IOReturn MbufUtils::setChainLength(mbuf_t mbuf, size_t targetLength) {
     return kIOReturnSuccess;
 }
 
+IOReturn MbufUtils::trimChainLength(mbuf_t mbuf, size_t targetLength) {
+    if (targetLength > MbufUtils::mbufTotalMaxLength(mbuf)) {
+        return kIOReturnNoMemory;
+    }
+    
+    mbuf_pkthdr_setlen(mbuf, targetLength);
+    for (; NULL != mbuf; mbuf = mbuf_next(mbuf)) {
+        size_t length = min_macro(targetLength, mbuf_maxlen(mbuf));
+        mbuf_setlen(mbuf, length);
+        targetLength -= length;
+    }
+    
+    return kIOReturnSuccess;
+}
+
 size_t MbufUtils::mbufTotalLength(mbuf_t mbuf) {
     size_t len = 0;
     do {
@@ -157,6 +172,23 @@ IOReturn MbufUtils::copyFromBufferToMbuf(mbuf_t mbuf, UInt32 from, UInt32 buffer
     return kIOReturnSuccess;
 }
 
+// The samples are 16 bit byte swapped on the wire: 24 bit big endian samples are
+// sent as byte pairs in the opposite order. Swaps the bytes of each pair, eight
+// bytes at a time, for when a whole range is in one mbuf.
+static void swapBytePairs(const UInt8 *in, UInt8 *out, UInt32 length) {
+    UInt32 i = 0;
+    for (; i+8 <= length; i+=8) {
+        UInt64 x;
+        memcpy(&x, in+i, sizeof(x));
+        x = ((x & 0x00ff00ff00ff00ffULL) << 8) | ((x >> 8) & 0x00ff00ff00ff00ffULL);
+        memcpy(out+i, &x, sizeof(x));
+    }
+    for (; i < length; i+=2) {
+        out[i] = in[i+1];
+        out[i+1] = in[i];
+    }
+}
+
 IOReturn MbufUtils::copyAudioFromBufferToMbuf(mbuf_t mbuf, UInt32 from, UInt32 bufferSize, UInt8 *inBuffer) {
     if (bufferSize > (UInt32) MbufUtils::mbufTotalLength(mbuf)-from) {
         IOLog("MbufUtils::copyAudioFromBufferToMbuf(): Got insufficiently large buffer (mbuf too small).\n");
@@ -173,6 +205,12 @@ IOReturn MbufUtils::copyAudioFromBufferToMbuf(mbuf_t mbuf, UInt32 from, UInt32 b
     UInt32 bytesLeft = bufferSize;
     
     skip_mbuf_macro();
+    
+    if (mbufLength >= bufferSize) {
+        // Fast path: The whole range is in this mbuf
+        swapBytePairs(inBuffer, mbufBuffer, bufferSize);
+        return kIOReturnSuccess;
+    }
 
 #   define mbuf_move_buffer_forward_macro() \
         ++mbufBuffer; \
@@ -212,6 +250,12 @@ IOReturn MbufUtils::copyAudioFromMbufToBuffer(mbuf_t mbuf, UInt32 from, UInt32 b
     
     skip_mbuf_macro();
     
+    if (mbufLength >= bufferSize) {
+        // Fast path: The whole range is in this mbuf
+        swapBytePairs(mbufBuffer, inBuffer, bufferSize);
+        return kIOReturnSuccess;
+    }
+    
     while (inBuffer < inBufferEnd) {
         for (UInt32 i=0; i<sizeof(intermediaryBuffer); i++) {
             ensure_mbuf_macro();
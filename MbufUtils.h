@@ -42,6 +42,9 @@ public:
     // On failure, this function may leave the mbuf in an inconsistent state (length wise, still safe to free)
     // This function can only increase the length
     static IOReturn setChainLength(mbuf_t mbuf, size_t targetLength);
+    // Sets the length of a packet mbuf chain to exactly targetLength, shortening
+    // it if needed. Mbufs past the end are left empty.
+    static IOReturn trimChainLength(mbuf_t mbuf, size_t targetLength);
     static size_t mbufTotalLength(mbuf_t mbuf);
     static size_t mbufTotalMaxLength(mbuf_t mbuf);
     static IOReturn zeroMbuf(mbuf_t mbuf, UInt32 from, UInt32 len);
@@ -50,6 +50,9 @@
 #include "FPU.h"
 #include "PCMBlitterLib.h"
 #include <xmmintrin.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
 #include <libkern/OSByteOrder.h>
 
 #define kMaxFloat32 2147483520.0f
@@ -1282,6 +1285,283 @@ void Float32ToSwapInt24_X86( const Float32 *src, UInt8 *dst, unsigned int numToC
 // ____________________________________________________________________________
 #pragma mark -
 
+// Transposes between interleaved frames of numChannels 24-bit big-endian samples
+// (as in REAC packets) and planar samples, one plane per channel, with plane c
+// starting planeStride samples after plane c-1.
+//
+// The vector code moves blocks of 4 frames x 4 channels: Each frame's 4 samples
+// are loaded into a register, expanded to 32-bit lanes, and the 4x4 lanes are
+// transposed. There are variants for the common channel counts, where the
+// compiler knows the frame size; other counts use the generic loop, with scalar
+// code for the channels that don't fill a block of 4.
+
+#if defined(__SSSE3__)
+
+// 12 bytes, without touching the 4 bytes after them
+static inline __m128i Load12(const UInt8 *src)
+{
+	return _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)src), _mm_cvtsi32_si128(*(const int *)(src+8)));
+}
+
+static inline void Store12(UInt8 *dst, __m128i val)
+{
+	_mm_storel_epi64((__m128i *)dst, val);
+	*(int *)(dst+8) = _mm_cvtsi128_si32(_mm_srli_si128(val, 8));
+}
+
+static inline void Transpose4x4(__m128i &r0, __m128i &r1, __m128i &r2, __m128i &r3)
+{
+	__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+	__m128i t1 = _mm_unpackhi_epi32(r0, r1);
+	__m128i t2 = _mm_unpacklo_epi32(r2, r3);
+	__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+	r0 = _mm_unpacklo_epi64(t0, t2);
+	r1 = _mm_unpackhi_epi64(t0, t2);
+	r2 = _mm_unpacklo_epi64(t1, t3);
+	r3 = _mm_unpackhi_epi64(t1, t3);
+}
+
+#endif
+
+// The same rounding as the vector code of Float32ToSwapInt24_X86 (to -inf), so that
+// the scalar and vector parts of the transposes agree
+static inline SInt32 Float32ToInt32Bits(Float32 f)
+{
+	Float32 v = f * 2147483648.0f + 0.5f;
+	if (v >= kMaxFloat32) return (SInt32)kMaxFloat32;
+	if (v <= -2147483648.0f) return (SInt32)0x80000000;
+	SInt32 i = (SInt32)v;
+	return ((Float32)i > v) ? i - 1 : i;
+}
+
+template <unsigned int kChannels>
+static void DeinterleaveInt24Frames(const UInt8 *src, unsigned int numChannels, unsigned int numFrames,
+									UInt8 *dst, unsigned int planeStride)
+{
+	const unsigned int channels = kChannels ? kChannels : numChannels;
+	const unsigned int frameSize = 3*channels;
+	unsigned int frame = 0;
+	unsigned int vectorChannels = 0;
+	
+#if defined(__SSSE3__)
+	const __m128i expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i compress = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	
+	vectorChannels = channels & ~3;
+	for (; frame+4 <= numFrames; frame += 4) {
+		const UInt8 *in = src + frame*frameSize;
+		for (unsigned int channel = 0; channel < vectorChannels; channel += 4) {
+			__m128i r0 = _mm_shuffle_epi8(Load12(in + 3*channel), expand);
+			__m128i r1 = _mm_shuffle_epi8(Load12(in + frameSize + 3*channel), expand);
+			__m128i r2 = _mm_shuffle_epi8(Load12(in + 2*frameSize + 3*channel), expand);
+			__m128i r3 = _mm_shuffle_epi8(Load12(in + 3*frameSize + 3*channel), expand);
+			Transpose4x4(r0, r1, r2, r3);
+			
+			UInt8 *out = dst + 3*(channel*planeStride + frame);
+			Store12(out, _mm_shuffle_epi8(r0, compress));
+			Store12(out + 3*planeStride, _mm_shuffle_epi8(r1, compress));
+			Store12(out + 6*planeStride, _mm_shuffle_epi8(r2, compress));
+			Store12(out + 9*planeStride, _mm_shuffle_epi8(r3, compress));
+		}
+	}
+#endif
+	
+	// The channels that the vector code left, then the frames
+	for (unsigned int channel = vectorChannels; channel < channels; channel++) {
+		for (unsigned int i = 0; i < frame; i++) {
+			const UInt8 *in = src + i*frameSize + 3*channel;
+			UInt8 *out = dst + 3*(channel*planeStride + i);
+			out[0] = in[0]; out[1] = in[1]; out[2] = in[2];
+		}
+	}
+	for (; frame < numFrames; frame++) {
+		for (unsigned int channel = 0; channel < channels; channel++) {
+			const UInt8 *in = src + frame*frameSize + 3*channel;
+			UInt8 *out = dst + 3*(channel*planeStride + frame);
+			out[0] = in[0]; out[1] = in[1]; out[2] = in[2];
+		}
+	}
+}
+
+template <unsigned int kChannels>
+static void InterleaveInt24Frames(const UInt8 *src, unsigned int planeStride, unsigned int numChannels,
+								  unsigned int numFrames, UInt8 *dst)
+{
+	const unsigned int channels = kChannels ? kChannels : numChannels;
+	const unsigned int frameSize = 3*channels;
+	unsigned int frame = 0;
+	unsigned int vectorChannels = 0;
+	
+#if defined(__SSSE3__)
+	const __m128i expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i compress = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	
+	vectorChannels = channels & ~3;
+	for (; frame+4 <= numFrames; frame += 4) {
+		UInt8 *out = dst + frame*frameSize;
+		for (unsigned int channel = 0; channel < vectorChannels; channel += 4) {
+			const UInt8 *in = src + 3*(channel*planeStride + frame);
+			__m128i r0 = _mm_shuffle_epi8(Load12(in), expand);
+			__m128i r1 = _mm_shuffle_epi8(Load12(in + 3*planeStride), expand);
+			__m128i r2 = _mm_shuffle_epi8(Load12(in + 6*planeStride), expand);
+			__m128i r3 = _mm_shuffle_epi8(Load12(in + 9*planeStride), expand);
+			Transpose4x4(r0, r1, r2, r3);
+			
+			Store12(out + 3*channel, _mm_shuffle_epi8(r0, compress));
+			Store12(out + frameSize + 3*channel, _mm_shuffle_epi8(r1, compress));
+			Store12(out + 2*frameSize + 3*channel, _mm_shuffle_epi8(r2, compress));
+			Store12(out + 3*frameSize + 3*channel, _mm_shuffle_epi8(r3, compress));
+		}
+	}
+#endif
+	
+	for (unsigned int channel = vectorChannels; channel < channels; channel++) {
+		for (unsigned int i = 0; i < frame; i++) {
+			const UInt8 *in = src + 3*(channel*planeStride + i);
+			UInt8 *out = dst + i*frameSize + 3*channel;
+			out[0] = in[0]; out[1] = in[1]; out[2] = in[2];
+		}
+	}
+	for (; frame < numFrames; frame++) {
+		for (unsigned int channel = 0; channel < channels; channel++) {
+			const UInt8 *in = src + 3*(channel*planeStride + frame);
+			UInt8 *out = dst + frame*frameSize + 3*channel;
+			out[0] = in[0]; out[1] = in[1]; out[2] = in[2];
+		}
+	}
+}
+
+template <unsigned int kChannels>
+static void DeinterleaveSwapInt24ToFloat32Frames(const UInt8 *src, unsigned int numChannels, unsigned int numFrames,
+												 Float32 *dst, unsigned int planeStride)
+{
+	const unsigned int channels = kChannels ? kChannels : numChannels;
+	const unsigned int frameSize = 3*channels;
+	unsigned int frame = 0;
+	unsigned int vectorChannels = 0;
+	
+#if defined(__SSSE3__)
+	// Big-endian 24 bit samples into the high 24 bits of 32 bit lanes
+	const __m128i expand = _mm_setr_epi8(-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9);
+	const __m128 vscale = (const __m128) { kTwoToMinus31, kTwoToMinus31, kTwoToMinus31, kTwoToMinus31 };
+	
+	vectorChannels = channels & ~3;
+	for (; frame+4 <= numFrames; frame += 4) {
+		const UInt8 *in = src + frame*frameSize;
+		for (unsigned int channel = 0; channel < vectorChannels; channel += 4) {
+			__m128i r0 = _mm_shuffle_epi8(Load12(in + 3*channel), expand);
+			__m128i r1 = _mm_shuffle_epi8(Load12(in + frameSize + 3*channel), expand);
+			__m128i r2 = _mm_shuffle_epi8(Load12(in + 2*frameSize + 3*channel), expand);
+			__m128i r3 = _mm_shuffle_epi8(Load12(in + 3*frameSize + 3*channel), expand);
+			Transpose4x4(r0, r1, r2, r3);
+			
+			Float32 *out = dst + channel*planeStride + frame;
+			_mm_storeu_ps(out, _mm_mul_ps(_mm_cvtepi32_ps(r0), vscale));
+			_mm_storeu_ps(out + planeStride, _mm_mul_ps(_mm_cvtepi32_ps(r1), vscale));
+			_mm_storeu_ps(out + 2*planeStride, _mm_mul_ps(_mm_cvtepi32_ps(r2), vscale));
+			_mm_storeu_ps(out + 3*planeStride, _mm_mul_ps(_mm_cvtepi32_ps(r3), vscale));
+		}
+	}
+#endif
+	
+	for (unsigned int channel = 0; channel < channels; channel++) {
+		// The vector code did the first frames of its channels
+		for (unsigned int i = (channel < vectorChannels) ? frame : 0; i < numFrames; i++) {
+			const UInt8 *in = src + i*frameSize + 3*channel;
+			SInt32 value = (SInt32)(((UInt32)in[0] << 24) | ((UInt32)in[1] << 16) | ((UInt32)in[2] << 8));
+			dst[channel*planeStride + i] = (Float32)value * kTwoToMinus31;
+		}
+	}
+}
+
+template <unsigned int kChannels>
+static void InterleaveFloat32ToSwapInt24Frames(const Float32 *src, unsigned int planeStride, unsigned int numChannels,
+											   unsigned int numFrames, UInt8 *dst)
+{
+	const unsigned int channels = kChannels ? kChannels : numChannels;
+	const unsigned int frameSize = 3*channels;
+	unsigned int frame = 0;
+	unsigned int vectorChannels = 0;
+	
+#if defined(__SSSE3__)
+	ROUNDMODE_NEG_INF
+	const __m128 vround = (const __m128) { 0.5f, 0.5f, 0.5f, 0.5f };
+	const __m128 vmin = (const __m128) { -2147483648.0f, -2147483648.0f, -2147483648.0f, -2147483648.0f };
+	const __m128 vmax = (const __m128) { kMaxFloat32, kMaxFloat32, kMaxFloat32, kMaxFloat32  };
+	const __m128 vscale = (const __m128) { 2147483648.0f, 2147483648.0f, 2147483648.0f, 2147483648.0f  };
+	// The high 24 bits of 32 bit lanes into big-endian 24 bit samples
+	const __m128i compress = _mm_setr_epi8(3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1);
+	__m128 vf0, vf1, vf2, vf3;
+	__m128i vi0, vi1, vi2, vi3;
+	
+	vectorChannels = channels & ~3;
+	for (; frame+4 <= numFrames; frame += 4) {
+		UInt8 *out = dst + frame*frameSize;
+		for (unsigned int channel = 0; channel < vectorChannels; channel += 4) {
+			const Float32 *in = src + channel*planeStride + frame;
+			vf0 = _mm_loadu_ps(in);
+			vf1 = _mm_loadu_ps(in + planeStride);
+			vf2 = _mm_loadu_ps(in + 2*planeStride);
+			vf3 = _mm_loadu_ps(in + 3*planeStride);
+			F32TOLE32(0)
+			F32TOLE32(1)
+			F32TOLE32(2)
+			F32TOLE32(3)
+			Transpose4x4(vi0, vi1, vi2, vi3);
+			
+			Store12(out + 3*channel, _mm_shuffle_epi8(vi0, compress));
+			Store12(out + frameSize + 3*channel, _mm_shuffle_epi8(vi1, compress));
+			Store12(out + 2*frameSize + 3*channel, _mm_shuffle_epi8(vi2, compress));
+			Store12(out + 3*frameSize + 3*channel, _mm_shuffle_epi8(vi3, compress));
+		}
+	}
+	RESTORE_ROUNDMODE
+#endif
+	
+	for (unsigned int channel = 0; channel < channels; channel++) {
+		for (unsigned int i = (channel < vectorChannels) ? frame : 0; i < numFrames; i++) {
+			SInt32 value = Float32ToInt32Bits(src[channel*planeStride + i]);
+			UInt8 *out = dst + i*frameSize + 3*channel;
+			out[0] = (UInt8)(value >> 24);
+			out[1] = (UInt8)(value >> 16);
+			out[2] = (UInt8)(value >> 8);
+		}
+	}
+}
+
+#define TRANSPOSE_DISPATCH(function, args) \
+	switch (numChannels) { \
+		case 8:  function<8> args; break; \
+		case 16: function<16> args; break; \
+		case 24: function<24> args; break; \
+		case 32: function<32> args; break; \
+		case 40: function<40> args; break; \
+		default: function<0> args; break; \
+	}
+
+void DeinterleaveInt24_X86( const UInt8 *src, unsigned int numChannels, unsigned int numFrames, UInt8 *dst, unsigned int planeStride )
+{
+	TRANSPOSE_DISPATCH(DeinterleaveInt24Frames, (src, numChannels, numFrames, dst, planeStride))
+}
+
+void InterleaveInt24_X86( const UInt8 *src, unsigned int planeStride, unsigned int numChannels, unsigned int numFrames, UInt8 *dst )
+{
+	TRANSPOSE_DISPATCH(InterleaveInt24Frames, (src, planeStride, numChannels, numFrames, dst))
+}
+
+void DeinterleaveSwapInt24ToFloat32_X86( const UInt8 *src, unsigned int numChannels, unsigned int numFrames, Float32 *dst, unsigned int planeStride )
+{
+	TRANSPOSE_DISPATCH(DeinterleaveSwapInt24ToFloat32Frames, (src, numChannels, numFrames, dst, planeStride))
+}
+
+void InterleaveFloat32ToSwapInt24_X86( const Float32 *src, unsigned int planeStride, unsigned int numChannels, unsigned int numFrames, UInt8 *dst )
+{
+	TRANSPOSE_DISPATCH(InterleaveFloat32ToSwapInt24Frames, (src, planeStride, numChannels, numFrames, dst))
+}
+
+// ____________________________________________________________________________
+#pragma mark -
+
 class FloatToIntBlitter {
 public:
 	FloatToIntBlitter(int bitDepth)
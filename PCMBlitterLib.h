@@ -78,6 +78,12 @@ void Float32ToSwapInt32_X86( const Float32 *src, SInt32 *dst, unsigned int numTo
 void Float32ToNativeInt24_X86( const Float32 *src, UInt8 *dst, unsigned int numToConvert );
 void Float32ToSwapInt24_X86( const Float32 *src, UInt8 *dst, unsigned int numToConvert );
 
+// Interleaved <-> planar transposes. Plane c starts planeStride samples after plane c-1.
+void DeinterleaveInt24_X86( const UInt8 *src, unsigned int numChannels, unsigned int numFrames, UInt8 *dst, unsigned int planeStride );
+void InterleaveInt24_X86( const UInt8 *src, unsigned int planeStride, unsigned int numChannels, unsigned int numFrames, UInt8 *dst );
+void DeinterleaveSwapInt24ToFloat32_X86( const UInt8 *src, unsigned int numChannels, unsigned int numFrames, Float32 *dst, unsigned int planeStride );
+void InterleaveFloat32ToSwapInt24_X86( const Float32 *src, unsigned int planeStride, unsigned int numChannels, unsigned int numFrames, UInt8 *dst );
+
 #define NativeInt16ToFloat32 NativeInt16ToFloat32_X86
 #define SwapInt16ToFloat32 SwapInt16ToFloat32_X86
 #define NativeInt24ToFloat32 NativeInt24ToFloat32_X86
@@ -92,6 +98,11 @@ void Float32ToSwapInt24_X86( const Float32 *src, UInt8 *dst, unsigned int numToC
 #define Float32ToNativeInt24 Float32ToNativeInt24_X86
 #define Float32ToSwapInt24 Float32ToSwapInt24_X86
 
+#define DeinterleaveInt24 DeinterleaveInt24_X86
+#define InterleaveInt24 InterleaveInt24_X86
+#define DeinterleaveSwapInt24ToFloat32 DeinterleaveSwapInt24ToFloat32_X86
+#define InterleaveFloat32ToSwapInt24 InterleaveFloat32ToSwapInt24_X86
+
 void	Float32ToUInt8(const Float32 *src, UInt8 *dest, unsigned int count);
 void	Float32ToSInt8(const Float32 *src, SInt8 *dest, unsigned int count);
 void	UInt8ToFloat32(const UInt8 *src, Float32 *dest, unsigned int count);
@@ -81,4 +81,14 @@ void	PCMBlitterLibTest()
 		Float32ToNativeInt32(src, (SInt32 *)dest, nframes);
 		Float32ToSwapInt32(src, (SInt32 *)dest, nframes);
 	}
+	{
+		UInt8 *src = 0;
+		UInt8 *dest = 0;
+		Float32 *planes = 0;
+		
+		DeinterleaveInt24(src, 2, nframes, dest, nframes);
+		InterleaveInt24(src, nframes, 2, nframes, dest);
+		DeinterleaveSwapInt24ToFloat32(src, 2, nframes, planes, nframes);
+		InterleaveFloat32ToSwapInt24(planes, nframes, 2, nframes, dest);
+	}
 }
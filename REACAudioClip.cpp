@@ -27,8 +27,106 @@
 #include "REACAudioEngine.h"
 
 #include <IOKit/IOLib.h>
+#include <libkern/OSAtomic.h>
 
 #include "PCMBlitterLib.h"
+#include "REACSampleKernels.h"
+
+static inline float controlValueToGain(SInt32 value, SInt32 maxValue, SInt32 minDB, SInt32 maxDB) {
+    if (value <= 0 && minDB < 0) {
+        return 0.0f; // The lowest setting of a volume control mutes the channel
+    }
+    const float decibels = ((float)minDB + (float)(maxDB-minDB)*value/maxValue)/65536.0f;
+    return REACDecibelsToGain(decibels);
+}
+
+static inline bool isUnityGain(const float *gains, const float *targetGains, UInt32 numChannels) {
+    for (UInt32 i=0; i<numChannels; i++) {
+        if (1.0f != gains[i] || 1.0f != targetGains[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+UInt32 REACAudioEngine::getControlGains(bool output, UInt32 firstChannelID, UInt32 numChannels, float *gains) {
+    UInt32 generation;
+    
+    do {
+        generation = controlParamsGeneration;
+        OSMemoryBarrier();
+        const ControlParams *params = &controlParams[activeControlParams];
+        
+        const SInt32 *values = output ? params->volume : params->gain;
+        const SInt32 *mutes = output ? params->muteOut : params->muteIn;
+        const SInt32 maxValue = output ? kVolumeMax : kGainMax;
+        const SInt32 minDB = output ? kVolumeMinDB : kGainMinDB;
+        const SInt32 maxDB = output ? kVolumeMaxDB : kGainMaxDB;
+        const float master = mutes[0] ? 0.0f : controlValueToGain(values[0], maxValue, minDB, maxDB);
+        
+        for (UInt32 i=0; i<numChannels; i++) {
+            const UInt32 id = firstChannelID+i;
+            if (id >= REAC_NUM_CONTROL_CHANNELS) {
+                // Only the master control applies to channels that have no controls of their own
+                gains[i] = master;
+            }
+            else if (mutes[0] || mutes[id]) {
+                gains[i] = 0.0f;
+            }
+            else if (output) {
+                // The master volume attenuates on top of the channel volumes
+                gains[i] = master*controlValueToGain(values[id], maxValue, minDB, maxDB);
+            }
+            else {
+                // The input gains boost, so the master gain isn't a trim of the
+                // channel gains; multiplying them would double the range.
+                gains[i] = controlValueToGain(values[id], maxValue, minDB, maxDB);
+            }
+        }
+        
+        OSMemoryBarrier();
+    } while (generation != controlParamsGeneration);
+    
+    return generation;
+}
+
+bool REACAudioEngine::hasUnityControlGains() {
+    float gains[REAC_MAX_CHANNEL_COUNT];
+    
+    for (int output=0; output<2; output++) {
+        getControlGains(output, 1, REAC_MAX_CHANNEL_COUNT, gains);
+        for (UInt32 i=0; i<REAC_MAX_CHANNEL_COUNT; i++) {
+            if (1.0f != gains[i]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+const float *REACAudioEngine::streamGainRamp(Source *source, IOAudioStream *audioStream, UInt32 firstSampleFrame,
+                                             UInt32 numChannels, float *rampStart) {
+    const bool output = (kIOAudioStreamDirectionOutput == audioStream->getDirection());
+    const UInt32 firstChannelID = audioStream->getStartingChannelID();
+    const UInt32 offset = firstChannelID-(output ? source->firstOutChannelID : source->firstInChannelID);
+    float *gains = (output ? source->outGains : source->inGains)+offset;
+    float *start = (output ? source->outRampGains : source->inRampGains)+offset;
+    UInt32 *frame = (output ? source->outGainsFrame : source->inGainsFrame)+offset;
+    UInt32 *generation = (output ? source->outGainsGeneration : source->inGainsGeneration)+offset;
+    
+    if (firstSampleFrame != *frame) {
+        // A new HAL cycle. The ramp of the last one is done.
+        *frame = firstSampleFrame;
+        memcpy(start, gains, numChannels*sizeof(float));
+        if (controlParamsGeneration != *generation) {
+            *generation = getControlGains(output, firstChannelID, numChannels, gains);
+        }
+    }
+    
+    // The kernels move the gains they are given, so they get a copy
+    memcpy(rampStart, start, numChannels*sizeof(float));
+    return gains;
+}
 
 // The function clipOutputSamples() is called to clip and convert samples from the float mix buffer into the actual
 // hardware sample buffer.  The samples to be clipped, are guaranteed not to wrap from the end of the buffer to the
@@ -43,8 +141,10 @@
 //		numSampleFrames - the total number of sample frames to clip and convert
 //		streamFormat - the current format of the IOAudioStream this function is operating on
 //		audioStream - the audio stream this function is operating on
-IOReturn REACAudioEngine::clipOutputSamples(const void* inMixBuffer, void* destBuf, UInt32 firstSampleFrame, UInt32 numSampleFrames, const IOAudioStreamFormat* streamFormat, IOAudioStream* /*audioStream*/)
+IOReturn REACAudioEngine::clipOutputSamples(const void* inMixBuffer, void* destBuf, UInt32 firstSampleFrame, UInt32 numSampleFrames, const IOAudioStreamFormat* streamFormat, IOAudioStream* audioStream)
 {
+    Source *source = sourceForStream(audioStream);
+    
 	//	figure out what sort of blit we need to do
 	if((streamFormat->fSampleFormat == kIOAudioStreamSampleFormatLinearPCM) && streamFormat->fIsMixable)
 	{
@@ -85,6 +185,20 @@ IOReturn REACAudioEngine::clipOutputSamples(const void* inMixBuffer, void* destB
 				case 24:
                 {
                     UInt8* theTargetBuffer = (UInt8*)destBuf;
+                    float gains[REAC_MAX_CHANNEL_COUNT];
+                    
+                    if (!nativeEndianInts && NULL != source && streamFormat->fNumChannels <= REAC_MAX_CHANNEL_COUNT) {
+                        const float *targetGains = streamGainRamp(source, audioStream, firstSampleFrame,
+                                                                  streamFormat->fNumChannels, gains);
+                        if (!isUnityGain(gains, targetGains, streamFormat->fNumChannels)) {
+                            // Scale, ramp and convert in one pass
+                            REACFloat32ToInt24WithGain(&(theMixBuffer[theFirstSample]), &(theTargetBuffer[3*theFirstSample]),
+                                                       streamFormat->fNumChannels, numSampleFrames,
+                                                       gains, targetGains);
+                            break;
+                        }
+                    }
+                    
                     if (nativeEndianInts)
                         Float32ToNativeInt24(&(theMixBuffer[theFirstSample]), &(theTargetBuffer[3*theFirstSample]), theNumberSamples);
                     else
@@ -160,14 +274,21 @@ IOReturn REACAudioEngine::clipOutputSamples(const void* inMixBuffer, void* destB
 //		audioStream - the audio stream this function is operating on
 IOReturn REACAudioEngine::convertInputSamples(const void* sampleBuf, void* destBuf, UInt32 firstSampleFrame,
                                               UInt32 numSampleFrames, const IOAudioStreamFormat* streamFormat,
-                                              IOAudioStream* /*audioStream*/) {
-    { // Check if we'll have an audio drop out, and log if that's the case.
-        const int numChannels = inputStream->format.fNumChannels;
-        const int resolution = inputStream->format.fBitWidth/8;
+                                              IOAudioStream* audioStream) {
+    Source *source = sourceForStream(audioStream);
+    REAC_STAGE_DECLARE(convertStart);
+    
+    REAC_STAGE_BEGIN(convertStart);
+    
+    if (NULL != source) { // Check if we'll have an audio drop out, and log if that's the case.
+        const int numChannels = streamFormat->fNumChannels;
+        const int resolution = streamFormat->fBitWidth/8;
         const int bytesPerSample = resolution * numChannels;
         
         // This is the place in the buffer where we're currently receiving data from the network
-        UInt8 *inBufferPosition = (UInt8 *)mInBuffer + currentBlock*blockSize*bytesPerSample;
+        // (sampleBuf is the buffer of this stream, which is one of the channels when planar)
+        const UInt32 inBufferFrame = blockFrame(&rates[activeRate], source->currentBlock);
+        UInt8 *inBufferPosition = (UInt8 *)sampleBuf + inBufferFrame*bytesPerSample;
         // Pointers to where we'll begin and stop writing
         UInt8 *bufferBeginWritePosition = ((UInt8 *)sampleBuf) + firstSampleFrame*bytesPerSample;
         UInt8 *bufferStopWritePosition = bufferBeginWritePosition + numSampleFrames*bytesPerSample;
@@ -175,7 +296,7 @@ IOReturn REACAudioEngine::convertInputSamples(const void* sampleBuf, void* destB
         // Check if we're going to cross inBufferPosition (this leads to audio dropouts)
         if (inBufferPosition >= bufferBeginWritePosition && inBufferPosition < bufferStopWritePosition) {
             IOLog("REACAudioEngine::convertInputSamples(): Audio drop-out! (by %d samples, when converting %d samples)\n",
-                  (int) (firstSampleFrame+numSampleFrames - currentBlock*blockSize), (int) numSampleFrames);
+                  (int) (firstSampleFrame+numSampleFrames - inBufferFrame), (int) numSampleFrames);
         }
     }
     
@@ -184,8 +305,8 @@ IOReturn REACAudioEngine::convertInputSamples(const void* sampleBuf, void* destB
 	{
 		//	it's linear PCM, which means the target is Float32 and we will be calling a blitter, which works in samples not frames
 		Float32* theTargetBuffer = (Float32*)destBuf;
-        const UInt32 theFirstSample = firstSampleFrame * inputStream->format.fNumChannels;
-        const UInt32 theNumberSamples = numSampleFrames * inputStream->format.fNumChannels;
+        const UInt32 theFirstSample = firstSampleFrame * streamFormat->fNumChannels;
+        const UInt32 theNumberSamples = numSampleFrames * streamFormat->fNumChannels;
         
 		if(streamFormat->fNumericRepresentation == kIOAudioStreamNumericRepresentationSignedInt)
 		{
@@ -219,6 +340,20 @@ IOReturn REACAudioEngine::convertInputSamples(const void* sampleBuf, void* destB
 				case 24:
                 {
                     UInt8* theSourceBuffer = (UInt8*)sampleBuf;
+                    float gains[REAC_MAX_CHANNEL_COUNT];
+                    
+                    if (!nativeEndianInts && NULL != source && streamFormat->fNumChannels <= REAC_MAX_CHANNEL_COUNT) {
+                        const float *targetGains = streamGainRamp(source, audioStream, firstSampleFrame,
+                                                                  streamFormat->fNumChannels, gains);
+                        if (!isUnityGain(gains, targetGains, streamFormat->fNumChannels)) {
+                            // Convert, scale and ramp in one pass
+                            REACInt24ToFloat32WithGain(&(theSourceBuffer[3*theFirstSample]), theTargetBuffer,
+                                                       streamFormat->fNumChannels, numSampleFrames,
+                                                       gains, targetGains);
+                            break;
+                        }
+                    }
+                    
                     if (nativeEndianInts)
                         NativeInt24ToFloat32(&(theSourceBuffer[3*theFirstSample]), theTargetBuffer, theNumberSamples);
                     else
@@ -273,5 +408,6 @@ IOReturn REACAudioEngine::convertInputSamples(const void* sampleBuf, void* destB
 		memcpy(destBuf, &(theSourceBuffer[theFirstByte]), theNumberBytes);
 	}
     
+    REAC_STAGE_END(stageProfile, REAC_STAGE_CONVERT, convertStart);
 	return kIOReturnSuccess;
 }
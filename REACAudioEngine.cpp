@@ -31,12 +31,14 @@
 #include <IOKit/audio/IOAudioDefines.h>
 #include <IOKit/IOLib.h>
 #include <IOKit/IOWorkLoop.h>
+#include <libkern/OSAtomic.h>
+#include <mach/vm_param.h>
 
 #include "REACConnection.h"
 
 // The number of packets to reserve as buffer internally in the driver. Increasing
 // this number by one increases the latency by 
-// REAC_SAMPLES_PER_PACKET/REAC_SAMPLE_RATE seconds, which is 0.125ms on 96kHz.
+// 1/REAC_PACKETS_PER_SECOND seconds, which is 0.125ms.
 // 
 // This number determines how resilient the driver should be wrt uneven timing on
 // the input network packets: Delays in incoming packets or in the networking stack
@@ -60,19 +62,49 @@ OSDefineMetaClassAndStructors(REACAudioEngine, super)
 
 const SInt32 REACAudioEngine::kVolumeMax = 65535;
 const SInt32 REACAudioEngine::kGainMax = 65535;
+const SInt32 REACAudioEngine::kVolumeMinDB = (-72 << 16) + (32768);
+const SInt32 REACAudioEngine::kVolumeMaxDB = 0;
+const SInt32 REACAudioEngine::kGainMinDB = 0;
+const SInt32 REACAudioEngine::kGainMaxDB = (72 << 16) + (32768);
 
 
-bool REACAudioEngine::init(REACConnection* proto, OSDictionary *properties) {
+bool REACAudioEngine::init(OSArray *protocols, OSDictionary *properties) {
     bool result = false;
     OSNumber *number = NULL;
+    OSArray *alignmentOffsets = NULL;
     
     // IOLog("REACAudioEngine[%p]::init()\n", this);
     
-    if (NULL == proto) {
+    numSources = 0;
+    clockSource = 0;
+    numRates = 0;
+    activeRate = 0;
+#ifdef REAC_STAGE_PROFILING
+    stageProfile.reset();
+#endif
+    if (NULL == protocols || 0 == protocols->getCount() || protocols->getCount() > REAC_MAX_ENGINE_SOURCES) {
         goto Done;
     }
-    protocol = proto;
-    protocol->retain();
+    
+    for (UInt32 i=0; i<protocols->getCount(); i++) {
+        REACConnection *proto = OSDynamicCast(REACConnection, protocols->getObject(i));
+        if (NULL == proto) {
+            goto Done;
+        }
+        
+        memset(&sources[numSources], 0, sizeof(sources[numSources]));
+        sources[numSources].protocol = proto;
+        // Unity until the first HAL cycle picks up the control values
+        for (UInt32 j=0; j<REAC_MAX_CHANNEL_COUNT; j++) {
+            sources[numSources].inGains[j] = sources[numSources].outGains[j] = 1.0f;
+            sources[numSources].inRampGains[j] = sources[numSources].outRampGains[j] = 1.0f;
+            sources[numSources].inGainsFrame[j] = sources[numSources].outGainsFrame[j] = (UInt32)-1;
+            // controlParamsGeneration starts at 0
+            sources[numSources].inGainsGeneration[j] = sources[numSources].outGainsGeneration[j] = (UInt32)-1;
+        }
+        proto->retain();
+        numSources++;
+    }
 
     if (!super::init(properties)) {
         goto Done;
@@ -84,14 +116,51 @@ bool REACAudioEngine::init(REACConnection* proto, OSDictionary *properties) {
     number = OSDynamicCast(OSNumber, getProperty(NUM_BLOCKS_KEY));
     numBlocks = (number ? number->unsigned32BitValue() : NUM_BLOCKS_DEFAULT);
     
+    // The connections keep the geometry that the engine is made for
+    blockSize = sources[0].protocol->freezeGeometry();
+    for (UInt32 i=1; i<numSources; i++) {
+        if (sources[i].protocol->freezeGeometry() != blockSize) {
+            IOLog("REACAudioEngine::init(): The connections have different numbers of samples per packet.\n");
+            goto Done;
+        }
+        if (sources[i].protocol->getWorkLoop() != sources[0].protocol->getWorkLoop()) {
+            IOLog("REACAudioEngine::init(): The connections of an aggregate engine have to share a WorkLoopGroup.\n");
+            goto Done;
+        }
+    }
     number = OSDynamicCast(OSNumber, getProperty(BLOCK_SIZE_KEY));
-    blockSize = (number ? number->unsigned32BitValue() : REAC_SAMPLES_PER_PACKET);
+    if (NULL != number && number->unsigned32BitValue() != blockSize) {
+        IOLog("REACAudioEngine::init(): BlockSize %d doesn't match the %d samples per packet of the stream.\n",
+              (int)number->unsigned32BitValue(), (int)blockSize);
+        goto Done;
+    }
+    reacSampleRate = REAC_PACKETS_PER_SECOND*blockSize;
     
     number = OSDynamicCast(OSNumber, getProperty(BUFFER_OFFSET_FACTOR_KEY));
     bufferOffsetFactor = (number ? number->unsigned32BitValue() : BUFFER_OFFSET_FACTOR_DEFAULT);
     
-    mInBuffer = mOutBuffer = NULL;
-    inputStream = outputStream = NULL;
+    if (!initSampleRates()) {
+        goto Done;
+    }
+    
+    planar = (kOSBooleanTrue == getProperty(PLANAR_KEY));
+    
+    alignmentOffsets = OSDynamicCast(OSArray, getProperty(ALIGNMENT_OFFSETS_KEY));
+    for (UInt32 i=0; i<numSources; i++) {
+        number = (NULL != alignmentOffsets) ? OSDynamicCast(OSNumber, alignmentOffsets->getObject(i)) : NULL;
+        sources[i].alignmentOffset = (number ? (SInt32)number->unsigned32BitValue() : 0);
+    }
+    
+    for (UInt32 i=0; i<numSources; i++) {
+        sources[i].meterMemory = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                                       sizeof(REACMeterSnapshot), PAGE_SIZE);
+        if (NULL == sources[i].meterMemory) {
+            goto Done;
+        }
+        sources[i].meterSnapshot = (REACMeterSnapshot *)sources[i].meterMemory->getBytesNoCopy();
+        memset(sources[i].meterSnapshot, 0, sizeof(REACMeterSnapshot));
+    }
+    
     duringHardwareInit = FALSE;
     mLastValidSampleFrame = 0;
     result = true;
@@ -128,17 +197,21 @@ bool REACAudioEngine::initHardware(IOService *provider) {
         goto Done;
     }
     
+    if (!initRoutes() || !initPatches()) {
+        goto Done;
+    }
+    
     desc = OSDynamicCast(OSString, getProperty(DESCRIPTION_KEY));
     if (desc) {
         setDescription(desc->getCStringNoCopy());
     }
     
     setSampleRate(&initialSampleRate);
-    setSampleOffset(blockSize*bufferOffsetFactor);
+    setSampleOffset(blockFrame(&rates[activeRate], bufferOffsetFactor));
     setClockIsStable(FALSE);
     
     // Set the number of sample frames in each buffer
-    setNumSampleFramesPerBuffer(blockSize * numBlocks);
+    setNumSampleFramesPerBuffer(blockFrame(&rates[activeRate], numBlocks));
     
     wl = getWorkLoop();
     if (!wl) {
@@ -156,94 +229,95 @@ Done:
 bool REACAudioEngine::createAudioStreams(IOAudioSampleRate *sampleRate) {
     bool            result = false;
     
-    UInt32              numInChannels  = protocol->getDeviceInfo()->in_channels;
-    UInt32              numOutChannels = protocol->getDeviceInfo()->out_channels;
     UInt32              bufferSizePerChannel;
+    UInt32              startingInChannelID = 1;
+    UInt32              startingOutChannelID = 1;
     OSDictionary       *inFormatDict;
     OSDictionary       *outFormatDict;
     
-    IOAudioStreamFormat inFormat;
-    IOAudioStreamFormat outFormat;
-    
-    sampleRate->whole = REAC_SAMPLE_RATE;
+    sampleRate->whole = reacSampleRate;
     sampleRate->fraction = 0;
     
-    inputStream = new IOAudioStream;
-    outputStream = new IOAudioStream;
-    if (NULL == inputStream || NULL == outputStream) {
-        IOLog("REAC: Could not create IOAudioStreams\n");
-        goto Error;
-    }
-        
-    if (!inputStream->initWithAudioEngine(this, kIOAudioStreamDirectionInput, 1 /* Starting channel ID */, "REAC Input Stream") ||
-        !outputStream->initWithAudioEngine(this, kIOAudioStreamDirectionOutput, 1 /* Starting channel ID */, "REAC Output Stream")) {
-        IOLog("REAC: Could not init one of the streams with audio engine. \n");
-        goto Error;
-    }
-    
     inFormatDict = OSDynamicCast(OSDictionary, getProperty(IN_FORMAT_KEY));
     outFormatDict = OSDynamicCast(OSDictionary, getProperty(OUT_FORMAT_KEY));
     if (NULL == inFormatDict || NULL == outFormatDict) {
         IOLog("REAC: inFormatDict or outFormatDict is NULL\n");
-        goto Error;
-    }
-    
-    if (IOAudioStream::createFormatFromDictionary(inFormatDict, &inFormat) == NULL ||
-        IOAudioStream::createFormatFromDictionary(outFormatDict, &outFormat) == NULL) {
-        IOLog("REAC: Error in createFormatFromDictionary()\n");
-        goto Error;
+        goto Done;
     }
     
-    inFormat.fNumChannels = numInChannels;
-    outFormat.fNumChannels = numOutChannels;
-    
-    inFormat.fBitDepth = REAC_RESOLUTION * 8;
-    outFormat.fBitDepth = REAC_RESOLUTION * 8;
-    
-    inputStream->addAvailableFormat(&inFormat, sampleRate, sampleRate);
-    outputStream->addAvailableFormat(&outFormat, sampleRate, sampleRate);
-    
-    inputStream->setFormat(&inFormat);
-    outputStream->setFormat(&outFormat);
-    
     bufferSizePerChannel = blockSize * numBlocks * REAC_RESOLUTION;
-    mInBufferSize = bufferSizePerChannel * numInChannels;
-    mOutBufferSize = bufferSizePerChannel * numOutChannels;
     
-    if (mInBuffer == NULL) {
-        mInBuffer = (void *)IOMalloc(mInBufferSize);
-        if (NULL == mInBuffer) {
-            IOLog("REAC: Error allocating input buffer - %d bytes.\n", (int) mInBufferSize);
-            goto Error;
+    for (UInt32 i=0; i<numSources; i++) {
+        Source         *source = &sources[i];
+        UInt32          numInChannels  = source->protocol->getDeviceInfo()->in_channels;
+        UInt32          numOutChannels = source->protocol->getDeviceInfo()->out_channels;
+        
+        source->numInChannels = numInChannels;
+        source->numOutChannels = numOutChannels;
+        source->firstInChannelID = startingInChannelID;
+        source->firstOutChannelID = startingOutChannelID;
+        source->planeSize = planar ? bufferSizePerChannel : 0;
+        source->inBufferSize = bufferSizePerChannel * numInChannels;
+        source->outBufferSize = bufferSizePerChannel * numOutChannels;
+        
+        if (source->inBuffer == NULL) {
+            source->inBuffer = (void *)IOMalloc(source->inBufferSize);
+            if (NULL == source->inBuffer) {
+                IOLog("REAC: Error allocating input buffer - %d bytes.\n", (int) source->inBufferSize);
+                goto Done;
+            }
         }
-    }
-    
-    if (mOutBuffer == NULL) {
-        mOutBuffer = (void *)IOMalloc(mOutBufferSize);
-        if (NULL == mOutBuffer) {
-            IOLog("REAC: Error allocating output buffer - %lu bytes.\n", (unsigned long)mOutBufferSize);
-            goto Error;
+        
+        if (source->outBuffer == NULL) {
+            source->outBuffer = (void *)IOMalloc(source->outBufferSize);
+            if (NULL == source->outBuffer) {
+                IOLog("REAC: Error allocating output buffer - %lu bytes.\n", (unsigned long)source->outBufferSize);
+                goto Done;
+            }
+        }
+        
+        // The output packet is also where routes and patches are applied, so that
+        // they never write to the engine buffer
+        if (NULL == source->outPacket) {
+            source->outPacketSize = blockSize*REAC_RESOLUTION*numOutChannels;
+            source->outPacket = (UInt8 *)IOMalloc(source->outPacketSize);
+            if (NULL == source->outPacket) {
+                IOLog("REAC: Error allocating packet buffers.\n");
+                goto Done;
+            }
+            memset(source->outPacket, 0, source->outPacketSize);
         }
+        
+        if ((numRates > 1 || planar) && NULL == source->inPackets) {
+            source->inPacketSize = blockSize*REAC_RESOLUTION*numInChannels;
+            source->resampleHistorySize = REAC_RESAMPLER_SCRATCH_FRAMES(blockSize)*numInChannels*sizeof(float);
+            source->resampleScratchSize = REAC_RESAMPLER_SCRATCH_FRAMES(blockSize)*numOutChannels*sizeof(float);
+            source->inPackets = (UInt8 *)IOMalloc(2*source->inPacketSize);
+            source->resampleHistory = (float *)IOMalloc(source->resampleHistorySize);
+            source->resampleScratch = (float *)IOMalloc(source->resampleScratchSize);
+            if (NULL == source->inPackets ||
+                NULL == source->resampleHistory || NULL == source->resampleScratch) {
+                IOLog("REAC: Error allocating packet buffers.\n");
+                goto Done;
+            }
+            memset(source->inPackets, 0, 2*source->inPacketSize);
+            memset(source->resampleHistory, 0, source->resampleHistorySize);
+        }
+        
+        source->inputStream = createStreams(kIOAudioStreamDirectionInput, startingInChannelID, numInChannels,
+                                            inFormatDict, (UInt8 *)source->inBuffer, source->inBufferSize);
+        source->outputStream = createStreams(kIOAudioStreamDirectionOutput, startingOutChannelID, numOutChannels,
+                                             outFormatDict, (UInt8 *)source->outBuffer, source->outBufferSize);
+        if (NULL == source->inputStream || NULL == source->outputStream) {
+            IOLog("REACAudioEngine[%p]::createAudioStreams() - ERROR\n", this);
+            goto Done;
+        }
+        
+        startingInChannelID += numInChannels;
+        startingOutChannelID += numOutChannels;
     }
     
-    inputStream->setSampleBuffer(mInBuffer, mInBufferSize);
-    addAudioStream(inputStream);
-    inputStream->release();
-    
-    outputStream->setSampleBuffer(mOutBuffer, mOutBufferSize);       
-    addAudioStream(outputStream);
-    outputStream->release();
-    
     result = true;
-    goto Done;
-
-Error:
-    IOLog("REACAudioEngine[%p]::createAudioStreams() - ERROR\n", this);
-
-    if (inputStream)
-        inputStream->release();
-    if (outputStream)
-        outputStream->release();
     
 Done:
     if (!result)
@@ -251,23 +325,109 @@ Done:
     return result;
 }
 
+IOAudioStream *REACAudioEngine::createStreams(IOAudioStreamDirection direction, UInt32 startingChannelID,
+                                              UInt32 numChannels, OSDictionary *formatDict,
+                                              UInt8 *buffer, UInt32 bufferSize) {
+    const char         *name = (kIOAudioStreamDirectionInput == direction) ? "REAC Input Stream" : "REAC Output Stream";
+    const UInt32        numStreams = planar ? numChannels : 1;
+    const UInt32        streamBufferSize = bufferSize/numStreams;
+    IOAudioStream      *firstStream = NULL;
+    IOAudioStreamFormat format;
+    
+    if (IOAudioStream::createFormatFromDictionary(formatDict, &format) == NULL) {
+        IOLog("REAC: Error in createFormatFromDictionary()\n");
+        return NULL;
+    }
+    format.fNumChannels = numChannels/numStreams;
+    format.fBitDepth = REAC_RESOLUTION * 8;
+    
+    for (UInt32 i=0; i<numStreams; i++) {
+        IOAudioStream *stream = new IOAudioStream;
+        
+        if (NULL == stream) {
+            IOLog("REAC: Could not create IOAudioStreams\n");
+            return NULL;
+        }
+        
+        if (!stream->initWithAudioEngine(this, direction, startingChannelID+i, name)) {
+            IOLog("REAC: Could not init one of the streams with audio engine. \n");
+            stream->release();
+            return NULL;
+        }
+        
+        for (UInt32 j=0; j<numRates; j++) {
+            IOAudioSampleRate rate;
+            rate.whole = rates[j].sampleRate;
+            rate.fraction = 0;
+            stream->addAvailableFormat(&format, &rate, &rate);
+        }
+        stream->setFormat(&format);
+        
+        stream->setSampleBuffer(buffer+i*streamBufferSize, streamBufferSize);
+        addAudioStream(stream);
+        stream->release();
+        
+        if (NULL == firstStream) {
+            firstStream = stream;
+        }
+    }
+    
+    return firstStream;
+}
+
  
 void REACAudioEngine::free() {
     //IOLog("REACAudioEngine[%p]::free()\n", this);
     
-    if (NULL != protocol) {
-        protocol->release();
+    for (UInt32 i=0; i<numSources; i++) {
+        Source *source = &sources[i];
+        
+        if (NULL != source->protocol) {
+            source->protocol->release();
+            source->protocol = NULL;
+        }
+        
+        if (NULL != source->inBuffer) {
+            IOFree(source->inBuffer, source->inBufferSize);
+            source->inBuffer = NULL;
+        }
+        if (NULL != source->outBuffer) {
+            IOFree(source->outBuffer, source->outBufferSize);
+            source->outBuffer = NULL;
+        }
+        
+        if (NULL != source->inPackets) {
+            IOFree(source->inPackets, 2*source->inPacketSize);
+            source->inPackets = NULL;
+        }
+        if (NULL != source->outPacket) {
+            IOFree(source->outPacket, source->outPacketSize);
+            source->outPacket = NULL;
+        }
+        if (NULL != source->resampleHistory) {
+            IOFree(source->resampleHistory, source->resampleHistorySize);
+            source->resampleHistory = NULL;
+        }
+        if (NULL != source->resampleScratch) {
+            IOFree(source->resampleScratch, source->resampleScratchSize);
+            source->resampleScratch = NULL;
+        }
+        if (NULL != source->meterMemory) {
+            source->meterMemory->release();
+            source->meterMemory = NULL;
+            source->meterSnapshot = NULL;
+        }
     }
+    numSources = 0;
     
-    if (NULL != mInBuffer) {
-        IOFree(mInBuffer, mInBufferSize);
-        mInBuffer = NULL;
-    }
-    if (NULL != mOutBuffer) {
-        IOFree(mOutBuffer, mOutBufferSize);
-        mOutBuffer = NULL;
+    for (UInt32 i=0; i<numRates; i++) {
+        if (NULL != rates[i].coefficients) {
+            IOFree(rates[i].coefficients, rates[i].coefficientsSize);
+            rates[i].coefficients = NULL;
+        }
     }
-        
+    numRates = 0;
+    
     super::free();
 }
 
@@ -288,6 +448,9 @@ IOReturn REACAudioEngine::performAudioEngineStart() {
     
     takeTimeStamp(false);
     currentBlock = 0;
+    for (UInt32 i=0; i<numSources; i++) {
+        sources[i].aligned = false;
+    }
     
     return kIOReturnSuccess;
 }
@@ -295,6 +458,10 @@ IOReturn REACAudioEngine::performAudioEngineStart() {
 IOReturn REACAudioEngine::performAudioEngineStop() {
     //IOLog("REACAudioEngine[%p]::performAudioEngineStop()\n", this);
     
+#ifdef REAC_STAGE_PROFILING
+    stageProfile.log("REACAudioEngine", this);
+#endif
+    
     return kIOReturnSuccess;
 }
 
@@ -308,7 +475,7 @@ UInt32 REACAudioEngine::getCurrentSampleFrame() {
     // frame returned by this function.  If it is too large a value, sound data that hasn't been played will be 
     // erased.
     
-    return currentBlock * blockSize;
+    return blockFrame(&rates[activeRate], currentBlock);
 }
 
 
@@ -324,48 +491,553 @@ IOReturn REACAudioEngine::performFormatChange(IOAudioStream *audioStream, const
     }
     
     if (NULL != newSampleRate) {
+        UInt32 i;
+        for (i=0; i<numRates; i++) {
+            if (rates[i].sampleRate == newSampleRate->whole) {
+                break;
+            }
+        }
+        if (i == numRates) {
+            return kIOReturnUnsupported;
+        }
+        
+        // The packet path picks up the new rate on its next packet. Until the
+        // engine buffers have filled up with samples of the new rate, there will be
+        // a glitch.
+        activeRate = i;
+        OSMemoryBarrier();
+        setNumSampleFramesPerBuffer(blockFrame(&rates[i], numBlocks));
+        setSampleOffset(blockFrame(&rates[i], bufferOffsetFactor));
     }
     
     return kIOReturnSuccess;
 }
 
-void REACAudioEngine::gotSamples(UInt8 **data, UInt32 *bufferSize) {
-    if (NULL == mInBuffer) {
+void REACAudioEngine::gotSamples(REACConnection *proto, UInt8 **data, UInt32 *bufferSize) {
+    Source *source = sourceForConnection(proto);
+    if (NULL == source || NULL == source->inBuffer) {
         // This should never happen. But better complain than crash the computer I guess
         IOLog("REACAudioEngine::gotSamples(): Internal error.\n");
         return;
     }
     
-    if (inputStream->format.fNumChannels != protocol->getDeviceInfo()->in_channels ||
+    IOAudioStream *inputStream = source->inputStream;
+    if (source->numInChannels != proto->getDeviceInfo()->in_channels ||
         inputStream->format.fBitWidth != REAC_RESOLUTION*8) {
         IOLog("REACAudioEngine::gotSamples(): Invalid input stream format.\n");
         return;
     }
     
-    const int bytesPerSample = inputStream->format.fBitWidth/8 * inputStream->format.fNumChannels;
-    const int bytesPerPacket = bytesPerSample * REAC_SAMPLES_PER_PACKET;
+    const int bytesPerSample = REAC_RESOLUTION * source->numInChannels;
+    const int bytesPerPacket = bytesPerSample * blockSize;
+    const RateParams *rate = &rates[activeRate];
+    const bool direct = (NULL == rate->coefficients && !planar);
     
-    *data = (UInt8 *)mInBuffer + currentBlock*blockSize*bytesPerSample;
+    if (NULL != source->unmeteredInput) {
+        REACMeterInt24(source->unmeteredInput, source->numInChannels, blockSize, source->inMeters);
+        source->inMeterFrames += blockSize;
+        source->latestInput = source->unmeteredInput;
+        if (!direct) {
+            decodeInput(rate, source);
+        }
+    }
+    
+    alignSource(source);
+    if (direct) {
+        *data = (UInt8 *)source->inBuffer + source->currentBlock*blockSize*bytesPerSample;
+    }
+    else {
+        *data = source->inPackets + source->nextInPacket*source->inPacketSize;
+        source->nextInPacket ^= 1;
+        source->pendingInputBlock = source->currentBlock;
+    }
     *bufferSize = bytesPerPacket;
+    source->unmeteredInput = *data;
     
-    if (REACConnection::REAC_MASTER != protocol->getMode()) {
-        incrementBlockCounter();
+    if (REACConnection::REAC_MASTER != proto->getMode()) {
+        incrementSourceBlockCounter(source);
+        countMeterPacket(source);
     }
 }
 
-void REACAudioEngine::getSamples(UInt8 **data, UInt32 *bufferSize) {
-    const int bytesPerSample = outputStream->format.fBitWidth/8 * outputStream->format.fNumChannels;
-    const int bytesPerPacket = bytesPerSample * REAC_SAMPLES_PER_PACKET;
+void REACAudioEngine::getSamples(REACConnection *proto, UInt8 **data, UInt32 *bufferSize) {
+    Source *source = sourceForConnection(proto);
+    if (NULL == source || NULL == source->outBuffer) {
+        IOLog("REACAudioEngine::getSamples(): Internal error.\n");
+        return;
+    }
+    
+    const int bytesPerSample = REAC_RESOLUTION * source->numOutChannels;
+    const int bytesPerPacket = bytesPerSample * blockSize;
+    const RateParams *rate = &rates[activeRate];
 
-    *data = (UInt8 *)mOutBuffer + currentBlock*blockSize*bytesPerSample;
+    alignSource(source);
+    if (NULL == rate->coefficients && !planar) {
+        *data = (UInt8 *)source->outBuffer + source->currentBlock*blockSize*bytesPerSample;
+        
+        // The block stays in the ring until a client overwrites it, which it might
+        // never do, so routes and patches are applied to a copy of it
+        if (0 != numPatchSets || 0 != numRouteSets) {
+            memcpy(source->outPacket, *data, bytesPerPacket);
+            *data = source->outPacket;
+        }
+    }
+    else {
+        encodeOutput(rate, source, source->currentBlock);
+        *data = source->outPacket;
+    }
     *bufferSize = bytesPerPacket;
     
-    if (REACConnection::REAC_MASTER == protocol->getMode()) {
-        incrementBlockCounter();
+    if (0 != numPatchSets) {
+        applyPatches(source, *data);
+    }
+    if (0 != numRouteSets) {
+        mixRoutes(source, *data);
+    }
+    
+    // The output samples are already in place, and about to be copied into the packet
+    REACMeterInt24(*data, source->numOutChannels, blockSize, source->outMeters);
+    source->outMeterFrames += blockSize;
+    
+    if (REACConnection::REAC_MASTER == proto->getMode()) {
+        incrementSourceBlockCounter(source);
+        countMeterPacket(source);
     }
     return;
 }
 
+void REACAudioEngine::connectionChanged(REACConnection *proto, bool connected) {
+    Source *source = sourceForConnection(proto);
+    if (NULL == source) {
+        return;
+    }
+    
+    source->aligned = false;
+    
+    if (!connected && source == &sources[clockSource]) {
+        // Let another connected source drive the clock, if there is one
+        for (UInt32 i=0; i<numSources; i++) {
+            if (sources[i].protocol->isConnected() && !sources[i].protocol->isStalled()) {
+                clockSource = i;
+                sources[i].aligned = false;
+                break;
+            }
+        }
+    }
+}
+
+static UInt32 greatestCommonDivisor(UInt32 a, UInt32 b) {
+    while (0 != b) {
+        const UInt32 remainder = a % b;
+        a = b;
+        b = remainder;
+    }
+    return a;
+}
+
+bool REACAudioEngine::initSampleRates() {
+    OSArray *rateArray = OSDynamicCast(OSArray, getProperty(SAMPLE_RATES_KEY));
+    UInt32   blockMultiple = 1;
+    
+    memset(&rates[0], 0, sizeof(rates[0]));
+    rates[0].sampleRate = reacSampleRate;
+    rates[0].framesPerPeriod = blockSize;
+    rates[0].packetsPerPeriod = 1;
+    numRates = 1;
+    
+    for (UInt32 i=0; NULL != rateArray && i<rateArray->getCount(); i++) {
+        OSNumber *number = OSDynamicCast(OSNumber, rateArray->getObject(i));
+        const UInt32 sampleRate = (NULL != number) ? number->unsigned32BitValue() : 0;
+        
+        bool duplicate = false;
+        for (UInt32 j=0; j<numRates; j++) {
+            duplicate = duplicate || (rates[j].sampleRate == sampleRate);
+        }
+        if (duplicate) {
+            continue;
+        }
+        
+        const UInt32 divisor = (0 != sampleRate) ? greatestCommonDivisor(sampleRate, reacSampleRate) : 1;
+        const UInt32 up = sampleRate/divisor;
+        const UInt32 down = reacSampleRate/divisor;
+        const UInt32 periodDivisor = greatestCommonDivisor(blockSize*up, down);
+        const UInt32 packetsPerPeriod = down/periodDivisor;
+        const UInt32 multiple = blockMultiple/greatestCommonDivisor(blockMultiple, packetsPerPeriod)*packetsPerPeriod;
+        
+        if (0 == sampleRate || sampleRate > reacSampleRate ||
+            up > REAC_MAX_RESAMPLER_FACTOR || down > REAC_MAX_RESAMPLER_FACTOR || multiple > numBlocks/2) {
+            IOLog("REACAudioEngine::initSampleRates(): Unsupported sample rate %u.\n", (unsigned int)sampleRate);
+            continue;
+        }
+        if (numRates >= REAC_MAX_SAMPLE_RATES) {
+            IOLog("REACAudioEngine::initSampleRates(): Too many sample rates.\n");
+            break;
+        }
+        
+        RateParams *rate = &rates[numRates];
+        memset(rate, 0, sizeof(*rate));
+        rate->sampleRate = sampleRate;
+        rate->framesPerPeriod = blockSize*up/periodDivisor;
+        rate->packetsPerPeriod = packetsPerPeriod;
+        rate->coefficientsSize = (up+down)*REAC_RESAMPLER_TAPS*sizeof(float);
+        rate->coefficients = (float *)IOMalloc(rate->coefficientsSize);
+        if (NULL == rate->coefficients) {
+            return false;
+        }
+        REACDesignResampler(&rate->inResampler, rate->coefficients, up, down);
+        REACDesignResampler(&rate->outResampler, rate->coefficients+up*REAC_RESAMPLER_TAPS, down, up);
+        
+        blockMultiple = multiple;
+        numRates++;
+    }
+    
+    if (0 != numBlocks % blockMultiple) {
+        numBlocks -= numBlocks % blockMultiple;
+        IOLog("REACAudioEngine::initSampleRates(): Using %u blocks, to fit the sample rates.\n", (unsigned int)numBlocks);
+    }
+    
+    return true;
+}
+
+UInt32 REACAudioEngine::blockFrame(const RateParams *rate, UInt32 block) const {
+    return (UInt32)(((UInt64)block*rate->framesPerPeriod+rate->packetsPerPeriod-1)/rate->packetsPerPeriod);
+}
+
+void REACAudioEngine::decodeInput(const RateParams *rate, Source *source) {
+    const UInt32 numChannels = source->numInChannels;
+    const UInt32 block = source->pendingInputBlock % numBlocks;
+    // Where sample c of engine frame n is
+    const UInt32 frameStride = planar ? REAC_RESOLUTION : numChannels*REAC_RESOLUTION;
+    const UInt32 channelStride = planar ? source->planeSize : REAC_RESOLUTION;
+    
+    if (NULL == rate->coefficients) {
+        REACDeinterleaveInt24(source->unmeteredInput, numChannels, blockSize,
+                              (UInt8 *)source->inBuffer + block*blockSize*frameStride, source->planeSize);
+        return;
+    }
+    
+    const UInt32 firstFrame = blockFrame(rate, block);
+    const UInt32 numFrames = blockFrame(rate, block+1)-firstFrame;
+    // The position of the first frame, relative to the first sample of the packet
+    const UInt32 position = (UInt32)((UInt64)firstFrame*rate->inResampler.down -
+                                     (UInt64)block*blockSize*rate->inResampler.up);
+    
+    REACResampleInt24(&rate->inResampler, source->unmeteredInput, blockSize, numChannels,
+                      source->resampleHistory, position,
+                      (UInt8 *)source->inBuffer + firstFrame*frameStride, frameStride, channelStride, numFrames);
+}
+
+void REACAudioEngine::encodeOutput(const RateParams *rate, Source *source, UInt32 block) {
+    const UInt32 numChannels = source->numOutChannels;
+    const UInt32 frameStride = planar ? REAC_RESOLUTION : numChannels*REAC_RESOLUTION;
+    const UInt32 channelStride = planar ? source->planeSize : REAC_RESOLUTION;
+    
+    if (NULL == rate->coefficients) {
+        REACInterleaveInt24((const UInt8 *)source->outBuffer + block*blockSize*frameStride, source->planeSize,
+                            numChannels, blockSize, source->outPacket);
+        return;
+    }
+    
+    REACResampleInt24FromRing(&rate->outResampler, (const UInt8 *)source->outBuffer, blockFrame(rate, numBlocks),
+                              frameStride, channelStride, numChannels, source->resampleScratch,
+                              (UInt64)block*blockSize*rate->outResampler.down, source->outPacket, blockSize);
+}
+
+bool REACAudioEngine::sourceChannel(UInt32 channelNumber, bool output, UInt32 *sourceIndex, UInt32 *channel) {
+    if (0 == channelNumber) {
+        return false;
+    }
+    
+    UInt32 first = 1;
+    for (UInt32 i=0; i<numSources; i++) {
+        const UInt32 numChannels = output ? sources[i].numOutChannels : sources[i].numInChannels;
+        
+        if (channelNumber < first+numChannels) {
+            *sourceIndex = i;
+            *channel = channelNumber-first;
+            return true;
+        }
+        first += numChannels;
+    }
+    return false;
+}
+
+bool REACAudioEngine::initRoutes() {
+    OSArray *routeArray = OSDynamicCast(OSArray, getProperty(ROUTES_KEY));
+    UInt32   numRoutes = 0;
+    
+    numRouteSets = 0;
+    if (NULL == routeArray) {
+        return true;
+    }
+    
+    for (UInt32 i=0; i<routeArray->getCount(); i++) {
+        OSDictionary *routeDict = OSDynamicCast(OSDictionary, routeArray->getObject(i));
+        OSNumber     *in = NULL, *out = NULL, *gain = NULL;
+        UInt32        inSource, inChannel, outSource, outChannel;
+        
+        if (NULL != routeDict) {
+            in = OSDynamicCast(OSNumber, routeDict->getObject(ROUTE_IN_KEY));
+            out = OSDynamicCast(OSNumber, routeDict->getObject(ROUTE_OUT_KEY));
+            gain = OSDynamicCast(OSNumber, routeDict->getObject(ROUTE_GAIN_KEY));
+        }
+        if (NULL == in || NULL == out ||
+            !sourceChannel(in->unsigned32BitValue(), false, &inSource, &inChannel) ||
+            !sourceChannel(out->unsigned32BitValue(), true, &outSource, &outChannel)) {
+            IOLog("REACAudioEngine::initRoutes(): Ignoring invalid route %u.\n", (unsigned int)i);
+            continue;
+        }
+        if (numRoutes >= REAC_MAX_ROUTES) {
+            IOLog("REACAudioEngine::initRoutes(): Too many routes.\n");
+            break;
+        }
+        
+        // Insert it in order
+        UInt32 pos = numRoutes;
+        while (pos > 0 &&
+               (outSource < routeSources[pos-1][0] ||
+                (outSource == routeSources[pos-1][0] &&
+                 (inSource < routeSources[pos-1][1] ||
+                  (inSource == routeSources[pos-1][1] && outChannel < routes[pos-1].output))))) {
+            routes[pos] = routes[pos-1];
+            routeSources[pos][0] = routeSources[pos-1][0];
+            routeSources[pos][1] = routeSources[pos-1][1];
+            pos--;
+        }
+        routes[pos].input = inChannel;
+        routes[pos].output = outChannel;
+        REACSetRouteGain(&routes[pos], (NULL != gain) ? (SInt32)gain->unsigned32BitValue() : 0);
+        routeSources[pos][0] = outSource;
+        routeSources[pos][1] = inSource;
+        numRoutes++;
+    }
+    
+    for (UInt32 i=0; i<numRoutes; i++) {
+        RouteSet *set = (0 == numRouteSets) ? NULL : &routeSets[numRouteSets-1];
+        if (NULL == set || set->outSource != routeSources[i][0] || set->inSource != routeSources[i][1]) {
+            set = &routeSets[numRouteSets++];
+            set->outSource = routeSources[i][0];
+            set->inSource = routeSources[i][1];
+            set->firstRoute = i;
+            set->numRoutes = 0;
+        }
+        set->numRoutes++;
+    }
+    
+    return true;
+}
+
+void REACAudioEngine::mixRoutes(Source *source, UInt8 *outBlock) {
+    const UInt32 outSource = source-sources;
+    
+    for (UInt32 i=0; i<numRouteSets; i++) {
+        const RouteSet *set = &routeSets[i];
+        const Source *inSource = &sources[set->inSource];
+        
+        if (set->outSource != outSource || NULL == inSource->latestInput) {
+            continue;
+        }
+        
+        REACMixInt24(inSource->latestInput, inSource->numInChannels,
+                     outBlock, source->numOutChannels, blockSize,
+                     &routes[set->firstRoute], set->numRoutes);
+    }
+}
+
+bool REACAudioEngine::initPatches() {
+    OSArray *patchArray = OSDynamicCast(OSArray, getProperty(PATCHES_KEY));
+    UInt32   numPatches = 0;
+    UInt32   numOps = 0;
+    
+    numPatchSets = 0;
+    if (NULL == patchArray) {
+        return true;
+    }
+    
+    for (UInt32 i=0; i<patchArray->getCount(); i++) {
+        OSDictionary *patchDict = OSDynamicCast(OSDictionary, patchArray->getObject(i));
+        OSNumber     *in = NULL, *out = NULL;
+        UInt32        inSource, inChannel, outSource, outChannel;
+        
+        if (NULL != patchDict) {
+            in = OSDynamicCast(OSNumber, patchDict->getObject(ROUTE_IN_KEY));
+            out = OSDynamicCast(OSNumber, patchDict->getObject(ROUTE_OUT_KEY));
+        }
+        if (NULL == in || NULL == out ||
+            !sourceChannel(in->unsigned32BitValue(), false, &inSource, &inChannel) ||
+            !sourceChannel(out->unsigned32BitValue(), true, &outSource, &outChannel)) {
+            IOLog("REACAudioEngine::initPatches(): Ignoring invalid patch %u.\n", (unsigned int)i);
+            continue;
+        }
+        if (numPatches >= REAC_MAX_PATCHES) {
+            IOLog("REACAudioEngine::initPatches(): Too many patches.\n");
+            break;
+        }
+        
+        // Insert it in order. Patches between the same sources keep their order, so
+        // that the last patch to an output is the one that is used.
+        UInt32 pos = numPatches;
+        while (pos > 0 &&
+               (outSource < patchSources[pos-1][0] ||
+                (outSource == patchSources[pos-1][0] && inSource < patchSources[pos-1][1]))) {
+            patchInputs[pos] = patchInputs[pos-1];
+            patchOutputs[pos] = patchOutputs[pos-1];
+            patchSources[pos][0] = patchSources[pos-1][0];
+            patchSources[pos][1] = patchSources[pos-1][1];
+            pos--;
+        }
+        patchInputs[pos] = inChannel;
+        patchOutputs[pos] = outChannel;
+        patchSources[pos][0] = outSource;
+        patchSources[pos][1] = inSource;
+        numPatches++;
+    }
+    
+    for (UInt32 i=0; i<numPatches; i++) {
+        PatchSet *set = (0 == numPatchSets) ? NULL : &patchSets[numPatchSets-1];
+        if (NULL == set || set->outSource != patchSources[i][0] || set->inSource != patchSources[i][1]) {
+            set = &patchSets[numPatchSets++];
+            set->outSource = patchSources[i][0];
+            set->inSource = patchSources[i][1];
+            set->firstPatch = i;
+            set->numPatches = 0;
+        }
+        set->numPatches++;
+    }
+    
+    for (UInt32 i=0; i<numPatchSets; i++) {
+        PatchSet *set = &patchSets[i];
+        set->firstOp = numOps;
+        set->numOps = REACCompilePatches(&patchInputs[set->firstPatch], &patchOutputs[set->firstPatch], set->numPatches,
+                                         sources[set->inSource].numInChannels,
+                                         sources[set->outSource].numOutChannels,
+                                         &patchOps[numOps], REAC_MAX_PATCH_OPS-numOps);
+        numOps += set->numOps;
+    }
+    
+    return true;
+}
+
+void REACAudioEngine::applyPatches(Source *source, UInt8 *outBlock) {
+    const UInt32 outSource = source-sources;
+    
+    for (UInt32 i=0; i<numPatchSets; i++) {
+        const PatchSet *set = &patchSets[i];
+        const Source *inSource = &sources[set->inSource];
+        
+        if (set->outSource != outSource || NULL == inSource->latestInput) {
+            continue;
+        }
+        
+        if (0 != set->numOps) {
+            REACApplyPatches(inSource->latestInput, inSource->numInChannels,
+                             outBlock, source->numOutChannels, blockSize,
+                             &patchOps[set->firstOp], set->numOps);
+        }
+        else {
+            REACCopyPatches(inSource->latestInput, inSource->numInChannels,
+                            outBlock, source->numOutChannels, blockSize,
+                            &patchInputs[set->firstPatch], &patchOutputs[set->firstPatch], set->numPatches);
+        }
+    }
+}
+
+// Rounds down
+static UInt32 integerSqrt(UInt64 value) {
+    UInt64 result = 0;
+    UInt64 bit = 1ULL << 62;
+    
+    while (bit > value) {
+        bit >>= 2;
+    }
+    while (0 != bit) {
+        if (value >= result+bit) {
+            value -= result+bit;
+            result = (result >> 1)+bit;
+        }
+        else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (UInt32)result;
+}
+
+void REACAudioEngine::countMeterPacket(Source *source) {
+    if (++source->meterPackets >= REAC_METER_INTERVAL) {
+        publishMeters(source);
+    }
+}
+
+void REACAudioEngine::publishMeters(Source *source) {
+    REACMeterSnapshot *snapshot = source->meterSnapshot;
+    const UInt32 inChannels = source->numInChannels;
+    const UInt32 outChannels = source->numOutChannels;
+    UInt64 now;
+    
+    snapshot->sequence++;
+    OSMemoryBarrier();
+    
+    snapshot->inChannels = inChannels;
+    snapshot->outChannels = outChannels;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now, &snapshot->timestamp);
+    for (UInt32 i=0; i<inChannels; i++) {
+        REACMeterValue *value = &snapshot->inputs[i];
+        value->peak = source->inMeters[i].peak;
+        value->rms = source->inMeterFrames ? integerSqrt(source->inMeters[i].sumOfSquares/source->inMeterFrames) : 0;
+        value->clipCount += source->inMeters[i].clipCount;
+    }
+    for (UInt32 i=0; i<outChannels; i++) {
+        REACMeterValue *value = &snapshot->outputs[i];
+        value->peak = source->outMeters[i].peak;
+        value->rms = source->outMeterFrames ? integerSqrt(source->outMeters[i].sumOfSquares/source->outMeterFrames) : 0;
+        value->clipCount += source->outMeters[i].clipCount;
+    }
+    
+    OSMemoryBarrier();
+    snapshot->sequence++;
+    
+    memset(source->inMeters, 0, sizeof(source->inMeters));
+    memset(source->outMeters, 0, sizeof(source->outMeters));
+    source->inMeterFrames = 0;
+    source->outMeterFrames = 0;
+    source->meterPackets = 0;
+}
+
+IOMemoryDescriptor *REACAudioEngine::copyMeterMemory(REACConnection *proto) {
+    Source *source = sourceForConnection(proto);
+    if (NULL == source || NULL == source->meterMemory) {
+        return NULL;
+    }
+    source->meterMemory->retain();
+    return source->meterMemory;
+}
+
+REACAudioEngine::Source *REACAudioEngine::sourceForConnection(REACConnection *proto) {
+    for (UInt32 i=0; i<numSources; i++) {
+        if (proto == sources[i].protocol) {
+            return &sources[i];
+        }
+    }
+    return NULL;
+}
+
+REACAudioEngine::Source *REACAudioEngine::sourceForStream(IOAudioStream *audioStream) {
+    const bool output = (kIOAudioStreamDirectionOutput == audioStream->getDirection());
+    const UInt32 channelID = audioStream->getStartingChannelID();
+    
+    for (UInt32 i=0; i<numSources; i++) {
+        const UInt32 firstChannelID = output ? sources[i].firstOutChannelID : sources[i].firstInChannelID;
+        const UInt32 numChannels = output ? sources[i].numOutChannels : sources[i].numInChannels;
+        if (channelID >= firstChannelID && channelID < firstChannelID+numChannels) {
+            return &sources[i];
+        }
+    }
+    return NULL;
+}
+
+
 void REACAudioEngine::incrementBlockCounter() {
     currentBlock++;
     if (currentBlock >= numBlocks) {
@@ -374,6 +1046,46 @@ void REACAudioEngine::incrementBlockCounter() {
     }
 }
 
+void REACAudioEngine::alignSource(Source *source) {
+    if (source == &sources[clockSource]) {
+        source->currentBlock = currentBlock;
+        source->aligned = true;
+    }
+    else if (!source->aligned) {
+        SInt32 offset = source->alignmentOffset % (SInt32)numBlocks;
+        source->currentBlock = (currentBlock+numBlocks+offset) % numBlocks;
+        source->aligned = true;
+    }
+}
+
+void REACAudioEngine::incrementSourceBlockCounter(Source *source) {
+    if (source == &sources[clockSource]) {
+        incrementBlockCounter();
+        source->currentBlock = currentBlock;
+        return;
+    }
+    
+    source->currentBlock++;
+    if (source->currentBlock >= numBlocks) {
+        source->currentBlock = 0;
+    }
+    
+    // The REAC units on a network are clocked by the same master, so the sources
+    // shouldn't drift apart. When one does anyway (because of lost packets for
+    // instance), it is realigned to the clock source.
+    SInt32 drift = (SInt32)source->currentBlock - (SInt32)((currentBlock+numBlocks+source->alignmentOffset%(SInt32)numBlocks) % numBlocks);
+    if (drift >= (SInt32)numBlocks/2) {
+        drift -= numBlocks;
+    }
+    else if (drift < -(SInt32)numBlocks/2) {
+        drift += numBlocks;
+    }
+    if ((UInt32)(drift < 0 ? -drift : drift) > bufferOffsetFactor/2) {
+        IOLog("REACAudioEngine::incrementSourceBlockCounter(): Realigning source (drift %d blocks)\n", (int)drift);
+        source->aligned = false;
+    }
+}
+
 
 
 #define addControl(control, handler) \
@@ -386,7 +1098,7 @@ void REACAudioEngine::incrementBlockCounter() {
     control->release();
 
 bool REACAudioEngine::initControls() {
-    const char *channelNameMap[17] = {
+    const char *channelNameMap[REAC_NUM_CONTROL_CHANNELS] = {
         kIOAudioControlChannelNameAll,
         kIOAudioControlChannelNameLeft,
         kIOAudioControlChannelNameRight,
@@ -399,15 +1111,18 @@ bool REACAudioEngine::initControls() {
     bool               result = false;
     IOAudioControl    *control = NULL;
     
-    for (UInt32 channel=0; channel <= 16; channel++) {
-        mVolume[channel] = mGain[channel] = 65535;
-        mMuteOut[channel] = mMuteIn[channel] = false;
+    activeControlParams = 0;
+    controlParamsGeneration = 0;
+    for (UInt32 channel=0; channel < REAC_NUM_CONTROL_CHANNELS; channel++) {
+        controlParams[0].volume[channel] = kVolumeMax;
+        controlParams[0].gain[channel] = 0; // 0 dB
+        controlParams[0].muteOut[channel] = controlParams[0].muteIn[channel] = false;
     }
     
-    for (UInt32 channel=7; channel <= 16; channel++)
+    for (UInt32 channel=7; channel < REAC_NUM_CONTROL_CHANNELS; channel++)
         channelNameMap[channel] = "Unknown Channel";
     
-    for (unsigned channel=0; channel <= 16; channel++) {
+    for (unsigned channel=0; channel < REAC_NUM_CONTROL_CHANNELS; channel++) {
         
         // Create an output volume control for each channel with an int range from 0 to 65535
         // and a db range from -72 to 0
@@ -416,8 +1131,8 @@ bool REACAudioEngine::initControls() {
         control = IOAudioLevelControl::createVolumeControl(REACAudioEngine::kVolumeMax,         // Initial value
                                                            0,                                   // min value
                                                            REACAudioEngine::kVolumeMax,         // max value
-                                                           (-72 << 16) + (32768),               // -72 in IOFixed (16.16)
-                                                           0,                                   // max 0.0 in IOFixed
+                                                           kVolumeMinDB,                        // -72 in IOFixed (16.16)
+                                                           kVolumeMaxDB,                        // max 0.0 in IOFixed
                                                            channel,                             // kIOAudioControlChannelIDDefaultLeft,
                                                            channelNameMap[channel],             // kIOAudioControlChannelNameLeft,
                                                            channel,                             // control ID - driver-defined
@@ -425,11 +1140,11 @@ bool REACAudioEngine::initControls() {
         addControl(control, (IOAudioControl::IntValueChangeHandler)volumeChangeHandler);
         
         // Gain control for each channel
-        control = IOAudioLevelControl::createVolumeControl(REACAudioEngine::kGainMax,           // Initial value
+        control = IOAudioLevelControl::createVolumeControl(0,                                   // Initial value, 0 dB
                                                            0,                                   // min value
                                                            REACAudioEngine::kGainMax,           // max value
-                                                           0,                                   // min 0.0 in IOFixed
-                                                           (72 << 16) + (32768),                // 72 in IOFixed (16.16)
+                                                           kGainMinDB,                          // min 0.0 in IOFixed
+                                                           kGainMaxDB,                          // 72 in IOFixed (16.16)
                                                            channel,                             // kIOAudioControlChannelIDDefaultLeft,
                                                            channelNameMap[channel],             // kIOAudioControlChannelNameLeft,
                                                            channel,                             // control ID - driver-defined
@@ -453,6 +1168,12 @@ bool REACAudioEngine::initControls() {
                                                       kIOAudioControlUsageInput);
     addControl(control, (IOAudioControl::IntValueChangeHandler)inputMuteChangeHandler);
     
+    // Audio should pass through untouched until the controls are changed
+    if (!hasUnityControlGains()) {
+        IOLog("REACAudioEngine::initControls(): The initial control values don't give unity gain.\n");
+        goto Done;
+    }
+    
     result = true;
     
 Done:
@@ -460,6 +1181,22 @@ Done:
 }
 
 
+// The control handlers are serialized by the engine's command gate, so there is
+// only one update at a time.
+REACAudioEngine::ControlParams *REACAudioEngine::beginControlParamsUpdate() {
+    ControlParams *params = &controlParams[1-activeControlParams];
+    memcpy(params, &controlParams[activeControlParams], sizeof(ControlParams));
+    return params;
+}
+
+void REACAudioEngine::commitControlParamsUpdate() {
+    OSMemoryBarrier();
+    activeControlParams = 1-activeControlParams;
+    OSMemoryBarrier();
+    controlParamsGeneration++;
+}
+
+
 IOReturn REACAudioEngine::volumeChangeHandler(IOService *target, IOAudioControl *volumeControl, SInt32 oldValue, SInt32 newValue) {
     IOReturn            result = kIOReturnBadArgument;
     REACAudioEngine    *audioEngine = (REACAudioEngine *)target;
@@ -471,8 +1208,10 @@ IOReturn REACAudioEngine::volumeChangeHandler(IOService *target, IOAudioControl
 
 
 IOReturn REACAudioEngine::volumeChanged(IOAudioControl *volumeControl, SInt32 oldValue, SInt32 newValue) {
-    if (volumeControl)
-        mVolume[volumeControl->getChannelID()] = newValue;
+    if (volumeControl && volumeControl->getChannelID() < REAC_NUM_CONTROL_CHANNELS) {
+        beginControlParamsUpdate()->volume[volumeControl->getChannelID()] = newValue;
+        commitControlParamsUpdate();
+    }
     return kIOReturnSuccess;
 }
 
@@ -488,8 +1227,10 @@ IOReturn REACAudioEngine::outputMuteChangeHandler(IOService *target, IOAudioCont
 
 
 IOReturn REACAudioEngine::outputMuteChanged(IOAudioControl *muteControl, SInt32 oldValue, SInt32 newValue) {
-    if (muteControl)
-        mMuteOut[muteControl->getChannelID()] = newValue;
+    if (muteControl && muteControl->getChannelID() < REAC_NUM_CONTROL_CHANNELS) {
+        beginControlParamsUpdate()->muteOut[muteControl->getChannelID()] = newValue;
+        commitControlParamsUpdate();
+    }
     return kIOReturnSuccess;
 }
 
@@ -505,8 +1246,10 @@ IOReturn REACAudioEngine::gainChangeHandler(IOService *target, IOAudioControl *g
 
 
 IOReturn REACAudioEngine::gainChanged(IOAudioControl *gainControl, SInt32 oldValue, SInt32 newValue) {
-    if (gainControl)
-        mGain[gainControl->getChannelID()] = newValue;
+    if (gainControl && gainControl->getChannelID() < REAC_NUM_CONTROL_CHANNELS) {
+        beginControlParamsUpdate()->gain[gainControl->getChannelID()] = newValue;
+        commitControlParamsUpdate();
+    }
     return kIOReturnSuccess;
 }
 
@@ -522,7 +1265,9 @@ IOReturn REACAudioEngine::inputMuteChangeHandler(IOService *target, IOAudioContr
 
 
 IOReturn REACAudioEngine::inputMuteChanged(IOAudioControl *muteControl, SInt32 oldValue, SInt32 newValue) {
-    if (muteControl)
-        mMuteIn[muteControl->getChannelID()] = newValue;
+    if (muteControl && muteControl->getChannelID() < REAC_NUM_CONTROL_CHANNELS) {
+        beginControlParamsUpdate()->muteIn[muteControl->getChannelID()] = newValue;
+        commitControlParamsUpdate();
+    }
     return kIOReturnSuccess;
 }
@@ -27,34 +27,206 @@
 #define _REACAUDIOENGINE_H
 
 #include <IOKit/audio/IOAudioEngine.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 
 #include "REACDevice.h"
+#include "REACMeterFormat.h"
+#include "REACSampleKernels.h"
 
 #define REACAudioEngine                com_pereckerdal_driver_REACAudioEngine
 
+#if REAC_METER_MAX_CHANNELS < REAC_MAX_CHANNEL_COUNT
+#error "REACMeterSnapshot has too few channels"
+#endif
+
 class REACAudioEngine : public IOAudioEngine
 {
     OSDeclareDefaultStructors(REACAudioEngine)
     
     // instance members
-    REACConnection     *protocol;
     
-    UInt32              mInBufferSize;
-    void               *mInBuffer;
-    UInt32              mOutBufferSize;
-    void               *mOutBuffer;
+    // The maximum number of REAC connections that one (aggregate) engine can span
+#   define REAC_MAX_ENGINE_SOURCES 8
+    
+    // A source is a REAC connection that the engine exchanges samples with. An
+    // engine that is created for a single connection has one source. An aggregate
+    // engine has one source per connection, and presents each of them as a pair of
+    // streams that are sample aligned to each other.
+    //
+    // The engine clock is driven by one of the sources, the clock source. The
+    // other sources keep their own block counters, which are aligned to the clock
+    // source's with a per source offset (in blocks).
+    //
+    // The sources of an engine have to run on the same work loop. The engine state
+    // that they share, like the clock source and the alignment, is only protected
+    // by its gate.
+    struct Source {
+        REACConnection *protocol;
+        
+        UInt32          inBufferSize;
+        void           *inBuffer;
+        UInt32          outBufferSize;
+        void           *outBuffer;
+        
+        // The first stream of each direction. When the engine is planar, each
+        // channel has a stream of its own, and the streams of a source have
+        // consecutive channel IDs.
+        IOAudioStream  *outputStream;
+        IOAudioStream  *inputStream;
+        UInt32          numInChannels;
+        UInt32          numOutChannels;
+        UInt32          firstInChannelID;
+        UInt32          firstOutChannelID;
+        UInt32          planeSize;      // The size of the buffer of each channel when planar, otherwise 0
+        
+        UInt32          currentBlock;
+        SInt32          alignmentOffset;
+        bool            aligned;        // False until currentBlock has been aligned to the clock source
+        
+        // Meters. The input samples are filled in by the connection after gotSamples
+        // returns, so each input block is metered on the following call.
+        REACChannelMeter inMeters[REAC_MAX_CHANNEL_COUNT];
+        REACChannelMeter outMeters[REAC_MAX_CHANNEL_COUNT];
+        UInt32          inMeterFrames;
+        UInt32          outMeterFrames;
+        UInt32          meterPackets;
+        const UInt8    *unmeteredInput;
+        // The snapshot that the meters are published in. It has memory of its own
+        // so that it can be mapped into user space by itself.
+        IOBufferMemoryDescriptor *meterMemory;
+        REACMeterSnapshot *meterSnapshot;
+        
+        // Gain ramps, by channel. Each HAL cycle of a stream ramps its channels from
+        // the ramp gains to the gains, which are the control values as of when the
+        // cycle started, so the ramp spans the frames of the cycle. The clients of
+        // the cycle all get the same ramp. The first frame and controlParamsGeneration
+        // of the cycle are kept at the index of the first channel of the stream.
+        float           outGains[REAC_MAX_CHANNEL_COUNT];
+        float           inGains[REAC_MAX_CHANNEL_COUNT];
+        float           outRampGains[REAC_MAX_CHANNEL_COUNT];
+        float           inRampGains[REAC_MAX_CHANNEL_COUNT];
+        UInt32          outGainsFrame[REAC_MAX_CHANNEL_COUNT];
+        UInt32          inGainsFrame[REAC_MAX_CHANNEL_COUNT];
+        UInt32          outGainsGeneration[REAC_MAX_CHANNEL_COUNT];
+        UInt32          inGainsGeneration[REAC_MAX_CHANNEL_COUNT];
+        
+        const UInt8    *latestInput;    // The most recent complete input block
+        
+        // Sample rate conversion state. When the engine runs at another rate than
+        // reacSampleRate, or is planar, the connection exchanges packets with
+        // these buffers instead of the engine buffers. Input packets are converted
+        // on the following gotSamples call, like they are metered.
+        UInt32          inPacketSize;
+        UInt8          *inPackets;      // Two input packets, that are used in turn
+        UInt32          nextInPacket;
+        UInt32          pendingInputBlock;  // The block of unmeteredInput
+        UInt32          outPacketSize;
+        UInt8          *outPacket;      // Always allocated; also holds the output block that routes and patches are applied to
+        UInt32          resampleHistorySize;
+        float          *resampleHistory;
+        UInt32          resampleScratchSize;
+        float          *resampleScratch;
+    };
+    Source              sources[REAC_MAX_ENGINE_SOURCES];
+    UInt32              numSources;
+    UInt32              clockSource;
+    
+    // When planar, the engine buffers are split into one ring per channel, and each
+    // channel is a stream of its own. Clients that use a few of the channels then
+    // only touch the memory of those channels.
+    bool                planar;
+    
+    // The meters of each source are published every REAC_METER_INTERVAL packets
+#   define REAC_METER_INTERVAL (REAC_PACKETS_PER_SECOND/20)
     
-    IOAudioStream      *outputStream;
-    IOAudioStream      *inputStream;
-
     UInt32              mLastValidSampleFrame;
     
-	SInt32              mVolume[17];
-    SInt32              mMuteOut[17];
-    SInt32              mMuteIn[17];
-    SInt32              mGain[17];
+#ifdef REAC_STAGE_PROFILING
+    REACStageProfile    stageProfile;    // Times convertInputSamples
+#endif
+    
+    // Sample rates. The engine runs at reacSampleRate, or at one of the lower
+    // rates in the SampleRates property, which it converts to and from on the
+    // packet path. At a converted rate, a period of packetsPerPeriod packets
+    // corresponds to framesPerPeriod engine frames; numBlocks is a multiple of
+    // packetsPerPeriod for all rates, so that the engine buffers hold a whole
+    // number of frames.
+#   define REAC_MAX_SAMPLE_RATES 8
+#   define REAC_MAX_RESAMPLER_FACTOR 512
+    struct RateParams {
+        UInt32          sampleRate;
+        UInt32          framesPerPeriod;
+        UInt32          packetsPerPeriod;
+        REACResampler   inResampler;      // From reacSampleRate to sampleRate
+        REACResampler   outResampler;     // From sampleRate to reacSampleRate
+        UInt32          coefficientsSize;
+        float          *coefficients;     // NULL if the rate is reacSampleRate
+    };
+    RateParams          rates[REAC_MAX_SAMPLE_RATES];
+    UInt32              numRates;
+    volatile UInt32     activeRate;
+    
+    // Control values. Channel 0 is the master channel, that affects all channels.
+    //
+    // The control handlers never modify the parameters that the audio path uses:
+    // They update a copy, and then make it the active one. The audio path checks
+    // controlParamsGeneration to see whether the parameters changed while it read
+    // them, and reads them again if they did.
+#   define REAC_NUM_CONTROL_CHANNELS (REAC_MAX_CHANNEL_COUNT+1)
+    struct ControlParams {
+        SInt32          volume[REAC_NUM_CONTROL_CHANNELS];
+        SInt32          muteOut[REAC_NUM_CONTROL_CHANNELS];
+        SInt32          muteIn[REAC_NUM_CONTROL_CHANNELS];
+        SInt32          gain[REAC_NUM_CONTROL_CHANNELS];
+    };
+    // Routing matrix
+    //
+    // Input channels can be mixed directly into output channels, for monitoring
+    // without the latency of a round trip through CoreAudio. The routes are kept
+    // sorted by output source, input source and output channel, and each run of
+    // routes between the same pair of sources is a route set.
+#   define REAC_MAX_ROUTES 256
+    struct RouteSet {
+        UInt32          outSource;
+        UInt32          inSource;
+        UInt32          firstRoute;
+        UInt32          numRoutes;
+    };
+    REACRoute           routes[REAC_MAX_ROUTES];
+    UInt32              routeSources[REAC_MAX_ROUTES][2]; // Output and input source of each route, while sorting
+    RouteSet            routeSets[REAC_MAX_ROUTES];
+    UInt32              numRouteSets;
     
-    UInt32              blockSize;                // In sample frames -- fixed, as defined in the Info.plist (e.g. 8192)
+    // Patch bay
+    //
+    // Patches copy input channels to output channels bit for bit, replacing what
+    // CoreAudio wrote there. They are kept in sets like the routes, and each set
+    // is compiled into byte shuffles (see REACCompilePatches) when it is read.
+#   define REAC_MAX_PATCHES 256
+#   define REAC_MAX_PATCH_OPS 512
+    struct PatchSet {
+        UInt32          outSource;
+        UInt32          inSource;
+        UInt32          firstPatch;
+        UInt32          numPatches;
+        UInt32          firstOp;
+        UInt32          numOps;     // 0 if the set couldn't be compiled; it is copied sample by sample then
+    };
+    UInt16              patchInputs[REAC_MAX_PATCHES];
+    UInt16              patchOutputs[REAC_MAX_PATCHES];
+    UInt32              patchSources[REAC_MAX_PATCHES][2]; // Output and input source of each patch, while sorting
+    PatchSet            patchSets[REAC_MAX_PATCHES];
+    UInt32              numPatchSets;
+    REACPatchOp         patchOps[REAC_MAX_PATCH_OPS];
+    
+    ControlParams       controlParams[2];
+    volatile UInt32     activeControlParams;
+    volatile UInt32     controlParamsGeneration;
+    
+    // A block is one packet, so blockSize is the samples per packet of the connections,
+    // which all have to agree on it
+    UInt32              blockSize;
+    UInt32              reacSampleRate;           // The sample rate of the REAC stream
     UInt32              numBlocks;
     UInt32              bufferOffsetFactor;
     UInt32              currentBlock;
@@ -70,13 +242,22 @@ public:
 	// class members
     static const SInt32 kVolumeMax;
     static const SInt32 kGainMax;
+    // The ranges of the controls, in IOFixed dB
+    static const SInt32 kVolumeMinDB;
+    static const SInt32 kVolumeMaxDB;
+    static const SInt32 kGainMinDB;
+    static const SInt32 kGainMaxDB;
 
-    virtual bool init(REACConnection* proto, OSDictionary *properties);
+    // protocols is an array of REACConnection objects, the sources of the engine.
+    virtual bool init(OSArray *protocols, OSDictionary *properties);
     virtual void free();
     
     virtual bool initHardware(IOService *provider);
     
     virtual bool createAudioStreams(IOAudioSampleRate *initialSampleRate);
+    // Creates the streams of one direction of a source, and returns the first one.
+    IOAudioStream *createStreams(IOAudioStreamDirection direction, UInt32 startingChannelID, UInt32 numChannels,
+                                 OSDictionary *formatDict, UInt8 *buffer, UInt32 bufferSize);
 
     virtual IOReturn performAudioEngineStart();
     virtual IOReturn performAudioEngineStop();
@@ -93,14 +274,63 @@ public:
                                          UInt32 numSampleFrames, const IOAudioStreamFormat *streamFormat,
                                          IOAudioStream *audioStream);
     
-    void gotSamples(UInt8 **data, UInt32 *bufferSize);
-    void getSamples(UInt8 **data, UInt32 *bufferSize);
+    void gotSamples(REACConnection *proto, UInt8 **data, UInt32 *bufferSize);
+    void getSamples(REACConnection *proto, UInt8 **data, UInt32 *bufferSize);
+    // Is to be called within the gate of the work loop of the sources.
+    void connectionChanged(REACConnection *proto, bool connected);
+    
+    // Returns the memory that the meters of proto are published in (see
+    // REACMeterFormat.h), retained, or NULL if proto isn't a source of the engine.
+    IOMemoryDescriptor *copyMeterMemory(REACConnection *proto);
     
 protected:
+    Source *sourceForConnection(REACConnection *proto);
+    Source *sourceForStream(IOAudioStream *audioStream);
+    // The gain ramp of the HAL cycle that starts at firstSampleFrame, for the channels
+    // of audioStream. Moves the ramp on when a new cycle starts. The start of the ramp
+    // is copied to rampStart, and the end of it is returned.
+    const float *streamGainRamp(Source *source, IOAudioStream *audioStream, UInt32 firstSampleFrame,
+                                UInt32 numChannels, float *rampStart);
+    
+    // Reads the SampleRates property. Adjusts numBlocks, so it has to be called
+    // before the buffers are allocated.
+    bool initSampleRates();
+    // The first engine frame of block, at rate
+    UInt32 blockFrame(const RateParams *rate, UInt32 block) const;
+    // Moves the input packet that was received into the source's packet buffer to
+    // the engine buffer
+    void decodeInput(const RateParams *rate, Source *source);
+    // Puts together the output packet in the source's packet buffer
+    void encodeOutput(const RateParams *rate, Source *source, UInt32 block);
+    
     void incrementBlockCounter();
+    void alignSource(Source *source);
+    void incrementSourceBlockCounter(Source *source);
+    // Counts a packet of the source, and publishes its meters when the interval is over.
+    void countMeterPacket(Source *source);
+    void publishMeters(Source *source);
+    
+    // Reads the Routes property. Channels are numbered from 1 and counted across
+    // all sources, like the channel IDs of the streams.
+    bool initRoutes();
+    // Finds the source and channel index of a channel number, or returns false.
+    bool sourceChannel(UInt32 channelNumber, bool output, UInt32 *sourceIndex, UInt32 *channel);
+    void mixRoutes(Source *source, UInt8 *outBlock);
+    // Reads the Patches property. The channels are numbered like in the Routes property.
+    bool initPatches();
+    void applyPatches(Source *source, UInt8 *outBlock);
     
     virtual bool initControls();
     
+    ControlParams *beginControlParamsUpdate();
+    void commitControlParamsUpdate();
+    // Calculates the gains that the controls ask for, for numChannels channels from
+    // firstChannelID. Is called from the audio path.
+    // Returns the controlParamsGeneration of the gains.
+    UInt32 getControlGains(bool output, UInt32 firstChannelID, UInt32 numChannels, float *gains);
+    // Checks that the current control values leave every channel at unity gain
+    bool hasUnityControlGains();
+    
     static  IOReturn volumeChangeHandler(IOService *target, IOAudioControl *volumeControl, SInt32 oldValue, SInt32 newValue);
     virtual IOReturn volumeChanged(IOAudioControl *volumeControl, SInt32 oldValue, SInt32 newValue);
     
@@ -0,0 +1,355 @@
+/*
+ *  REACBenchmark.cpp
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "REACBenchmark.h"
+
+#include <libkern/OSAtomic.h>
+#include <kern/clock.h>
+
+#include "MbufUtils.h"
+#include "PCMBlitterLib.h"
+#include "REACAudioEngine.h"
+#include "REACConnection.h"
+#include "REACDataStream.h"
+
+#define super OSObject
+
+OSDefineMetaClassAndStructors(REACBenchmark, super)
+
+bool REACBenchmark::initWithParams(const Params *params_) {
+    UInt32 packetLength;
+    UInt8 *samples = NULL;
+    thread_t thread;
+    
+    memset(streams, 0, sizeof(streams));
+    convertBuffer = NULL;
+    lock = NULL;
+    running = false;
+    shouldStop = false;
+    packets = 0;
+    busyTime = 0;
+    injectedLosses = 0;
+    detectedLosses = 0;
+    lateBursts = 0;
+    maxLatency = 0;
+    memset(latencyHistogram, 0, sizeof(latencyHistogram));
+#ifdef REAC_STAGE_PROFILING
+    stageProfile.reset();
+#endif
+    
+    if (!super::init()) {
+        return false;
+    }
+    
+    if (0 == params_->numStreams || params_->numStreams > REAC_BENCHMARK_MAX_STREAMS ||
+        0 == params_->numChannels || params_->numChannels > REAC_MAX_CHANNEL_COUNT ||
+        params_->samplesPerPacket > REAC_MAX_SAMPLES_PER_PACKET ||
+        0 == params_->seconds) {
+        goto Fail;
+    }
+    params = *params_;
+    if (0 == params.burstPackets) {
+        params.burstPackets = 1;
+    }
+    if (0 == params.samplesPerPacket) {
+        params.samplesPerPacket = REAC_SAMPLES_PER_PACKET;
+    }
+    packetSize = params.samplesPerPacket*REAC_RESOLUTION*params.numChannels;
+    packetLength = sizeof(REACPacketHeader)+packetSize+sizeof(REACConstants::ENDING);
+    
+    lock = IOLockAlloc();
+    if (NULL == lock) {
+        goto Fail;
+    }
+    
+    convertBuffer = (float *)IOMalloc(params.samplesPerPacket*params.numChannels*sizeof(float));
+    samples = (UInt8 *)IOMalloc(packetSize);
+    if (NULL == convertBuffer || NULL == samples) {
+        goto Fail;
+    }
+    
+    for (UInt32 i=0; i<params.numStreams; i++) {
+        Stream *stream = &streams[i];
+        REACPacketHeader header;
+        
+        // Locally administered addresses, one per synthetic unit
+        stream->addr[0] = 0x02;
+        stream->addr[5] = i;
+        stream->lastCounter = 0xffff; // The first packet has counter 0
+        
+        stream->ring = (UInt8 *)IOMalloc(packetSize*REAC_BENCHMARK_RING_PACKETS);
+        if (NULL == stream->ring) {
+            goto Fail;
+        }
+        
+        // Each channel gets a ramp of its own, so the conversion doesn't see only zeros
+        for (UInt32 j=0; j<packetSize; j++) {
+            samples[j] = i+j;
+        }
+        memset(&header, 0, sizeof(header));
+        
+        if (0 != mbuf_allocpacket(MBUF_WAITOK, packetLength, NULL, &stream->packet)) {
+            stream->packet = NULL;
+            goto Fail;
+        }
+        if (kIOReturnSuccess != MbufUtils::setChainLength(stream->packet, packetLength) ||
+            kIOReturnSuccess != MbufUtils::copyFromBufferToMbuf(stream->packet, 0, sizeof(header), &header) ||
+            kIOReturnSuccess != MbufUtils::copyFromBufferToMbuf(stream->packet, sizeof(header), packetSize, samples) ||
+            kIOReturnSuccess != MbufUtils::copyFromBufferToMbuf(stream->packet, sizeof(header)+packetSize,
+                                                                sizeof(REACConstants::ENDING),
+                                                                (void *)REACConstants::ENDING)) {
+            goto Fail;
+        }
+    }
+    
+    IOFree(samples, packetSize);
+    samples = NULL;
+    
+    IOLog("REACBenchmark::initWithParams(): Running %d streams of %d channels for %d seconds.\n",
+          (int)params.numStreams, (int)params.numChannels, (int)params.seconds);
+    
+    running = true;
+    if (KERN_SUCCESS != kernel_thread_start(&REACBenchmark::threadMain, this, &thread)) {
+        IOLog("REACBenchmark::initWithParams(): Failed to start benchmark thread.\n");
+        running = false;
+        goto Fail;
+    }
+    thread_deallocate(thread);
+    
+    return true;
+    
+Fail:
+    if (NULL != samples) {
+        IOFree(samples, packetSize);
+    }
+    deinit();
+    return false;
+}
+
+REACBenchmark *REACBenchmark::withParams(const Params *params) {
+    REACBenchmark *b = new REACBenchmark;
+    if (NULL == b) return NULL;
+    bool result = b->initWithParams(params);
+    if (!result) {
+        b->release();
+        return NULL;
+    }
+    return b;
+}
+
+void REACBenchmark::deinit() {
+    if (running) {
+        IOLockLock(lock);
+        shouldStop = true;
+        IOLockWakeup(lock, (void *)&shouldStop, false);
+        IOLockUnlock(lock);
+        
+        while (running) {
+            IOSleep(10);
+        }
+    }
+    
+    for (UInt32 i=0; i<REAC_BENCHMARK_MAX_STREAMS; i++) {
+        if (NULL != streams[i].packet) {
+            mbuf_freem(streams[i].packet);
+            streams[i].packet = NULL;
+        }
+        if (NULL != streams[i].ring) {
+            IOFree(streams[i].ring, packetSize*REAC_BENCHMARK_RING_PACKETS);
+            streams[i].ring = NULL;
+        }
+    }
+    
+    if (NULL != convertBuffer) {
+        IOFree(convertBuffer, params.samplesPerPacket*params.numChannels*sizeof(float));
+        convertBuffer = NULL;
+    }
+    
+    if (NULL != lock) {
+        IOLockFree(lock);
+        lock = NULL;
+    }
+}
+
+void REACBenchmark::free() {
+    deinit();
+    super::free();
+}
+
+void REACBenchmark::threadMain(void *param, wait_result_t waitResult) {
+    REACBenchmark *b = (REACBenchmark *)param;
+    const UInt64 numBursts = (UInt64)b->params.seconds*REAC_PACKETS_PER_SECOND/b->params.burstPackets;
+    uint64_t packetInterval, start, now;
+    
+    REACConnection::configureCurrentThread(b->params.affinityTag, 0);
+    nanoseconds_to_absolutetime(1000000000/REAC_PACKETS_PER_SECOND, &packetInterval);
+    start = mach_absolute_time();
+    
+    for (UInt64 burst=0; burst<numBursts && !b->shouldStop; burst++) {
+        const UInt64 firstPacket = burst*b->params.burstPackets;
+        // A burst arrives when its last packet is due
+        const uint64_t arrival = start+(firstPacket+b->params.burstPackets-1)*packetInterval;
+        
+        now = mach_absolute_time();
+        if (now < arrival) {
+            IOLockLock(b->lock);
+            if (!b->shouldStop) {
+                IOLockSleepDeadline(b->lock, (void *)&b->shouldStop, arrival, THREAD_UNINT);
+            }
+            IOLockUnlock(b->lock);
+        }
+        else if (now > arrival+b->params.burstPackets*packetInterval) {
+            b->lateBursts++;
+        }
+        
+        for (UInt32 i=0; i<b->params.burstPackets; i++) {
+            const UInt64 packet = firstPacket+i;
+            const uint64_t due = start+packet*packetInterval;
+            
+            for (UInt32 j=0; j<b->params.numStreams; j++) {
+                uint64_t done, latency;
+                
+                if (0 != b->params.lossInterval && b->params.lossInterval-1 == packet % b->params.lossInterval) {
+                    b->injectedLosses++;
+                    continue;
+                }
+                
+                now = mach_absolute_time();
+                if (!b->processPacket(&b->streams[j], (UInt16)packet)) {
+                    continue;
+                }
+                done = mach_absolute_time();
+                
+                b->busyTime += done-now;
+                b->packets++;
+                absolutetime_to_nanoseconds(done-due, &latency);
+                if (latency > b->maxLatency) {
+                    b->maxLatency = latency;
+                }
+                latency /= 1000;
+                b->latencyHistogram[latency < REAC_BENCHMARK_HISTOGRAM_SIZE ? latency : REAC_BENCHMARK_HISTOGRAM_SIZE-1]++;
+            }
+        }
+    }
+    
+    b->logResults(mach_absolute_time()-start);
+    
+    OSMemoryBarrier();
+    b->running = false;
+    thread_terminate(current_thread());
+}
+
+bool REACBenchmark::processPacket(Stream *stream, UInt16 counter) {
+    REACPacketHeader header;
+    UInt8 *slot = stream->ring+(counter % REAC_BENCHMARK_RING_PACKETS)*packetSize;
+    REAC_STAGE_DECLARE(stageStart);
+    
+    // What the unit does
+    header.setCounter(counter);
+    if (0 != mbuf_copyback(stream->packet, 0, sizeof(header.counter), &header.counter, MBUF_DONTWAIT)) {
+        return false;
+    }
+    
+    // The input filter
+    REAC_STAGE_BEGIN(stageStart);
+    if (!REACConnection::isREACPacket(stream->packet)) {
+        return false;
+    }
+    REAC_STAGE_END(stageProfile, REAC_STAGE_CLASSIFY, stageStart);
+    
+    // The work loop
+    REAC_STAGE_BEGIN(stageStart);
+    if (0 != mbuf_copydata(stream->packet, 0, sizeof(REACPacketHeader), &header)) {
+        return false;
+    }
+    if ((UInt16)(stream->lastCounter+1) != header.getCounter()) {
+        detectedLosses += (UInt16)(header.getCounter()-stream->lastCounter-1);
+    }
+    stream->lastCounter = header.getCounter();
+    REAC_STAGE_END(stageProfile, REAC_STAGE_HEADER, stageStart);
+    
+    REAC_STAGE_BEGIN(stageStart);
+    if (kIOReturnSuccess != MbufUtils::copyAudioFromMbufToBuffer(stream->packet, sizeof(REACPacketHeader),
+                                                                 packetSize, slot)) {
+        return false;
+    }
+    REAC_STAGE_END(stageProfile, REAC_STAGE_SAMPLE_COPY, stageStart);
+    
+    // The engine. It meters each packet and starts over every REAC_METER_INTERVAL packets.
+    REAC_STAGE_BEGIN(stageStart);
+    REACMeterInt24(slot, params.numChannels, params.samplesPerPacket, stream->meters);
+    if (++stream->meterPackets >= REAC_METER_INTERVAL) {
+        stream->meterPackets = 0;
+        memset(stream->meters, 0, sizeof(stream->meters));
+    }
+    REAC_STAGE_END(stageProfile, REAC_STAGE_RING, stageStart);
+    
+    REAC_STAGE_BEGIN(stageStart);
+    SwapInt24ToFloat32(slot, convertBuffer, params.samplesPerPacket*params.numChannels);
+    REAC_STAGE_END(stageProfile, REAC_STAGE_CONVERT, stageStart);
+    
+    return true;
+}
+
+UInt32 REACBenchmark::latencyPercentile(UInt32 permille) {
+    const UInt64 limit = (packets*permille+999)/1000;
+    UInt64 count = 0;
+    
+    for (UInt32 i=0; i<REAC_BENCHMARK_HISTOGRAM_SIZE; i++) {
+        count += latencyHistogram[i];
+        if (count >= limit) {
+            return i+1;
+        }
+    }
+    return REAC_BENCHMARK_HISTOGRAM_SIZE;
+}
+
+void REACBenchmark::logResults(UInt64 elapsedTime) {
+    UInt64 elapsedNS, busyNS, nsPerPacket, streamsPerCore;
+    
+    if (0 == packets) {
+        IOLog("REACBenchmark::logResults(): No packets were processed.\n");
+        return;
+    }
+    
+    absolutetime_to_nanoseconds(elapsedTime, &elapsedNS);
+    absolutetime_to_nanoseconds(busyTime, &busyNS);
+    nsPerPacket = busyNS/packets;
+    // A stream needs REAC_PACKETS_PER_SECOND packets a second
+    streamsPerCore = (UInt64)1000000000*packets/(busyNS+1)/REAC_PACKETS_PER_SECOND;
+    
+    IOLog("REACBenchmark::logResults(): %llu packets in %llu ms, %llu ns per packet, %llu%% busy.\n",
+          packets, elapsedNS/1000000, nsPerPacket, 100*busyNS/(elapsedNS+1));
+    IOLog("REACBenchmark::logResults(): One core keeps up with %llu streams of %d channels (%llu channels).\n",
+          streamsPerCore, (int)params.numChannels, streamsPerCore*params.numChannels);
+    IOLog("REACBenchmark::logResults(): Latency <= %d us (50%%), %d us (99%%), %d us (99.9%%), %llu us (max).\n",
+          (int)latencyPercentile(500), (int)latencyPercentile(990), (int)latencyPercentile(999), maxLatency/1000);
+    IOLog("REACBenchmark::logResults(): %llu lost packets injected, %llu detected, %llu late bursts.\n",
+          injectedLosses, detectedLosses, lateBursts);
+#ifdef REAC_STAGE_PROFILING
+    stageProfile.log("REACBenchmark", this);
+#endif
+}
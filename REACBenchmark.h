@@ -0,0 +1,138 @@
+/*
+ *  REACBenchmark.h
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REACBENCHMARK_H
+#define _REACBENCHMARK_H
+
+#include <libkern/OSTypes.h>
+#include <libkern/c++/OSObject.h>
+#include <IOKit/IOReturn.h>
+#include <IOKit/IOLib.h>
+#include <kern/thread.h>
+#include <sys/kpi_mbuf.h>
+
+#include "EthernetHeader.h"
+#include "REACConstants.h"
+#include "REACSampleKernels.h"
+#include "REACStageProfile.h"
+
+#define REACBenchmark              com_pereckerdal_driver_REACBenchmark
+
+// Measures how many REAC streams the machine can take in, without any REAC
+// hardware. A kernel thread of the benchmark's own generates packets for a
+// number of synthetic units, at the rate real units send them, and puts each
+// packet through the main steps of the receive path: the checks of the input
+// filter, the packet header and counter, the copy from the mbuf to a ring
+// buffer like the engine's, the metering of the engine and the conversion to
+// float that CoreAudio asks for.
+//
+// It is a proxy of the receive path, not the receive path itself: the real one
+// needs a network interface and an IOAudioDevice, so the benchmark calls the
+// same functions as REACConnection and REACAudioEngine do, from its own thread
+// and ring. It leaves out the command gate of the work loop, gain ramps,
+// patches, routes, rate conversion and the taps, so the real path costs more
+// per packet than what the benchmark reports, by what those are set up to do.
+//
+// When the run is over, the results are logged: the time each packet takes,
+// how many streams and channels one core could keep up with at that rate, and
+// the distribution of the latency from when each packet was due to when its
+// samples were converted.
+class REACBenchmark : public OSObject {
+    OSDeclareDefaultStructors(REACBenchmark)
+
+public:
+#   define REAC_BENCHMARK_MAX_STREAMS 64
+
+    struct Params {
+        UInt32  numStreams;
+        UInt32  numChannels;        // Per stream, at most REAC_MAX_CHANNEL_COUNT
+        UInt32  samplesPerPacket;   // At most REAC_MAX_SAMPLES_PER_PACKET. 0 for REAC_SAMPLES_PER_PACKET.
+        UInt32  seconds;
+        UInt32  lossInterval;       // Every lossInterval:th packet of each stream is lost. 0 for no loss.
+        UInt32  burstPackets;       // The packets of each stream arrive this many at a time, like after a
+                                    // switch that holds them up. 0 or 1 for evenly spaced packets.
+        UInt32  affinityTag;        // For the benchmark thread, or THREAD_AFFINITY_TAG_NULL
+    };
+    
+    // Starts the benchmark right away.
+    virtual bool initWithParams(const Params *params);
+    static REACBenchmark *withParams(const Params *params);
+
+protected:
+    // Object destruction method that is used by free, and the init method on failure.
+    virtual void deinit();
+    virtual void free();
+
+public:
+    bool isFinished() const { return !running; }
+
+protected:
+    // Latencies are counted in buckets of one microsecond, the last one takes the rest
+#   define REAC_BENCHMARK_HISTOGRAM_SIZE 4096
+    // The number of packets per stream that the engine like ring buffer holds
+#   define REAC_BENCHMARK_RING_PACKETS 64
+    
+    struct Stream {
+        mbuf_t          packet;     // Is reused for every packet of the stream
+        UInt8           addr[ETHER_ADDR_LEN];
+        UInt16          lastCounter;
+        UInt8          *ring;
+        REACChannelMeter meters[REAC_MAX_CHANNEL_COUNT];
+        UInt32          meterPackets;
+    };
+    
+    Params              params;
+    UInt32              packetSize;  // The number of sample bytes in a packet
+    Stream              streams[REAC_BENCHMARK_MAX_STREAMS];
+    float              *convertBuffer;
+    
+    // Results
+    UInt64              packets;
+    UInt64              busyTime;    // Spent processing packets, in absolute time units
+    UInt64              injectedLosses;
+    UInt64              detectedLosses;
+    UInt64              lateBursts;  // Bursts that started after the next one was due
+    UInt32              latencyHistogram[REAC_BENCHMARK_HISTOGRAM_SIZE];
+    UInt64              maxLatency;  // In ns
+#ifdef REAC_STAGE_PROFILING
+    REACStageProfile    stageProfile;
+#endif
+    
+    IOLock             *lock;
+    volatile bool       shouldStop;
+    volatile bool       running;
+    
+    static void threadMain(void *param, wait_result_t waitResult);
+    // Runs one packet through the receive steps that the benchmark covers. Returns false
+    // if it was lost on the way.
+    bool processPacket(Stream *stream, UInt16 counter);
+    void logResults(UInt64 elapsedTime);
+    // Returns the smallest latency, in microseconds, that permille of the packets are within
+    UInt32 latencyPercentile(UInt32 permille);
+};
+
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ *  REACCapture.cpp
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "REACCapture.h"
+
+#include <libkern/OSByteOrder.h>
+#include <kern/clock.h>
+#include <sys/fcntl.h>
+
+#include "MbufUtils.h"
+
+#define super REACRecorder
+
+OSDefineMetaClassAndStructors(REACCapture, super)
+
+bool REACCapture::initWithPath(const char *path, UInt32 maxPacketLength,
+                               UInt32 inChannels, UInt32 outChannels, UInt32 ringSize) {
+    char indexPath[1024];
+    clock_sec_t secs;
+    clock_usec_t usecs;
+
+    recordBuffer = NULL;
+    indexVnode = NULL;
+    indexContext = NULL;
+    indexEntryCount = 0;
+    for (int i=0; i<2; i++) {
+        haveCounter[i] = false;
+        lastCounter[i] = 0;
+        extendedCounter[i] = 0;
+    }
+
+    if (NULL == path || 0 == maxPacketLength || maxPacketLength > 0xffff) {
+        goto Fail;
+    }
+
+    recordSize = (sizeof(REACCaptureRecordHeader)+maxPacketLength+15) & ~15;
+    captureInChannels = inChannels;
+    captureOutChannels = outChannels;
+
+    recordBuffer = (UInt8 *)IOMalloc(recordSize);
+    if (NULL == recordBuffer) {
+        goto Fail;
+    }
+
+    clock_get_calendar_microtime(&secs, &usecs);
+    startTimestamp = currentTimestamp();
+    startTimeSeconds = secs;
+    startTimeMicroseconds = usecs;
+
+    // The index is opened first, because the writer thread starts using it as soon as it runs
+    indexContext = vfs_context_create(NULL);
+    if (NULL == indexContext) {
+        goto Fail;
+    }
+    snprintf(indexPath, sizeof(indexPath), "%s%s", path, REAC_CAPTURE_INDEX_SUFFIX);
+    if (0 != vnode_open(indexPath, O_CREAT | O_TRUNC | FWRITE, 0644, 0, &indexVnode, indexContext)) {
+        IOLog("REACCapture::initWithPath(): Failed to open '%s'.\n", indexPath);
+        indexVnode = NULL;
+        goto Fail;
+    }
+
+    if (!initWriter(path, ringSize, recordSize*REAC_CAPTURE_RECORDS_PER_CHUNK)) {
+        goto Fail;
+    }
+
+    return true;
+
+Fail:
+    deinit();
+    return false;
+}
+
+REACCapture *REACCapture::withPath(const char *path, UInt32 maxPacketLength,
+                                   UInt32 inChannels, UInt32 outChannels, UInt32 ringSize) {
+    REACCapture *c = new REACCapture;
+    if (NULL == c) return NULL;
+    bool result = c->initWithPath(path, maxPacketLength, inChannels, outChannels, ringSize);
+    if (!result) {
+        c->release();
+        return NULL;
+    }
+    return c;
+}
+
+void REACCapture::deinit() {
+    // The writer thread writes to the index until it stops
+    stopWriter();
+
+    if (NULL != indexVnode) {
+        vnode_close(indexVnode, FWRITE, indexContext);
+        indexVnode = NULL;
+    }
+
+    if (NULL != indexContext) {
+        vfs_context_rele(indexContext);
+        indexContext = NULL;
+    }
+
+    if (NULL != recordBuffer) {
+        IOFree(recordBuffer, recordSize);
+        recordBuffer = NULL;
+    }
+
+    super::deinit();
+}
+
+void REACCapture::writePacket(UInt8 direction, UInt16 counter, const void *header, UInt32 headerLength,
+                              mbuf_t data, UInt32 dataOffset) {
+    REACCaptureRecordHeader *record = (REACCaptureRecordHeader *)recordBuffer;
+    const UInt32 room = recordSize-sizeof(REACCaptureRecordHeader);
+    const UInt32 length = headerLength+MbufUtils::mbufTotalLength(data)-dataOffset;
+    const UInt32 savedLength = (length < room) ? length : room;
+    const UInt32 savedHeaderLength = (headerLength < savedLength) ? headerLength : savedLength;
+
+    if (direction > REAC_CAPTURE_DIRECTION_OUT) {
+        return;
+    }
+
+    // Extend the counter. Lost packets are accounted for as long as less than
+    // 65536 of them are lost in a row.
+    if (haveCounter[direction]) {
+        extendedCounter[direction] += (UInt16)(counter-lastCounter[direction]);
+    }
+    else {
+        extendedCounter[direction] = counter;
+        haveCounter[direction] = true;
+    }
+    lastCounter[direction] = counter;
+
+    memset(recordBuffer, 0, recordSize);
+    record->counter = OSSwapHostToLittleInt64(extendedCounter[direction]);
+    record->timestamp = OSSwapHostToLittleInt64(currentTimestamp());
+    record->length = OSSwapHostToLittleInt16((UInt16)length);
+    record->direction = direction;
+    record->flags = (savedLength != length) ? REAC_CAPTURE_FLAG_TRUNCATED : 0;
+
+    if (NULL != header) {
+        memcpy(recordBuffer+sizeof(REACCaptureRecordHeader), header, savedHeaderLength);
+    }
+    if (savedLength > savedHeaderLength &&
+        0 != mbuf_copydata(data, dataOffset, savedLength-savedHeaderLength,
+                           recordBuffer+sizeof(REACCaptureRecordHeader)+savedHeaderLength)) {
+        return;
+    }
+
+    writeSamples(recordBuffer, recordSize);
+}
+
+void REACCapture::prepareChunk(UInt8 *buffer, UInt32 length, UInt64 offset) {
+    const UInt64 firstRecord = (offset-REAC_RECORDER_HEADER_SIZE)/recordSize;
+    const UInt32 recordCount = length/recordSize;
+
+    for (UInt32 i=0; i<recordCount; i++) {
+        const UInt64 recordNumber = firstRecord+i;
+        if (0 != recordNumber % REAC_CAPTURE_RECORDS_PER_INDEX_ENTRY) {
+            continue;
+        }
+
+        const REACCaptureRecordHeader *record = (const REACCaptureRecordHeader *)(buffer+i*recordSize);
+        REACCaptureIndexEntry entry;
+        entry.recordNumber = OSSwapHostToLittleInt64(recordNumber);
+        entry.counter = record->counter;
+        entry.timestamp = record->timestamp;
+
+        if (kIOReturnSuccess == writeToVnode(indexVnode, indexContext, &entry, sizeof(entry),
+                                             indexEntryCount*sizeof(entry), 0)) {
+            indexEntryCount++;
+        }
+    }
+}
+
+IOReturn REACCapture::writeHeader() {
+    memset(writeBuffer, 0, REAC_RECORDER_HEADER_SIZE);
+    return writeCaptureHeader(0, 0);
+}
+
+IOReturn REACCapture::finishHeader() {
+    return writeCaptureHeader(dataBytes/recordSize, droppedBytes/recordSize);
+}
+
+IOReturn REACCapture::writeCaptureHeader(UInt64 recordCount, UInt64 droppedRecords) {
+    REACCaptureFileHeader header;
+
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, REAC_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = OSSwapHostToLittleInt32(REAC_CAPTURE_VERSION);
+    header.headerSize = OSSwapHostToLittleInt32(REAC_RECORDER_HEADER_SIZE);
+    header.recordSize = OSSwapHostToLittleInt32(recordSize);
+    header.recordsPerIndexEntry = OSSwapHostToLittleInt32(REAC_CAPTURE_RECORDS_PER_INDEX_ENTRY);
+    header.startTimeSeconds = OSSwapHostToLittleInt64(startTimeSeconds);
+    header.startTimeMicroseconds = OSSwapHostToLittleInt32(startTimeMicroseconds);
+    header.inChannels = OSSwapHostToLittleInt32(captureInChannels);
+    header.outChannels = OSSwapHostToLittleInt32(captureOutChannels);
+    header.startTimestamp = OSSwapHostToLittleInt64(startTimestamp);
+    header.recordCount = OSSwapHostToLittleInt64(recordCount);
+    header.droppedRecords = OSSwapHostToLittleInt64(droppedRecords);
+    header.indexEntryCount = OSSwapHostToLittleInt64(indexEntryCount);
+
+    if (0 == recordCount) {
+        // The first time, the whole header area is written, so that the records
+        // start at the right offset.
+        memcpy(writeBuffer, &header, sizeof(header));
+        return writeToFile(writeBuffer, REAC_RECORDER_HEADER_SIZE, 0);
+    }
+    return writeToFile(&header, sizeof(header), 0);
+}
+
+UInt64 REACCapture::currentTimestamp() {
+    UInt64 now, ns;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now, &ns);
+    return ns;
+}
@@ -0,0 +1,94 @@
+/*
+ *  REACCapture.h
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REACCAPTURE_H
+#define _REACCAPTURE_H
+
+#include <sys/kpi_mbuf.h>
+
+#include "REACRecorder.h"
+#include "REACCaptureFormat.h"
+
+#define REACCapture              com_pereckerdal_driver_REACCapture
+
+// Captures the raw REAC packets of a connection, in both directions, to the
+// format that is described in REACCaptureFormat.h. It uses the ring buffer and
+// writer thread of REACRecorder; the records are put together on the work loop
+// and the index is written by the writer thread as the records reach the disk.
+class REACCapture : public REACRecorder {
+    OSDeclareDefaultStructors(REACCapture)
+
+public:
+    // Packets that are longer than maxPacketLength are truncated.
+    virtual bool initWithPath(const char *path, UInt32 maxPacketLength,
+                              UInt32 inChannels, UInt32 outChannels, UInt32 ringSize);
+    static REACCapture *withPath(const char *path, UInt32 maxPacketLength,
+                                 UInt32 inChannels, UInt32 outChannels, UInt32 ringSize);
+
+protected:
+    virtual void deinit();
+
+public:
+    // Saves the Ethernet frame that consists of headerLength bytes at header,
+    // followed by the contents of data from dataOffset. header may be NULL if
+    // the whole frame is in data. Has the same threading rules as writeSamples.
+    void writePacket(UInt8 direction, UInt16 counter, const void *header, UInt32 headerLength,
+                     mbuf_t data, UInt32 dataOffset);
+
+protected:
+#   define REAC_CAPTURE_RECORDS_PER_CHUNK 256  // Makes the chunks page aligned, since records are 16 byte aligned
+#   define REAC_CAPTURE_RECORDS_PER_INDEX_ENTRY 1024
+
+    UInt32              recordSize;
+    UInt32              captureInChannels;
+    UInt32              captureOutChannels;
+    UInt8              *recordBuffer;    // Scratch space for putting a record together
+
+    // Per direction state for extending the 16 bit REAC counters
+    bool                haveCounter[2];
+    UInt16              lastCounter[2];
+    UInt64              extendedCounter[2];
+
+    // Is only accessed by the writer thread after initialization
+    vnode_t             indexVnode;
+    vfs_context_t       indexContext;
+    UInt64              indexEntryCount;
+
+    UInt64              startTimeSeconds;
+    UInt32              startTimeMicroseconds;
+    UInt64              startTimestamp;
+
+    virtual void prepareChunk(UInt8 *buffer, UInt32 length, UInt64 offset);
+    virtual IOReturn writeHeader();
+    virtual IOReturn finishHeader();
+    // Writes the header as it is at the moment
+    IOReturn writeCaptureHeader(UInt64 recordCount, UInt64 droppedRecords);
+
+    static UInt64 currentTimestamp();
+};
+
+
+#endif
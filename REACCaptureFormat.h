@@ -0,0 +1,106 @@
+/*
+ *  REACCaptureFormat.h
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REACCAPTUREFORMAT_H
+#define _REACCAPTUREFORMAT_H
+
+// The on disk format of raw REAC packet captures. This header is plain C and has
+// no dependencies on the rest of the driver, so that it can be used as is by
+// programs that read the captures.
+//
+// A capture consists of two files:
+//
+// The capture file starts with a REACCaptureFileHeader, padded to headerSize
+// bytes. After it come the packets, one per record. All records are recordSize
+// bytes, so record n is at headerSize+n*recordSize, and the whole file can be
+// mapped into memory and used in place. Each record is a REACCaptureRecordHeader
+// followed by the complete Ethernet frame of the packet, without FCS.
+//
+// The index file (the capture file name with ".idx" appended) is an array of
+// REACCaptureIndexEntry, one for every recordsPerIndexEntry records. Both the
+// timestamps and the record numbers in it are increasing, so a reader can
+// binary search it for a point in time and then jump straight to the record.
+//
+// The files are only ever appended to while recording. The recordCount,
+// droppedRecords and indexEntryCount header fields are zero until the capture
+// is finished; readers of a capture that is in progress should use the file
+// sizes instead.
+//
+// All integers are little endian.
+
+#include <stdint.h>
+
+#define REAC_CAPTURE_MAGIC          "REACCAP"
+#define REAC_CAPTURE_VERSION        1
+#define REAC_CAPTURE_INDEX_SUFFIX   ".idx"
+
+enum {
+    REAC_CAPTURE_DIRECTION_IN       = 0,
+    REAC_CAPTURE_DIRECTION_OUT      = 1
+};
+
+enum {
+    // The packet was longer than the record; only the beginning of it was saved
+    REAC_CAPTURE_FLAG_TRUNCATED     = 0x01
+};
+
+#pragma pack(push, 1)
+
+typedef struct {
+    char     magic[8];                // REAC_CAPTURE_MAGIC, zero terminated
+    uint32_t version;                 // REAC_CAPTURE_VERSION
+    uint32_t headerSize;              // The offset of the first record
+    uint32_t recordSize;
+    uint32_t recordsPerIndexEntry;
+    uint64_t startTimeSeconds;        // Wall clock time when the capture started (Unix time)
+    uint32_t startTimeMicroseconds;
+    uint32_t inChannels;              // Of the REAC device at the other end
+    uint64_t startTimestamp;          // The record timestamp that corresponds to startTimeSeconds
+    uint64_t recordCount;
+    uint64_t droppedRecords;          // Records that were lost because the disk couldn't keep up
+    uint64_t indexEntryCount;
+    uint32_t outChannels;
+    uint32_t reserved;
+} REACCaptureFileHeader;
+
+typedef struct {
+    uint64_t counter;                 // The REAC packet counter, extended to 64 bits. Counts each direction separately.
+    uint64_t timestamp;               // Uptime in nanoseconds when the packet was received or sent
+    uint16_t length;                  // The length of the Ethernet frame
+    uint8_t  direction;               // REAC_CAPTURE_DIRECTION_*
+    uint8_t  flags;                   // REAC_CAPTURE_FLAG_*
+    uint32_t reserved;
+} REACCaptureRecordHeader;
+
+typedef struct {
+    uint64_t recordNumber;
+    uint64_t counter;                 // Of the record at recordNumber
+    uint64_t timestamp;               // Of the record at recordNumber
+} REACCaptureIndexEntry;
+
+#pragma pack(pop)
+
+#endif
@@ -28,6 +28,9 @@
 
 #include <IOKit/IOLib.h>
 #include <IOKit/IOTimerEventSource.h>
+#include <libkern/OSAtomic.h>
+#include <mach/thread_act.h>
+#include <mach/thread_policy.h>
 #include <sys/errno.h>
 #include <sys/socket.h>
 
@@ -42,6 +45,8 @@
 
 OSDefineMetaClassAndStructors(REACConnection, super)
 
+REACConnection * volatile REACConnection::protocolConnections[REAC_MAX_PROTOCOL_CONNECTIONS];
+
 bool REACConnection::initWithInterface(IOWorkLoop *workLoop_, ifnet_t interface_, REACMode mode_,
                                        reac_connection_callback_t connectionCallback_,
                                        reac_samples_callback_t samplesCallback_,
@@ -55,7 +60,25 @@ bool REACConnection::initWithInterface(IOWorkLoop *workLoop_, ifnet_t interface_
     filterCommandGate = NULL;
     workLoop = NULL;
     timerEventSource = NULL;
+    watchdogEventSource = NULL;
     interface = NULL;
+    spinNS = 0;
+    transport = REAC_TRANSPORT_FILTER;
+    protocolSlot = -1;
+    pacingAffinityTag = THREAD_AFFINITY_TAG_NULL;
+    pacingLock = NULL;
+    pacingShouldStop = false;
+    pacingRunning = false;
+    mbufPool = NULL;
+    mbufPoolSize = REAC_DEFAULT_MBUF_POOL_SIZE;
+#ifdef REAC_STAGE_PROFILING
+    stageProfile.reset();
+#endif
+    trapAllocations = false;
+    recorder = NULL;
+    capture = NULL;
+    sharedStream = NULL;
+    rtpSender = NULL;
     
     if (NULL == workLoop_) {
         goto Fail;
@@ -79,6 +102,13 @@ bool REACConnection::initWithInterface(IOWorkLoop *workLoop_, ifnet_t interface_
         IOLog("REACConnection::initWithInterface() - Error: Failed to create timer event source.\n");
         goto Fail;
     }
+    if (REAC_MASTER != mode_) {
+        watchdogEventSource = IOTimerEventSource::timerEventSource(this, (IOTimerEventSource::Action)&REACConnection::watchdogFired);
+        if (NULL == watchdogEventSource) {
+            IOLog("REACConnection::initWithInterface() - Error: Failed to create watchdog event source.\n");
+            goto Fail;
+        }
+    }
     
     // Hack: Pretend to be connected immediately
     deviceInfo = (REACDeviceInfo*) IOMalloc(sizeof(REACDeviceInfo));
@@ -96,11 +126,21 @@ bool REACConnection::initWithInterface(IOWorkLoop *workLoop_, ifnet_t interface_
     deviceInfo->out_channels = 8;
     started = false;
     connected = false;
+    samplesPerPacket = REAC_SAMPLES_PER_PACKET;
+    candidateSamplesPerPacket = 0;
+    candidatePackets = 0;
+    geometryFrozen = false;
     
-    lastCounter = 0;
+    sourceCount = 0;
+    allowedSourceCount = 0;
     lastSeenConnectionCounter = 0;
     lastSentAnnouncementCounter = 0;
     splitAnnouncementCounter = 0;
+    firstPacketTime = 0;
+    lastPacketTime = 0;
+    nanoseconds_to_absolutetime((UInt64)REAC_STALL_PACKETS*1000000000/REAC_PACKETS_PER_SECOND, &stallTimeout);
+    stalled = false;
+    stallCallback = NULL;
     connectionCallback = connectionCallback_;
     samplesCallback = samplesCallback_;
     getSamplesCallback = getSamplesCallback_;
@@ -184,16 +224,32 @@ void REACConnection::deinit() {
         IOFree(deviceInfo, sizeof(REACDeviceInfo));
     }
     
+    if (NULL != recorder) {
+        recorder->release();
+        recorder = NULL;
+    }
+    
+    if (NULL != capture) {
+        capture->release();
+        capture = NULL;
+    }
+    
+    if (NULL != sharedStream) {
+        sharedStream->release();
+        sharedStream = NULL;
+    }
+    
+    if (NULL != rtpSender) {
+        rtpSender->release();
+        rtpSender = NULL;
+    }
+    
     if (NULL != filterCommandGate) {
         workLoop->removeEventSource(filterCommandGate);
         filterCommandGate->release();
         filterCommandGate = NULL;
     }
     
-    if (NULL != workLoop) {
-        workLoop->release();
-    }
-    
     if (NULL != timerEventSource) {
         timerEventSource->cancelTimeout();
         workLoop->removeEventSource(timerEventSource);
@@ -201,10 +257,29 @@ void REACConnection::deinit() {
         timerEventSource = NULL;
     }
     
+    if (NULL != watchdogEventSource) {
+        watchdogEventSource->cancelTimeout();
+        workLoop->removeEventSource(watchdogEventSource);
+        watchdogEventSource->release();
+        watchdogEventSource = NULL;
+    }
+    
+    // The connections might be the only ones that hold the work loop, so it is
+    // released after all event sources have been removed from it
+    if (NULL != workLoop) {
+        workLoop->release();
+        workLoop = NULL;
+    }
+    
     if (NULL != interface) {
         ifnet_release(interface);
         interface = NULL;
     }
+    
+    if (NULL != pacingLock) {
+        IOLockFree(pacingLock);
+        pacingLock = NULL;
+    }
 }
 
 void REACConnection::free() {
@@ -214,30 +289,59 @@ void REACConnection::free() {
 
 
 bool REACConnection::start() {
+    if (0 != mbufPoolSize) {
+        // Big enough for any packet that the connection sends
+        const UInt32 maxPacketLength = sizeof(EthernetHeader)+sizeof(REACPacketHeader)+
+            2*REAC_MAX_SAMPLES_PER_PACKET*REAC_RESOLUTION*REAC_MAX_CHANNEL_COUNT+sizeof(REACConstants::ENDING);
+        mbufPool = REACMbufPool::withSize(mbufPoolSize, maxPacketLength, trapAllocations);
+        if (NULL == mbufPool) {
+            IOLog("REACConnection::start() - Error: Failed to create mbuf pool.\n");
+            return false;
+        }
+    }
+    
     if (NULL == timerEventSource || workLoop->addEventSource(timerEventSource) != kIOReturnSuccess) {
         IOLog("REACConnection::start() - Error: Failed to add timer event source to work loop!\n");
         return false;
     }
-    
-    
-    timerEventSource->setTimeout(timeoutNS);
+    if (NULL != watchdogEventSource && workLoop->addEventSource(watchdogEventSource) != kIOReturnSuccess) {
+        IOLog("REACConnection::start() - Error: Failed to add watchdog event source to work loop!\n");
+        workLoop->removeEventSource(timerEventSource);
+        return false;
+    }
     
     uint64_t time;
     clock_get_uptime(&time);
     absolutetime_to_nanoseconds(time, &nextTime);
     nextTime += timeoutNS;
+    
+    if (0 == spinNS) {
+        timerEventSource->setTimeout(timeoutNS);
+    }
+    else {
+        thread_t thread;
         
-    iff_filter filter;
-    filter.iff_cookie = this;
-    filter.iff_name = "REAC driver input filter";
-    filter.iff_protocol = 0;
-    filter.iff_input = &REACConnection::filterInputFunc;
-    filter.iff_output = NULL;
-    filter.iff_event = NULL;
-    filter.iff_ioctl = NULL;
-    filter.iff_detached = &REACConnection::filterDetachedFunc;
+        pacingShouldStop = false;
+        pacingRunning = true;
+        if (KERN_SUCCESS != kernel_thread_start(&REACConnection::pacingThreadMain, this, &thread)) {
+            IOLog("REACConnection::start() - Error: Failed to start pacing thread.\n");
+            pacingRunning = false;
+            workLoop->removeEventSource(timerEventSource);
+            if (NULL != watchdogEventSource) {
+                workLoop->removeEventSource(watchdogEventSource);
+            }
+            return false;
+        }
+        thread_deallocate(thread);
+    }
     
-    if (0 != iflt_attach(interface, &filter, &filterRef)) {
+    if (kIOReturnSuccess != attachTransport()) {
+        stopPacingThread();
+        timerEventSource->cancelTimeout();
+        workLoop->removeEventSource(timerEventSource);
+        if (NULL != watchdogEventSource) {
+            workLoop->removeEventSource(watchdogEventSource);
+        }
         return false;
     }
     
@@ -248,10 +352,15 @@ bool REACConnection::start() {
 
 void REACConnection::stop() {
     if (started) {
+        stopPacingThread();
         if (NULL != timerEventSource) {
             timerEventSource->cancelTimeout();
             workLoop->removeEventSource(timerEventSource);
         }
+        if (NULL != watchdogEventSource) {
+            watchdogEventSource->cancelTimeout();
+            workLoop->removeEventSource(watchdogEventSource);
+        }
         
         if (isConnected()) {
             // Announce disconnect
@@ -260,8 +369,21 @@ void REACConnection::stop() {
             }
         }
         
-        iflt_detach(filterRef);
+        detachTransport();
         started = false;
+        
+#ifdef REAC_STAGE_PROFILING
+        stageProfile.log("REACConnection", this);
+#endif
+    }
+    
+    if (NULL != mbufPool) {
+        if (0 != mbufPool->getAllocations()) {
+            IOLog("REACConnection::stop(): %llu packets were allocated outside of the mbuf pool.\n",
+                  (unsigned long long)mbufPool->getAllocations());
+        }
+        mbufPool->release();
+        mbufPool = NULL;
     }
 }
 
@@ -277,47 +399,225 @@ void REACConnection::timerFired(OSObject *target, IOTimerEventSource *sender) {
         return;
     }
     
+    sender->setTimeout(proto->periodicWork());
+}
+
+void REACConnection::watchdogFired(OSObject *target, IOTimerEventSource *sender) {
+    REACConnection *proto = OSDynamicCast(REACConnection, target);
+    if (NULL == proto) {
+        // This should never happen
+        IOLog("REACConnection::watchdogFired(): Internal error!\n");
+        return;
+    }
+    
+    // The watchdog is started again by the next connect
+    if (!proto->isConnected()) {
+        return;
+    }
+    
+    if (!proto->stalled) {
+        UInt64 now;
+        clock_get_uptime(&now);
+        if (now-proto->lastPacketTime > proto->stallTimeout) {
+            IOLog("REACConnection[%p]::watchdogFired(): The stream has stalled.\n", proto);
+            proto->stalled = true;
+            if (NULL != proto->stallCallback) {
+                proto->stallCallback(proto, &proto->cookieA, &proto->cookieB, true);
+            }
+        }
+    }
+    
+    sender->setTimeoutUS(REAC_WATCHDOG_INTERVAL_US);
+}
+
+UInt64 REACConnection::periodicWork() {
     UInt64            thisTimeNS;
     uint64_t          time;
     SInt64            diff;
     
     do {
-        if (proto->isConnected()) {
-            if ((proto->connectionCounter - proto->lastSeenConnectionCounter)*proto->timeoutNS >
+        if (isConnected()) {
+            if ((connectionCounter - lastSeenConnectionCounter)*timeoutNS >
                 (UInt64)REAC_TIMEOUT_UNTIL_DISCONNECT*1000000) {
-                proto->connected = false;
-                if (NULL != proto->connectionCallback) {
-                    proto->connectionCallback(proto, &proto->cookieA, &proto->cookieB, NULL);
+                connected = false;
+                stalled = false;
+                if (NULL != connectionCallback) {
+                    connectionCallback(this, &cookieA, &cookieB, NULL);
+                }
+                
+                // Be ready for the master's next announce right away, instead of
+                // after the next periodic announce has noticed that it is gone
+                if (REAC_SPLIT == mode) {
+                    REACSplitDataStream *splitDataStream = OSDynamicCast(REACSplitDataStream, dataStream);
+                    if (NULL != splitDataStream) {
+                        splitDataStream->resetHandshake();
+                    }
                 }
             }
             
-            proto->connectionCounter++;
+            connectionCounter++;
         }
         
-        if (REAC_MASTER == proto->mode) {
-            proto->getAndSendSamples();
-        }
-        else if (REAC_SPLIT == proto->mode) {
-            proto->lastSentAnnouncementCounter++;
-            if (proto->lastSentAnnouncementCounter*proto->timeoutNS >= 1000000000) {
-                proto->lastSentAnnouncementCounter = 0;
-                proto->sendSplitAnnouncementPacket();
+        if (REAC_MASTER == mode) {
+            getAndSendSamples();
+        }
+        else if (REAC_SPLIT == mode) {
+            lastSentAnnouncementCounter++;
+            if (lastSentAnnouncementCounter*timeoutNS >= 1000000000) {
+                lastSentAnnouncementCounter = 0;
+                sendSplitAnnouncementPacket();
             }
         }
         
         // Calculate next time to fire, by taking the time and comparing it to the time we requested.
         clock_get_uptime(&time);
         absolutetime_to_nanoseconds(time, &thisTimeNS);
-        proto->nextTime += proto->timeoutNS;
+        nextTime += timeoutNS;
         // This next calculation must be signed
-        diff = ((SInt64)proto->nextTime - (SInt64)thisTimeNS);
+        diff = ((SInt64)nextTime - (SInt64)thisTimeNS);
         
-        if (diff < -((SInt64)proto->timeoutNS)*10) {
+        if (diff < -((SInt64)timeoutNS)*10) {
             // TODO After a certain amount of lost packets we probably ought to skip output packets
-            IOLog("REACConnection::timerFired(): Lost the time by %lld us\n", diff/1000);
+            IOLog("REACConnection::periodicWork(): Lost the time by %lld us\n", diff/1000);
         }
     } while (diff < 0);
-    sender->setTimeout((UInt64)diff);
+    return (UInt64)diff;
+}
+
+void REACConnection::setMbufPoolSize(UInt32 numPackets, bool trapAllocations_) {
+    if (!started) {
+        mbufPoolSize = numPackets;
+        trapAllocations = trapAllocations_;
+    }
+}
+
+IOReturn REACConnection::allocatePacket(UInt32 length, mbuf_t *mbuf) {
+    if (NULL != mbufPool) {
+        return mbufPool->getPacket(length, mbuf);
+    }
+    
+    if (0 != mbuf_allocpacket(MBUF_DONTWAIT, length, NULL, mbuf)) {
+        return kIOReturnNoMemory;
+    }
+    if (kIOReturnSuccess != MbufUtils::setChainLength(*mbuf, length)) {
+        mbuf_freem(*mbuf);
+        *mbuf = NULL;
+        return kIOReturnNoMemory;
+    }
+    return kIOReturnSuccess;
+}
+
+void REACConnection::setPacing(UInt32 spinMicroseconds, UInt32 affinityTag) {
+    if (started || 0 == spinMicroseconds) {
+        return;
+    }
+    if (REAC_MASTER != mode) {
+        // The thread is real time with one period per REAC packet, but only a master
+        // sends packets; the other modes just check the connection now and then.
+        IOLog("REACConnection::setPacing(): Pacing is only for REAC_MASTER mode, ignoring it.\n");
+        return;
+    }
+    
+    if (NULL == pacingLock) {
+        pacingLock = IOLockAlloc();
+        if (NULL == pacingLock) {
+            return;
+        }
+    }
+    spinNS = (UInt64)spinMicroseconds*1000;
+    pacingAffinityTag = affinityTag;
+}
+
+void REACConnection::configureThread(thread_t thread, UInt32 affinityTag, UInt64 computationNS) {
+    if (THREAD_AFFINITY_TAG_NULL != affinityTag) {
+        // Threads with different tags are spread out over different L2 caches
+        thread_affinity_policy_data_t policy;
+        policy.affinity_tag = affinityTag;
+        
+        if (KERN_SUCCESS != thread_policy_set(thread, THREAD_AFFINITY_POLICY,
+                                              (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT)) {
+            IOLog("REACConnection::configureThread(): Failed to set thread affinity.\n");
+        }
+    }
+    
+    if (0 != computationNS) {
+        uint64_t period, computation;
+        nanoseconds_to_absolutetime(1000000000/REAC_PACKETS_PER_SECOND, &period);
+        nanoseconds_to_absolutetime(computationNS, &computation);
+        
+        thread_time_constraint_policy_data_t policy;
+        policy.period = (uint32_t)period;
+        policy.computation = (uint32_t)computation;
+        policy.constraint = (uint32_t)period;
+        policy.preemptible = TRUE;
+        
+        if (KERN_SUCCESS != thread_policy_set(thread, THREAD_TIME_CONSTRAINT_POLICY,
+                                              (thread_policy_t)&policy, THREAD_TIME_CONSTRAINT_POLICY_COUNT)) {
+            IOLog("REACConnection::configureThread(): Failed to set time constraint policy.\n");
+        }
+    }
+}
+
+void REACConnection::pacingThreadMain(void *param, wait_result_t waitResult) {
+    REACConnection *proto = (REACConnection *)param;
+    UInt64 computationNS = proto->spinNS+1000000000/REAC_PACKETS_PER_SECOND/4;
+    uint64_t wakeTime, deadline;
+    
+    // The spinning is part of the computation. The scheduler demotes threads that
+    // use more than they asked for.
+    if (computationNS > 1000000000/REAC_PACKETS_PER_SECOND) {
+        computationNS = 1000000000/REAC_PACKETS_PER_SECOND;
+    }
+    configureCurrentThread(proto->pacingAffinityTag, computationNS);
+    
+    IOLockLock(proto->pacingLock);
+    while (!proto->pacingShouldStop) {
+        // nextTime is only changed by pacingAction, which runs on this thread
+        nanoseconds_to_absolutetime(proto->nextTime, &deadline);
+        nanoseconds_to_absolutetime(proto->nextTime-proto->spinNS, &wakeTime);
+        
+        if (mach_absolute_time() < wakeTime) {
+            IOLockSleepDeadline(proto->pacingLock, (void *)&proto->pacingShouldStop, wakeTime, THREAD_UNINT);
+            if (proto->pacingShouldStop) {
+                break;
+            }
+        }
+        IOLockUnlock(proto->pacingLock);
+        
+        while (mach_absolute_time() < deadline) {
+            // Spin
+        }
+        proto->filterCommandGate->runAction(&REACConnection::pacingAction);
+        
+        IOLockLock(proto->pacingLock);
+    }
+    IOLockUnlock(proto->pacingLock);
+    
+    OSMemoryBarrier();
+    proto->pacingRunning = false;
+    
+    thread_terminate(current_thread());
+}
+
+IOReturn REACConnection::pacingAction(OSObject *target, void*, void*, void*, void*) {
+    REACConnection *proto = OSDynamicCast(REACConnection, target);
+    if (NULL == proto) {
+        return kIOReturnBadArgument;
+    }
+    proto->periodicWork();
+    return kIOReturnSuccess;
+}
+
+void REACConnection::stopPacingThread() {
+    if (pacingRunning) {
+        IOLockLock(pacingLock);
+        pacingShouldStop = true;
+        IOLockWakeup(pacingLock, (void *)&pacingShouldStop, true);
+        IOLockUnlock(pacingLock);
+        while (pacingRunning) {
+            IOSleep(1);
+        }
+    }
 }
 
 IOReturn REACConnection::getAndSendSamples() {
@@ -331,7 +631,7 @@ IOReturn REACConnection::getAndSendSamples() {
 
 IOReturn REACConnection::sendSamples(UInt32 bufSize, UInt8 *sampleBuffer) {
     REACMasterDataStream *masterDataStream = OSDynamicCast(REACMasterDataStream, dataStream);
-    const UInt32 ourSamplesSize = REAC_SAMPLES_PER_PACKET*REAC_RESOLUTION*
+    const UInt32 ourSamplesSize = samplesPerPacket*REAC_RESOLUTION*
                                 (NULL != masterDataStream ?
                                     inChannels : deviceInfo->out_channels);
     // TODO This is not complete
@@ -344,6 +644,8 @@ IOReturn REACConnection::sendSamples(UInt32 bufSize, UInt8 *sampleBuffer) {
     mbuf_t mbuf = NULL;
     IOReturn result = kIOReturnError;
     IOReturn processPacketRet;
+    REAC_STAGE_DECLARE(buildStart);
+    REAC_STAGE_DECLARE(sendStart);
     
     /// Do some argument checks
     if (!(REAC_SLAVE == mode || REAC_MASTER == mode)) {
@@ -373,8 +675,8 @@ IOReturn REACConnection::sendSamples(UInt32 bufSize, UInt8 *sampleBuffer) {
     }
     
     /// Allocate mbuf
-    if (0 != mbuf_allocpacket(MBUF_DONTWAIT, packetLen, NULL, &mbuf) ||
-        kIOReturnSuccess != MbufUtils::setChainLength(mbuf, packetLen)) {
+    REAC_STAGE_BEGIN(buildStart);
+    if (kIOReturnSuccess != allocatePacket(packetLen, &mbuf)) {
         IOLog("REACConnection::sendSamples() - Error: Failed to allocate packet mbuf.\n");
         goto Done;
     }
@@ -419,13 +721,20 @@ IOReturn REACConnection::sendSamples(UInt32 bufSize, UInt8 *sampleBuffer) {
         IOLog("REACConnection::sendSamples() - Error: Failed to copy ending to packet mbuf.\n");
         goto Done;
     }
+    REAC_STAGE_END(stageProfile, REAC_STAGE_BUILD, buildStart);
+    
+    if (NULL != capture) {
+        capture->writePacket(REAC_CAPTURE_DIRECTION_OUT, rph.getCounter(), NULL, 0, mbuf, 0);
+    }
     
     /// Send packet
+    REAC_STAGE_BEGIN(sendStart);
     if (0 != ifnet_output_raw(interface, 0, mbuf)) {
         mbuf = NULL; // ifnet_output_raw always frees the mbuf
         IOLog("REACConnection::sendSamples() - Error: Failed to send packet.\n");
         goto Done;
     }
+    REAC_STAGE_END(stageProfile, REAC_STAGE_SEND, sendStart);
     
     mbuf = NULL; // ifnet_output_raw always frees the mbuf
     result = kIOReturnSuccess;
@@ -466,8 +775,7 @@ IOReturn REACConnection::sendSplitAnnouncementPacket() {
     }
     
     /// Allocate mbuf
-    if (0 != mbuf_allocpacket(MBUF_DONTWAIT, packetLen, NULL, &mbuf) ||
-        kIOReturnSuccess != MbufUtils::setChainLength(mbuf, packetLen)) {
+    if (kIOReturnSuccess != allocatePacket(packetLen, &mbuf)) {
         IOLog("REACConnection::sendSplitAnnouncementPacket() - Error: Failed to allocate packet mbuf.\n");
         goto Done;
     }
@@ -501,6 +809,10 @@ IOReturn REACConnection::sendSplitAnnouncementPacket() {
         goto Done;
     }
     
+    if (NULL != capture) {
+        capture->writePacket(REAC_CAPTURE_DIRECTION_OUT, rph.getCounter(), NULL, 0, mbuf, 0);
+    }
+    
     /// Send packet
     if (0 != ifnet_output_raw(interface, 0, mbuf)) {
         mbuf = NULL; // ifnet_output_raw always frees the mbuf
@@ -518,6 +830,58 @@ Done:
     return result;
 }
 
+void REACConnection::setRecorder(REACRecorder *newRecorder) {
+    swapObject((OSObject **)&recorder, newRecorder);
+}
+
+void REACConnection::setCapture(REACCapture *newCapture) {
+    swapObject((OSObject **)&capture, newCapture);
+}
+
+void REACConnection::setSharedStream(REACSharedStream *newSharedStream) {
+    swapObject((OSObject **)&sharedStream, newSharedStream);
+}
+
+void REACConnection::setRTPSender(REACRTPSender *newRTPSender) {
+    swapObject((OSObject **)&rtpSender, newRTPSender);
+}
+
+IOMemoryDescriptor *REACConnection::copySharedStreamMemory() {
+    IOMemoryDescriptor *memory = NULL;
+    filterCommandGate->runAction(&REACConnection::copySharedStreamMemoryAction, &memory);
+    return memory;
+}
+
+IOReturn REACConnection::copySharedStreamMemoryAction(OSObject *target, void *memory, void*, void*, void*) {
+    REACConnection *proto = OSDynamicCast(REACConnection, target);
+    if (NULL == proto || NULL == proto->sharedStream) {
+        return kIOReturnNotReady;
+    }
+    *((IOMemoryDescriptor **)memory) = proto->sharedStream->getMemory();
+    (*((IOMemoryDescriptor **)memory))->retain();
+    return kIOReturnSuccess;
+}
+
+void REACConnection::swapObject(OSObject **slot, OSObject *newObject) {
+    OSObject *oldObject = NULL;
+    
+    if (NULL != newObject) {
+        newObject->retain();
+    }
+    filterCommandGate->runAction(&REACConnection::swapObjectAction, slot, newObject, &oldObject);
+    
+    // Releasing an old recorder waits for its writer thread, so it is done outside of the gate
+    if (NULL != oldObject) {
+        oldObject->release();
+    }
+}
+
+IOReturn REACConnection::swapObjectAction(OSObject *target, void *slot, void *newObject, void *oldObject, void*) {
+    *((OSObject **)oldObject) = *((OSObject **)slot);
+    *((OSObject **)slot) = (OSObject *)newObject;
+    return kIOReturnSuccess;
+}
+
 void REACConnection::filterCommandGateMsg(OSObject *target, void *data_mbuf, void *eth_header_ptr, void*, void*) {
     REACConnection *proto = OSDynamicCast(REACConnection, target);
     if (NULL == proto) {
@@ -527,77 +891,129 @@ void REACConnection::filterCommandGateMsg(OSObject *target, void *data_mbuf, voi
     }
     
     const EthernetHeader *ethernetHeader = (const EthernetHeader *)eth_header_ptr;
-    const int samplesSize = REAC_SAMPLES_PER_PACKET*REAC_RESOLUTION*proto->deviceInfo->in_channels;
     
     mbuf_t *data = (mbuf_t *)data_mbuf;
     UInt32 len = MbufUtils::mbufTotalLength(*data);
     REACPacketHeader packetHeader;
+    SourceState *source;
+    bool isNewSource;
+    REAC_STAGE_DECLARE(headerStart);
+    REAC_STAGE_DECLARE(ringStart);
+    REAC_STAGE_DECLARE(copyStart);
+    REAC_STAGE_DECLARE(tapsStart);
     
-    // Check that the packet length is long enough
-    if (len < sizeof(REACPacketHeader)+sizeof(REACConstants::ENDING)) {
-        IOLog("REACConnection[%p]::filterCommandGateMsg(): Got packet of too short length\n", proto);
-        return;
-    }
-        
-    // Check packet ending
-    UInt8 packetEnding[sizeof(REACConstants::ENDING)];
-    if (0 != mbuf_copydata(*data, len-sizeof(REACConstants::ENDING), sizeof(REACConstants::ENDING), &packetEnding)) {
-        IOLog("REACConnection[%p]::filterCommandGateMsg(): Failed to fetch REAC packet ending\n", proto);
-        return;
-    }
-    if (0 != memcmp(packetEnding, REACConstants::ENDING, sizeof(packetEnding))) {
-        // Incorrect ending. Not a REAC packet?
-        IOLog("REACConnection[%p]::filterCommandGateMsg(): Incorrect packet ending.\n", proto);
-        return;
-    }
+    // The length and the ending of the packet have been checked by classifyPacket
     
     // Fetch packet header
+    REAC_STAGE_BEGIN(headerStart);
     if (0 != mbuf_copydata(*data, 0, sizeof(REACPacketHeader), &packetHeader)) {
         IOLog("REACConnection[%p]::filterCommandGateMsg(): Failed to fetch REAC packet header\n", proto);
         return;
     }
     
     // Check packet counter
-    // TODO This doesn't work when more than one unit (for instance two splits) is connected
-    if (proto->isConnected() && /* This prunes a lost packet message when connecting */
-        proto->lastCounter+1 != packetHeader.getCounter()) {
-        if (!(65535 == proto->lastCounter && 0 == packetHeader.getCounter())) {
-            IOLog("REACConnection[%p]::filterCommandGateMsg(): Lost packet [%d %d]\n",
-                  proto, proto->lastCounter, packetHeader.getCounter());
-        }
+    source = proto->lookupSource(ethernetHeader->shost, &isNewSource);
+    if (!isNewSource && /* This prunes a lost packet message when connecting */
+        (UInt16)(source->lastCounter+1) != packetHeader.getCounter()) {
+        IOLog("REACConnection[%p]::filterCommandGateMsg(): Lost packet from %02x:%02x:%02x:%02x:%02x:%02x [%d %d]\n",
+              proto, source->addr[0], source->addr[1], source->addr[2],
+              source->addr[3], source->addr[4], source->addr[5],
+              source->lastCounter, packetHeader.getCounter());
     }
+    source->lastCounter = packetHeader.getCounter();
     
     // Process packet header
     proto->dataStream->gotPacket(&packetHeader, ethernetHeader);
+    REAC_STAGE_END(proto->stageProfile, REAC_STAGE_HEADER, headerStart);
+    
+    if (!proto->isConnected() && 0 == proto->firstPacketTime) {
+        clock_get_uptime(&proto->firstPacketTime);
+    }
+    
+    // Answer the master as soon as it has announced itself, so that each step of
+    // the handshake doesn't have to wait for the periodic announce
+    if (REAC_SPLIT == proto->mode) {
+        REACSplitDataStream *splitDataStream = OSDynamicCast(REACSplitDataStream, proto->dataStream);
+        if (NULL != splitDataStream && splitDataStream->isAnnounceDue()) {
+            proto->lastSentAnnouncementCounter = 0;
+            proto->sendSplitAnnouncementPacket();
+        }
+    }
+    
+    if (NULL != proto->capture) {
+        proto->capture->writePacket(REAC_CAPTURE_DIRECTION_IN, packetHeader.getCounter(),
+                                    ethernetHeader, sizeof(EthernetHeader), *data, 0);
+    }
+    
+    // The engine is created for the geometry the stream has when it connects
+    if (!proto->isConnected() && REAC_MASTER != proto->mode) {
+        proto->updateGeometry(len);
+    }
     
     // Check packet length
+    const UInt32 samplesSize = proto->samplesPerPacket*REAC_RESOLUTION*proto->deviceInfo->in_channels;
     if (sizeof(REACPacketHeader)+samplesSize+sizeof(UInt16) == len) {
         // Hack: Announce connect
         if (!proto->isConnected()) {
+            UInt64 now, ns;
+            clock_get_uptime(&now);
+            absolutetime_to_nanoseconds(now-proto->firstPacketTime, &ns);
+            IOLog("REACConnection[%p]::filterCommandGateMsg(): Connected %llu us after the first packet.\n",
+                  proto, (unsigned long long)(ns/1000));
+            proto->firstPacketTime = 0;
+            
             proto->connected = true;
             if (NULL != proto->connectionCallback) {
                 proto->connectionCallback(proto, &proto->cookieA, &proto->cookieB, proto->deviceInfo);
             }
+            
+            if (NULL != proto->watchdogEventSource) {
+                proto->watchdogEventSource->setTimeoutUS(REAC_WATCHDOG_INTERVAL_US);
+            }
         }
         
-        // Save the time we got the packet, for use by REACConnection::timerFired
+        // Save the time we got the packet, for use by REACConnection::timerFired and the watchdog
         proto->lastSeenConnectionCounter = proto->connectionCounter;
+        clock_get_uptime(&proto->lastPacketTime);
+        if (proto->stalled) {
+            IOLog("REACConnection[%p]::filterCommandGateMsg(): The stream has resumed.\n", proto);
+            proto->stalled = false;
+            if (NULL != proto->stallCallback) {
+                proto->stallCallback(proto, &proto->cookieA, &proto->cookieB, false);
+            }
+        }
         
         if (proto->isConnected()) {
             if (NULL != proto->samplesCallback) {
                 UInt8* inBuffer = NULL;
                 UInt32 inBufferSize = 0;
+                REAC_STAGE_BEGIN(ringStart);
                 proto->samplesCallback(proto, &proto->cookieA, &proto->cookieB, &inBuffer, &inBufferSize);
+                REAC_STAGE_END(proto->stageProfile, REAC_STAGE_RING, ringStart);
                 
                 if (NULL != inBuffer) {
                     const UInt32 bytesPerSample = REAC_RESOLUTION * proto->deviceInfo->in_channels;
-                    const UInt32 bytesPerPacket = bytesPerSample * REAC_SAMPLES_PER_PACKET;
+                    const UInt32 bytesPerPacket = bytesPerSample * proto->samplesPerPacket;
                     
                     if (inBufferSize != bytesPerPacket) {
                         IOLog("REACConnection::filterCommandGateMsg(): Got incorrectly sized buffer (not the same as a packet).\n");
                     }
                     else {
+                        REAC_STAGE_BEGIN(copyStart);
                         MbufUtils::copyAudioFromMbufToBuffer(*data, sizeof(REACPacketHeader), inBufferSize, inBuffer);
+                        REAC_STAGE_END(proto->stageProfile, REAC_STAGE_SAMPLE_COPY, copyStart);
+                        
+                        REAC_STAGE_BEGIN(tapsStart);
+                        if (NULL != proto->recorder) {
+                            proto->recorder->writeSamples(inBuffer, inBufferSize);
+                        }
+                        if (NULL != proto->sharedStream) {
+                            proto->sharedStream->writeSamples(inBuffer, inBufferSize);
+                        }
+                        if (NULL != proto->rtpSender) {
+                            proto->rtpSender->writePacket(packetHeader.getCounter(), inBuffer);
+                        }
+                        REAC_STAGE_END(proto->stageProfile, REAC_STAGE_TAPS, tapsStart);
                     }
                 }
             }
@@ -607,10 +1023,253 @@ void REACConnection::filterCommandGateMsg(OSObject *target, void *data_mbuf, voi
     if (REAC_SLAVE == proto->mode) {
         proto->getAndSendSamples();
     }
+}
+
+REACConnection::SourceState *REACConnection::lookupSource(const UInt8 *addr, bool *isNew) {
+    const UInt32 count = (sourceCount < REAC_MAX_SOURCES) ? sourceCount : REAC_MAX_SOURCES;
+    SourceState *source;
+    
+    for (UInt32 i=0; i<count; i++) {
+        if (0 == memcmp(sources[i].addr, addr, ETHER_ADDR_LEN)) {
+            *isNew = false;
+            return &sources[i];
+        }
+    }
     
-    proto->lastCounter = packetHeader.getCounter();
+    // When the table is full, the entries are reused in the order they were added
+    source = &sources[sourceCount % REAC_MAX_SOURCES];
+    sourceCount++;
+    memcpy(source->addr, addr, ETHER_ADDR_LEN);
+    source->lastCounter = 0;
+    *isNew = true;
+    return source;
 }
 
+bool REACConnection::classifyPacket(mbuf_t data, const EthernetHeader *header) {
+    REAC_STAGE_DECLARE(classifyStart);
+    bool result;
+    
+    REAC_STAGE_BEGIN(classifyStart);
+    result = isAllowedSource(header->shost) && isREACPacket(data);
+    REAC_STAGE_END(stageProfile, REAC_STAGE_CLASSIFY, classifyStart);
+    return result;
+}
+
+bool REACConnection::isAllowedSource(const UInt8 *addr) {
+    if (0 != allowedSourceCount) {
+        UInt32 i;
+        for (i=0; i<allowedSourceCount; i++) {
+            if (0 == memcmp(allowedSources[i], addr, ETHER_ADDR_LEN)) {
+                break;
+            }
+        }
+        if (allowedSourceCount == i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool REACConnection::isREACPacket(mbuf_t data) {
+    UInt8 packetEnding[sizeof(REACConstants::ENDING)];
+    const UInt32 len = MbufUtils::mbufTotalLength(data);
+    
+    if (len < sizeof(REACPacketHeader)+sizeof(REACConstants::ENDING)) {
+        return false;
+    }
+    
+    if (0 != mbuf_copydata(data, len-sizeof(REACConstants::ENDING), sizeof(REACConstants::ENDING), &packetEnding)) {
+        return false;
+    }
+    return 0 == memcmp(packetEnding, REACConstants::ENDING, sizeof(packetEnding));
+}
+
+IOReturn REACConnection::addAllowedSource(const UInt8 *addr) {
+    if (started) {
+        return kIOReturnBusy;
+    }
+    if (REAC_MAX_ALLOWED_SOURCES == allowedSourceCount) {
+        return kIOReturnNoSpace;
+    }
+    memcpy(allowedSources[allowedSourceCount++], addr, ETHER_ADDR_LEN);
+    return kIOReturnSuccess;
+}
+
+bool REACConnection::parseMacAddress(const char *str, UInt8 *addr) {
+    for (int i=0; i<ETHER_ADDR_LEN; i++) {
+        UInt32 value = 0;
+        for (int j=0; j<2; j++) {
+            const char c = *str++;
+            if (c >= '0' && c <= '9')      value = value*16 + (c-'0');
+            else if (c >= 'a' && c <= 'f') value = value*16 + (c-'a'+10);
+            else if (c >= 'A' && c <= 'F') value = value*16 + (c-'A'+10);
+            else return false;
+        }
+        addr[i] = value;
+        if (*str != (ETHER_ADDR_LEN-1 == i ? '\0' : ':')) {
+            return false;
+        }
+        str++;
+    }
+    return true;
+}
+
+
+IOReturn REACConnection::setSamplesPerPacket(UInt32 samplesPerPacket_) {
+    if (started) {
+        return kIOReturnBusy;
+    }
+    if (0 == samplesPerPacket_ || samplesPerPacket_ > REAC_MAX_SAMPLES_PER_PACKET) {
+        return kIOReturnBadArgument;
+    }
+    samplesPerPacket = samplesPerPacket_;
+    return kIOReturnSuccess;
+}
+
+UInt32 REACConnection::freezeGeometry() {
+    UInt32 samples = samplesPerPacket;
+    filterCommandGate->runAction(&REACConnection::freezeGeometryAction, &samples);
+    return samples;
+}
+
+IOReturn REACConnection::freezeGeometryAction(OSObject *target, void *samplesPerPacket, void*, void*, void*) {
+    REACConnection *proto = OSDynamicCast(REACConnection, target);
+    if (NULL == proto) {
+        return kIOReturnBadArgument;
+    }
+    proto->geometryFrozen = true;
+    proto->candidatePackets = 0;
+    *((UInt32 *)samplesPerPacket) = proto->samplesPerPacket;
+    return kIOReturnSuccess;
+}
+
+void REACConnection::updateGeometry(UInt32 packetLength) {
+    const UInt32 bytesPerSample = REAC_RESOLUTION*deviceInfo->in_channels;
+    const UInt32 samplesLength = packetLength-sizeof(REACPacketHeader)-sizeof(REACConstants::ENDING);
+    const UInt32 samples = samplesLength/bytesPerSample;
+    
+    if (0 == bytesPerSample || 0 != samplesLength % bytesPerSample ||
+        0 == samples || samples > REAC_MAX_SAMPLES_PER_PACKET || samples == samplesPerPacket) {
+        candidatePackets = 0;
+        return;
+    }
+    
+    if (samples != candidateSamplesPerPacket) {
+        candidateSamplesPerPacket = samples;
+        candidatePackets = 0;
+    }
+    if (candidatePackets >= REAC_GEOMETRY_AGREEMENT_PACKETS) {
+        // Only happens when frozen; it has been logged already
+        return;
+    }
+    if (++candidatePackets < REAC_GEOMETRY_AGREEMENT_PACKETS) {
+        return;
+    }
+    
+    if (geometryFrozen) {
+        IOLog("REACConnection[%p]::updateGeometry(): The stream has %d samples per packet, but the audio engine has %d.\n",
+              this, (int)samples, (int)samplesPerPacket);
+        return;
+    }
+    
+    IOLog("REACConnection[%p]::updateGeometry(): The stream has %d samples per packet.\n", this, (int)samples);
+    samplesPerPacket = samples;
+    candidatePackets = 0;
+}
+
+void REACConnection::setStallCallback(reac_stall_callback_t stallCallback_) {
+    if (!started) {
+        stallCallback = stallCallback_;
+    }
+}
+
+void REACConnection::setTransport(REACTransport transport_) {
+    if (!started) {
+        transport = transport_;
+    }
+}
+
+IOReturn REACConnection::attachTransport() {
+    if (REAC_TRANSPORT_PROTOCOL == transport) {
+        struct ifnet_demux_desc demux;
+        struct ifnet_attach_proto_param param;
+        
+        // The protocol input function has no cookie, so the connection is found by protocol family
+        for (protocolSlot = 0; protocolSlot < REAC_MAX_PROTOCOL_CONNECTIONS; protocolSlot++) {
+            if (OSCompareAndSwapPtr(NULL, this, (void * volatile *)&protocolConnections[protocolSlot])) {
+                break;
+            }
+        }
+        if (REAC_MAX_PROTOCOL_CONNECTIONS == protocolSlot) {
+            IOLog("REACConnection::attachTransport() - Error: Too many protocol connections.\n");
+            protocolSlot = -1;
+            return kIOReturnNoResources;
+        }
+        
+        memset(&demux, 0, sizeof(demux));
+        demux.type = DLIL_DESC_ETYPE2;
+        demux.data = (void *)REACConstants::PROTOCOL; // Already in network byte order
+        demux.datalen = sizeof(REACConstants::PROTOCOL);
+        
+        memset(&param, 0, sizeof(param));
+        param.demux_array = &demux;
+        param.demux_count = 1;
+        param.input = &REACConnection::protocolInputFunc;
+        
+        if (0 != ifnet_attach_protocol(interface, REAC_PROTOCOL_FAMILY_BASE+protocolSlot, &param)) {
+            IOLog("REACConnection::attachTransport() - Error: Failed to attach protocol.\n");
+            protocolConnections[protocolSlot] = NULL;
+            protocolSlot = -1;
+            return kIOReturnError;
+        }
+        return kIOReturnSuccess;
+    }
+    
+    iff_filter filter;
+    filter.iff_cookie = this;
+    filter.iff_name = "REAC driver input filter";
+    filter.iff_protocol = 0;
+    filter.iff_input = &REACConnection::filterInputFunc;
+    filter.iff_output = NULL;
+    filter.iff_event = NULL;
+    filter.iff_ioctl = NULL;
+    filter.iff_detached = &REACConnection::filterDetachedFunc;
+    
+    if (0 != iflt_attach(interface, &filter, &filterRef)) {
+        return kIOReturnError;
+    }
+    return kIOReturnSuccess;
+}
+
+void REACConnection::detachTransport() {
+    if (REAC_TRANSPORT_PROTOCOL == transport) {
+        if (-1 != protocolSlot) {
+            ifnet_detach_protocol(interface, REAC_PROTOCOL_FAMILY_BASE+protocolSlot);
+            OSMemoryBarrier();
+            protocolConnections[protocolSlot] = NULL;
+            protocolSlot = -1;
+        }
+    }
+    else {
+        iflt_detach(filterRef);
+    }
+}
+
+errno_t REACConnection::protocolInputFunc(ifnet_t interface,
+                                          protocol_family_t protocol,
+                                          mbuf_t packet,
+                                          char *header) {
+    const UInt32 slot = protocol-REAC_PROTOCOL_FAMILY_BASE;
+    REACConnection *proto = (slot < REAC_MAX_PROTOCOL_CONNECTIONS) ? protocolConnections[slot] : NULL;
+    
+    // The interface has already matched the REAC ethertype
+    if (NULL != proto && proto->classifyPacket(packet, (const EthernetHeader *)header)) {
+        proto->filterCommandGate->runCommand(&packet, header);
+    }
+    
+    mbuf_freem(packet);
+    return 0;
+}
 
 errno_t REACConnection::filterInputFunc(void *cookie,
                                         ifnet_t interface, 
@@ -624,6 +1283,9 @@ errno_t REACConnection::filterInputFunc(void *cookie,
         // This is not a REAC packet. Ignore.
         return 0; // Continue normal processing of the package.
     }
+    if (!proto->classifyPacket(*data, header)) {
+        return 0;
+    }
         
     proto->filterCommandGate->runCommand(data, header);
     
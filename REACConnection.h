@@ -32,10 +32,17 @@
 #include <net/kpi_interface.h>
 #include <sys/kpi_mbuf.h>
 #include <net/kpi_interfacefilter.h>
+#include <kern/thread.h>
 
 #include "REACDataStream.h"
 #include "REACConstants.h"
 #include "EthernetHeader.h"
+#include "REACRecorder.h"
+#include "REACCapture.h"
+#include "REACSharedStream.h"
+#include "REACRTPSender.h"
+#include "REACMbufPool.h"
+#include "REACStageProfile.h"
 
 #define REACConnection              com_pereckerdal_driver_REACConnection
 
@@ -48,6 +55,11 @@ typedef void(*reac_samples_callback_t)(REACConnection *proto, void **cookieA, vo
 // Is only called when in REAC_MASTER or REAC_SLAVE mode and the connection callback has
 // indicated that there is a connection.
 typedef void(*reac_get_samples_callback_t)(REACConnection *proto, void **cookieA, void **cookieB, UInt8 **data, UInt32 *bufferSize);
+// Is called with stalled true when a connected stream has had no packets for a few
+// packet periods, and with stalled false when it resumes. The connection stays up
+// while stalled; if the stream doesn't resume, the connection callback reports a
+// disconnect later on, which ends the stall without another call.
+typedef void(*reac_stall_callback_t)(REACConnection *proto, void **cookieA, void **cookieB, bool stalled);
 
 
 // This class is not thread safe; the only functions that can be called
@@ -88,13 +100,68 @@ public:
     bool start();
     void stop();
     
+    // Makes the connection do its periodic work (sending packets in REAC_MASTER
+    // mode) on a real time thread of its own instead of the work loop timer. The
+    // thread blocks until spinMicroseconds before each deadline and then spins
+    // until it is due, which keeps the wakeup latency out of the packet timing at
+    // the cost of spinning a core. Has to be called before start, and is ignored
+    // outside REAC_MASTER mode, where there are no packets to pace.
+    void setPacing(UInt32 spinMicroseconds, UInt32 affinityTag);
+    // Sets the number of packets that are kept allocated for sending, 0 to allocate
+    // each packet when it is sent. When trapAllocations is true, the connection
+    // panics if it has to allocate a packet anyway. Has to be called before start.
+    void setMbufPoolSize(UInt32 numPackets, bool trapAllocations);
+    
+    enum REACTransport {
+        // An interface filter sees every frame on the interface, and takes the REAC ones
+        REAC_TRANSPORT_FILTER,
+        // The connection is attached as a protocol for the REAC ethertype, so the
+        // interface's demux hands it the REAC frames directly and the rest of the
+        // traffic never passes through the driver
+        REAC_TRANSPORT_PROTOCOL
+    };
+    // Has to be called before start. The default is REAC_TRANSPORT_FILTER.
+    void setTransport(REACTransport transport);
+    // Has to be called before start. Stalls are only detected when not in REAC_MASTER mode.
+    void setStallCallback(reac_stall_callback_t stallCallback);
+    // Sets the number of samples per packet. A master sends packets of this size;
+    // otherwise it is where the connection starts out, and it follows the stream
+    // while it isn't connected, until freezeGeometry is called. Has to be called
+    // before start.
+    IOReturn setSamplesPerPacket(UInt32 samplesPerPacket);
+    // Restricts the connection to packets from the given source MAC addresses.
+    // Has to be called before start. When it is never called, packets from any
+    // source are accepted.
+    IOReturn addAllowedSource(const UInt8 *addr);
+    // Checks the length and the ending of a received packet, which starts at the REAC header.
+    static bool isREACPacket(mbuf_t data);
+    // Parses a MAC address of the form "00:40:ab:c4:80:f6".
+    static bool parseMacAddress(const char *str, UInt8 *addr);
+    // Applies an affinity tag (unless it is THREAD_AFFINITY_TAG_NULL) and, if
+    // computationNS isn't 0, a real time policy with one period per REAC packet
+    // to thread.
+    static void configureThread(thread_t thread, UInt32 affinityTag, UInt64 computationNS);
+    static void configureCurrentThread(UInt32 affinityTag, UInt64 computationNS) {
+        configureThread(current_thread(), affinityTag, computationNS);
+    }
+    
     const REACDeviceInfo *getDeviceInfo() const;
     bool isStarted() const { return started; }
     bool isConnected() const { return connected; }
+    bool isStalled() const { return stalled; }
     // If you want to continue using the ifnet_t object, make sure to call
     // ifnet_reference on it, as REACConnection will release it when it is freed.
     ifnet_t getInterface() const { return interface; }
     REACMode getMode() const { return mode; }
+    IOWorkLoop *getWorkLoop() const { return workLoop; }
+    // The packet geometry does not change while the connection is connected
+    UInt32 getSamplesPerPacket() const { return samplesPerPacket; }
+    // Makes the connection keep its current number of samples per packet from now
+    // on, and returns it. Is used when an audio engine is made for the connection,
+    // since an engine can't change its block size; a stream with another geometry
+    // is then not connected to. Can be called from any thread.
+    UInt32 freezeGeometry();
+    UInt32 getSampleRate() const { return REAC_PACKETS_PER_SECOND*samplesPerPacket; }
     IOReturn getInterfaceAddr(UInt32 len, UInt8 *addr) const {
         if (sizeof(interfaceAddr) != len) return kIOReturnBadArgument;
         memcpy(addr, interfaceAddr, len);
@@ -106,24 +173,68 @@ public:
     }
     UInt8 getInChannels() const { return inChannels; }
     UInt8 getOutChannels() const { return outChannels; }
+    
+    // Starts writing the input samples of this connection to recorder, or stops
+    // recording when recorder is NULL. The connection retains the recorder. Note
+    // that replacing a recorder blocks until the old one has flushed its file, so
+    // this is not to be called from the connection's work loop or its callbacks.
+    void setRecorder(REACRecorder *recorder);
+    // Starts or stops capturing the raw packets of this connection, like setRecorder.
+    void setCapture(REACCapture *capture);
+    // Starts or stops publishing the input samples of this connection through
+    // sharedStream, like setRecorder.
+    void setSharedStream(REACSharedStream *sharedStream);
+    // Returns the memory of the current shared stream, retained, or NULL if there
+    // is none. Can be called from any thread.
+    IOMemoryDescriptor *copySharedStreamMemory();
+    // Starts or stops sending the input samples of this connection as RTP streams,
+    // like setRecorder.
+    void setRTPSender(REACRTPSender *rtpSender);
 
 protected:
     // IOKit handles
     IOWorkLoop         *workLoop;
     IOTimerEventSource *timerEventSource;        // Note that the timer runs faster when in REAC_MASTER mode than otherwise
+    IOTimerEventSource *watchdogEventSource;     // Only runs while connected. NULL in REAC_MASTER mode.
     IOCommandGate      *filterCommandGate;
     UInt64              timeoutNS;
     UInt64              nextTime;                // the estimated time the timer will fire next
     
+    // Pacing thread state. Is only used when spinNS isn't 0.
+    UInt64              spinNS;
+    UInt32              pacingAffinityTag;
+    IOLock             *pacingLock;
+    volatile bool       pacingShouldStop;
+    volatile bool       pacingRunning;
+    
+#   define REAC_DEFAULT_MBUF_POOL_SIZE 64
+    REACMbufPool       *mbufPool;                // Exists while started
+    UInt32              mbufPoolSize;
+    bool                trapAllocations;
+    
     // Network handles
     UInt8               interfaceAddr[ETHER_ADDR_LEN];
     ifnet_t             interface;
     interface_filter_t  filterRef;
+    REACTransport       transport;
+    
+    // The connections that use REAC_TRANSPORT_PROTOCOL, indexed by their protocol
+    // family minus REAC_PROTOCOL_FAMILY_BASE
+#   define REAC_MAX_PROTOCOL_CONNECTIONS 16
+#   define REAC_PROTOCOL_FAMILY_BASE 0x52454100 // 'REA\0'
+    static REACConnection * volatile protocolConnections[REAC_MAX_PROTOCOL_CONNECTIONS];
+    SInt32              protocolSlot;
+    
+    // Is only written before start, after that it is read by the input functions
+#   define REAC_MAX_ALLOWED_SOURCES 8
+    UInt8               allowedSources[REAC_MAX_ALLOWED_SOURCES][ETHER_ADDR_LEN];
+    UInt32              allowedSourceCount;
     
     // Callback variables
     reac_connection_callback_t  connectionCallback;
     reac_samples_callback_t     samplesCallback;
     reac_get_samples_callback_t getSamplesCallback;
+    reac_stall_callback_t       stallCallback;
     void *cookieA;
     void *cookieB;
     
@@ -133,25 +244,95 @@ protected:
     UInt64              lastSentAnnouncementCounter;
     UInt16              splitAnnouncementCounter;
     
+    // Packet arrival watchdog. The connection check timer is too coarse to notice
+    // a stream that stops before the audio engine runs out of samples, so a timer
+    // that checks the time of the last packet runs while connected.
+#   define REAC_STALL_PACKETS 16            // Packet periods without packets until the stream counts as stalled
+#   define REAC_WATCHDOG_INTERVAL_US 1000
+    UInt64              lastPacketTime;     // Uptime, in absolute time units
+    UInt64              stallTimeout;       // REAC_STALL_PACKETS packet periods, in absolute time units
+    bool                stalled;
+    // Uptime when the first packet arrived while not connected, for logging the time
+    // until the audio starts. 0 when not measuring.
+    UInt64              firstPacketTime;
+    
     // Connection state variables
     REACMode            mode;
     UInt8               inChannels;  // The number of input channels (seen as outputs in the computer) Only used in REAC_MASTER mode
     UInt8               outChannels; // The number of output channels (seen as inputs in the computer) Only used in REAC_MASTER mode
     bool                started;
     bool                connected;
+    
+    // The number of samples per packet, and the one that the received packets
+    // have had lately if it is different. It is changed once enough packets in
+    // a row agree, so that the occasional packet of another kind doesn't.
+#   define REAC_GEOMETRY_AGREEMENT_PACKETS 16
+    UInt32              samplesPerPacket;
+    UInt32              candidateSamplesPerPacket;
+    UInt32              candidatePackets;
+    bool                geometryFrozen;
     REACDataStream     *dataStream;
     REACDeviceInfo     *deviceInfo;
-    UInt16              lastCounter; // Tracks input REAC counter
+    
+    // Tracks the input REAC counter of each unit that sends to this connection,
+    // so that for instance two splits on the same interface don't look like lost
+    // packets to each other. Is only accessed from within the work loop.
+#   define REAC_MAX_SOURCES 4
+    struct SourceState {
+        UInt8           addr[ETHER_ADDR_LEN];
+        UInt16          lastCounter;
+    };
+    SourceState         sources[REAC_MAX_SOURCES];
+    UInt32              sourceCount;  // The number of sources that have been seen
+    
+    REACRecorder       *recorder;    // Is only accessed from within the work loop
+    REACCapture        *capture;     // Is only accessed from within the work loop
+    REACSharedStream   *sharedStream; // Is only accessed from within the work loop
+    REACRTPSender      *rtpSender;   // Is only accessed from within the work loop
+#ifdef REAC_STAGE_PROFILING
+    REACStageProfile    stageProfile;
+#endif
     
     static void timerFired(OSObject *target, IOTimerEventSource *sender);
+    static void watchdogFired(OSObject *target, IOTimerEventSource *sender);
+    // Does the periodic work of the connection and returns the time until it is due next, in ns.
+    UInt64 periodicWork();
+    static void pacingThreadMain(void *param, wait_result_t waitResult);
+    static IOReturn pacingAction(OSObject *target, void*, void*, void*, void*);
+    void stopPacingThread();
     
     IOReturn getAndSendSamples();
     // When sampleBuffer is NULL, the sample data will be zeros (and bufSize will be disregarded).
     IOReturn sendSamples(UInt32 bufSize, UInt8 *sampleBuffer);
     IOReturn sendSplitAnnouncementPacket();
+    // Gets a packet mbuf chain of length bytes, from the pool if there is one.
+    IOReturn allocatePacket(UInt32 length, mbuf_t *mbuf);
     
+    // Replaces the object in slot on the work loop. The connection retains newObject.
+    void swapObject(OSObject **slot, OSObject *newObject);
+    static IOReturn swapObjectAction(OSObject *target, void *slot, void *newObject, void *oldObject, void*);
+    static IOReturn copySharedStreamMemoryAction(OSObject *target, void *memory, void*, void*, void*);
     static void filterCommandGateMsg(OSObject *target, void *data_mbuf, void *eth_header_ptr, void*, void*);
+    // Returns the state of the unit with the given address. Sets isNew if it
+    // hasn't been seen before.
+    SourceState *lookupSource(const UInt8 *addr, bool *isNew);
+    // Follows the number of samples per packet of the stream, from the length of a
+    // received packet
+    void updateGeometry(UInt32 packetLength);
+    static IOReturn freezeGeometryAction(OSObject *target, void *samplesPerPacket, void*, void*, void*);
+    
+    // Decides whether a frame with the REAC ethertype is for this connection.
+    // Runs on the input thread before the work loop is involved, so anything it
+    // rejects never wakes the work loop.
+    bool classifyPacket(mbuf_t data, const EthernetHeader *header);
+    bool isAllowedSource(const UInt8 *addr);
     
+    IOReturn attachTransport();
+    void detachTransport();
+    static errno_t protocolInputFunc(ifnet_t interface,
+                                     protocol_family_t protocol,
+                                     mbuf_t packet,
+                                     char *header);
     static errno_t filterInputFunc(void *cookie,
                                    ifnet_t interface, 
                                    protocol_family_t protocol,
@@ -32,9 +32,14 @@
 #define REAC_MAX_CHANNEL_COUNT 40
 #define REAC_PACKETS_PER_SECOND 8000
 #define REAC_RESOLUTION 3 // 3 bytes per sample per channel
+// The number of samples per packet that connections start out with. The actual
+// number is per connection and follows the stream, see
+// REACConnection::getSamplesPerPacket. Units that run at other rates send the
+// same number of packets, with more or fewer samples in each.
 #define REAC_SAMPLES_PER_PACKET 12
+#define REAC_MAX_SAMPLES_PER_PACKET 16 // At most REAC_MIX_MAX_FRAMES
 
-#define REAC_SAMPLE_RATE REAC_PACKETS_PER_SECOND * REAC_SAMPLES_PER_PACKET
+#define REAC_SAMPLE_RATE (REAC_PACKETS_PER_SECOND * REAC_SAMPLES_PER_PACKET)
 
 #define REACConstants          com_pereckerdal_driver_REACConstants
 
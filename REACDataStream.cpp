@@ -131,11 +131,15 @@ bool REACDataStream::checkChecksum(const REACPacketHeader *packet) {
 }
 
 UInt8 REACDataStream::applyChecksum(REACPacketHeader *packet) {
+    return applyChecksum(packet->data);
+}
+
+UInt8 REACDataStream::applyChecksum(UInt8 *data) {
     UInt8 sum = 0;
     for (int i=0; i<31; i++)
-        sum += packet->data[i];
+        sum += data[i];
     sum = (256 - (int)sum);
-    packet->data[31] = sum;
+    data[31] = sum;
     return sum;
 }
 
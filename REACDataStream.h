@@ -140,6 +140,7 @@ protected:
         
     static bool checkChecksum(const REACPacketHeader *packet);
     static UInt8 applyChecksum(REACPacketHeader *packet);
+    static UInt8 applyChecksum(UInt8 *data); // data is the 32 byte data part of a packet
     
     static bool isPacketType(const REACPacketHeader *packet, REACStreamType st);
     static bool isControlPacketType(const REACPacketHeader *packet, REACStreamControlPacketType type);
@@ -30,17 +30,27 @@
 #include <IOKit/audio/IOAudioToggleControl.h>
 #include <IOKit/audio/IOAudioDefines.h>
 #include <IOKit/IOLib.h>
+#include <mach/thread_act.h>
+#include <mach/thread_policy.h>
 #include <net/kpi_interface.h>
 
 #include "REACAudioEngine.h"
+#include "REACUserClient.h"
 
 #define super IOAudioDevice
 
 OSDefineMetaClassAndStructors(REACDevice, super)
 
 bool REACDevice::init(OSDictionary *properties) {
+    aggregateEngine = NULL;
+    recordingNumber = 0;
+    benchmark = NULL;
+    numTapsSlots = 0;
+    tapsStopping = false;
+    tapsLock = IOLockAlloc();
+    tapsUpdateLock = IOLockAlloc();
     protocols = OSArray::withCapacity(5);
-    if (NULL == protocols) {
+    if (NULL == protocols || NULL == tapsLock || NULL == tapsUpdateLock) {
         return false;
     }
     
@@ -63,6 +73,8 @@ bool REACDevice::initHardware(IOService *provider)
     if (!createProtocolListeners())
         goto Done;
     
+    startBenchmark();
+    
     result = true;
     
 Done:
@@ -72,22 +84,91 @@ Done:
 
 void REACDevice::stop(IOService *provider)
 {
+    aggregateEngine = NULL;
+    if (NULL != benchmark) {
+        // Waits for the benchmark thread to stop
+        benchmark->release();
+        benchmark = NULL;
+    }
     super::stop(provider);
-    protocols->flushCollection();
+    stopTaps();
+    // The user clients look up connections within the gate
+    if (NULL != getCommandGate()) {
+        getCommandGate()->runAction(&REACDevice::flushConnectionsAction);
+    }
+    else {
+        protocols->flushCollection();
+    }
+}
+
+IOReturn REACDevice::flushConnectionsAction(OSObject *owner, void*, void*, void*, void*) {
+    ((REACDevice*) owner)->protocols->flushCollection();
+    return kIOReturnSuccess;
 }
 
 void REACDevice::free() {
     if (NULL != protocols) {
         protocols->release();
     }
+    if (NULL != benchmark) {
+        benchmark->release();
+    }
+    if (NULL != tapsLock && NULL != tapsUpdateLock) {
+        stopTaps();
+    }
+    if (NULL != tapsLock) {
+        IOLockFree(tapsLock);
+    }
+    if (NULL != tapsUpdateLock) {
+        IOLockFree(tapsUpdateLock);
+    }
     
     super::free();
 }
 
+void REACDevice::startBenchmark() {
+    OSDictionary *benchmarkDict = OSDynamicCast(OSDictionary, getProperty(BENCHMARK_KEY));
+    OSNumber     *streams, *channels, *samples, *seconds, *lossInterval, *burstPackets, *affinityTag;
+    REACBenchmark::Params params;
+    
+    if (NULL == benchmarkDict) {
+        return;
+    }
+    
+    streams = OSDynamicCast(OSNumber, benchmarkDict->getObject(BENCHMARK_STREAMS_KEY));
+    channels = OSDynamicCast(OSNumber, benchmarkDict->getObject(BENCHMARK_CHANNELS_KEY));
+    samples = OSDynamicCast(OSNumber, benchmarkDict->getObject(BENCHMARK_SAMPLES_KEY));
+    seconds = OSDynamicCast(OSNumber, benchmarkDict->getObject(BENCHMARK_SECONDS_KEY));
+    lossInterval = OSDynamicCast(OSNumber, benchmarkDict->getObject(BENCHMARK_LOSS_INTERVAL_KEY));
+    burstPackets = OSDynamicCast(OSNumber, benchmarkDict->getObject(BENCHMARK_BURST_PACKETS_KEY));
+    affinityTag = OSDynamicCast(OSNumber, benchmarkDict->getObject(AFFINITY_TAG_KEY));
+    if (NULL == streams || NULL == channels || NULL == seconds) {
+        IOLog("REACDevice[%p]::startBenchmark() - Error: Invalid benchmark parameters.\n", this);
+        return;
+    }
+    
+    params.numStreams = streams->unsigned32BitValue();
+    params.numChannels = channels->unsigned32BitValue();
+    params.samplesPerPacket = (NULL == samples) ? 0 : samples->unsigned32BitValue();
+    params.seconds = seconds->unsigned32BitValue();
+    params.lossInterval = (NULL == lossInterval) ? 0 : lossInterval->unsigned32BitValue();
+    params.burstPackets = (NULL == burstPackets) ? 1 : burstPackets->unsigned32BitValue();
+    params.affinityTag = (NULL == affinityTag) ? THREAD_AFFINITY_TAG_NULL : affinityTag->unsigned32BitValue();
+    
+    benchmark = REACBenchmark::withParams(&params);
+    if (NULL == benchmark) {
+        IOLog("REACDevice[%p]::startBenchmark() - Error: Failed to start benchmark.\n", this);
+    }
+}
+
 bool REACDevice::createProtocolListeners() {
     OSArray                *interfaceArray = OSDynamicCast(OSArray, getProperty(INTERFACES_KEY));
     OSCollectionIterator   *interfaceIterator;
     OSDictionary           *interfaceDict;
+    OSDictionary           *workLoops;
+    OSArray                *alignmentOffsets;
+    OSNumber               *mbufPoolSize = OSDynamicCast(OSNumber, getProperty(MBUF_POOL_SIZE_KEY));
+    OSBoolean              *trapAllocations = OSDynamicCast(OSBoolean, getProperty(TRAP_ALLOCATIONS_KEY));
 	
     if (!interfaceArray) {
         IOLog("REACDevice[%p]::createProtocolListeners() - Error: no Interface array in personality.\n", this);
@@ -100,9 +181,25 @@ bool REACDevice::createProtocolListeners() {
 		return true;
 	}
     
+    // The work loops are retained by the connections that run on them, so this
+    // dictionary only has to be kept while the connections are being created.
+    workLoops = OSDictionary::withCapacity(interfaceArray->getCount());
+    alignmentOffsets = OSArray::withCapacity(interfaceArray->getCount());
+    if (NULL == workLoops || NULL == alignmentOffsets) {
+        if (NULL != workLoops) workLoops->release();
+        if (NULL != alignmentOffsets) alignmentOffsets->release();
+        interfaceIterator->release();
+        return false;
+    }
+    
     while ((interfaceDict = (OSDictionary*)interfaceIterator->getNextObject())) {
         OSString       *ifname = OSDynamicCast(OSString, interfaceDict->getObject(INTERFACE_NAME_KEY));
 		REACConnection *protocol = NULL;
+        IOWorkLoop     *workLoop;
+        OSNumber       *spinMicroseconds;
+        OSString       *transport;
+        OSNumber       *samplesPerPacket;
+        OSArray        *sourceAddresses;
         ifnet_t interface;
         
         if (NULL == ifname) {
@@ -110,13 +207,20 @@ bool REACDevice::createProtocolListeners() {
             goto Next;
         }
         
+        workLoop = workLoopForInterface(interfaceDict, workLoops);
+        if (NULL == workLoop) {
+            IOLog("REACDevice[%p]::createProtocolListeners() - Error: failed to create work loop for '%s'.\n",
+                  this, ifname->getCStringNoCopy());
+            goto Next;
+        }
+        
         if (0 != ifnet_find_by_name(ifname->getCStringNoCopy(), &interface)) {
             IOLog("REACDevice[%p]::createProtocolListeners() - Error: failed to find interface '%s'.\n",
                   this, ifname->getCStringNoCopy());
             goto Next;
         }
         
-        protocol = REACConnection::withInterface(getWorkLoop(),
+        protocol = REACConnection::withInterface(workLoop,
                                                  interface,
                                                  REACConnection::REAC_SPLIT,
                                                  &REACDevice::connectionCallback,
@@ -134,6 +238,44 @@ bool REACDevice::createProtocolListeners() {
             goto Next;
         }
         
+        if (NULL != mbufPoolSize || (NULL != trapAllocations && trapAllocations->isTrue())) {
+            protocol->setMbufPoolSize(NULL == mbufPoolSize ? REAC_DEFAULT_MBUF_POOL_SIZE : mbufPoolSize->unsigned32BitValue(),
+                                      NULL != trapAllocations && trapAllocations->isTrue());
+        }
+        
+        protocol->setStallCallback(&REACDevice::stallCallback);
+        
+        transport = OSDynamicCast(OSString, interfaceDict->getObject(TRANSPORT_KEY));
+        if (NULL != transport && transport->isEqualTo("Protocol")) {
+            protocol->setTransport(REACConnection::REAC_TRANSPORT_PROTOCOL);
+        }
+        
+        samplesPerPacket = OSDynamicCast(OSNumber, interfaceDict->getObject(SAMPLES_PER_PACKET_KEY));
+        if (NULL != samplesPerPacket &&
+            kIOReturnSuccess != protocol->setSamplesPerPacket(samplesPerPacket->unsigned32BitValue())) {
+            IOLog("REACDevice[%p]::createProtocolListeners() - Error: invalid samples per packet for '%s'.\n",
+                  this, ifname->getCStringNoCopy());
+        }
+        
+        sourceAddresses = OSDynamicCast(OSArray, interfaceDict->getObject(SOURCE_ADDRESSES_KEY));
+        for (UInt32 i=0; NULL != sourceAddresses && i<sourceAddresses->getCount(); i++) {
+            OSString *sourceAddress = OSDynamicCast(OSString, sourceAddresses->getObject(i));
+            UInt8 addr[ETHER_ADDR_LEN];
+            if (NULL == sourceAddress ||
+                !REACConnection::parseMacAddress(sourceAddress->getCStringNoCopy(), addr) ||
+                kIOReturnSuccess != protocol->addAllowedSource(addr)) {
+                IOLog("REACDevice[%p]::createProtocolListeners() - Error: invalid source address for '%s'.\n",
+                      this, ifname->getCStringNoCopy());
+            }
+        }
+        
+        spinMicroseconds = OSDynamicCast(OSNumber, interfaceDict->getObject(PACING_SPIN_MICROSECONDS_KEY));
+        if (NULL != spinMicroseconds) {
+            OSNumber *affinityTag = OSDynamicCast(OSNumber, interfaceDict->getObject(AFFINITY_TAG_KEY));
+            protocol->setPacing(spinMicroseconds->unsigned32BitValue(),
+                                NULL == affinityTag ? THREAD_AFFINITY_TAG_NULL : affinityTag->unsigned32BitValue());
+        }
+        
         if (!protocol->start()) {
             IOLog("REACDevice[%p]::createProtocolListeners() - Error: failed to listen to '%s'.\n",
                   this, ifname->getCStringNoCopy());
@@ -146,23 +288,150 @@ bool REACDevice::createProtocolListeners() {
             goto Next;
         }
         
+        if (isAggregate()) {
+            OSNumber *alignmentOffset = OSDynamicCast(OSNumber, interfaceDict->getObject(ALIGNMENT_OFFSET_KEY));
+            OSNumber *zero = NULL;
+            if (NULL == alignmentOffset) {
+                alignmentOffset = zero = OSNumber::withNumber((unsigned long long)0, 32);
+            }
+            if (NULL == alignmentOffset || !alignmentOffsets->setObject(alignmentOffset)) {
+                // The offsets have to match up with the protocols array
+                IOLog("REACDevice[%p]::createProtocolListeners(): Failed to store alignment offset for '%s'.\n",
+                      this, ifname->getCStringNoCopy());
+                protocols->removeObject(protocols->getCount()-1);
+            }
+            if (NULL != zero) {
+                zero->release();
+            }
+        }
+        
     Next:
         if (NULL != protocol) {
             protocol->release();
         }
     }
 	
+    if (isAggregate() && 0 != protocols->getCount()) {
+        aggregateEngine = createAudioEngine(protocols, alignmentOffsets);
+        if (NULL == aggregateEngine) {
+            IOLog("REACDevice[%p]::createProtocolListeners() - Error: failed to create aggregate audio engine.\n", this);
+        }
+    }
+	
+    alignmentOffsets->release();
+    workLoops->release();
     interfaceIterator->release();
     return true;
 }
 
+bool REACDevice::isAggregate() {
+    OSDictionary *audioEngineParams = OSDynamicCast(OSDictionary, getProperty(AUDIO_ENGINE_PARAMS_KEY));
+    OSBoolean    *aggregate = NULL;
+    
+    if (NULL != audioEngineParams) {
+        aggregate = OSDynamicCast(OSBoolean, audioEngineParams->getObject(AGGREGATE_KEY));
+    }
+    return NULL != aggregate && aggregate->isTrue();
+}
+
+IOWorkLoop *REACDevice::workLoopForInterface(OSDictionary *interfaceDict, OSDictionary *workLoops) {
+    OSNumber   *group = OSDynamicCast(OSNumber, interfaceDict->getObject(WORK_LOOP_GROUP_KEY));
+    OSNumber   *affinityTag = OSDynamicCast(OSNumber, interfaceDict->getObject(AFFINITY_TAG_KEY));
+    OSBoolean  *realTime = OSDynamicCast(OSBoolean, interfaceDict->getObject(REAL_TIME_WORK_LOOP_KEY));
+    IOWorkLoop *workLoop;
+    char        groupKey[16];
+    
+    // Interfaces that don't specify a group share the device's work loop
+    if (NULL == group) {
+        return getWorkLoop();
+    }
+    
+    snprintf(groupKey, sizeof(groupKey), "%u", group->unsigned32BitValue());
+    workLoop = OSDynamicCast(IOWorkLoop, workLoops->getObject(groupKey));
+    if (NULL != workLoop) {
+        // The thread of the group was configured by the first interface in it
+        return workLoop;
+    }
+    
+    workLoop = IOWorkLoop::workLoop();
+    if (NULL == workLoop) {
+        return NULL;
+    }
+    if (!workLoops->setObject(groupKey, workLoop)) {
+        workLoop->release();
+        return NULL;
+    }
+    workLoop->release(); // workLoops keeps it alive
+    
+    // The work loop has to wake up once for every REAC packet in master mode
+    REACConnection::configureThread(workLoop->getThread(),
+                                    NULL == affinityTag ? THREAD_AFFINITY_TAG_NULL : affinityTag->unsigned32BitValue(),
+                                    NULL != realTime && realTime->isTrue() ? 1000000000/REAC_PACKETS_PER_SECOND/4 : 0);
+    
+    return workLoop;
+}
+
 void REACDevice::connectionCallback(REACConnection *proto, void **cookieA, void** cookieB, REACDeviceInfo *deviceInfo) {
     REACDevice *device = (REACDevice*) *cookieA;
+    IOCommandGate *gate = device->getCommandGate();
+    
+    // The connection might run on a work loop of its own, so audio engines are
+    // created and stopped within the device's command gate.
+    if (NULL != gate) {
+        gate->runAction(&REACDevice::connectionAction, proto, cookieB, deviceInfo);
+    }
+    else {
+        connectionAction(device, proto, cookieB, deviceInfo, NULL);
+    }
+}
+
+void REACDevice::stallCallback(REACConnection *proto, void **cookieA, void** cookieB, bool stalled) {
+    REACDevice *device = (REACDevice*) *cookieA;
+    IOCommandGate *gate = device->getCommandGate();
+    
+    if (!device->isAggregate()) {
+        return;
+    }
+    
+    if (NULL != gate) {
+        gate->runAction(&REACDevice::stallAction, proto, (void*) stalled);
+    }
+    else {
+        stallAction(device, proto, (void*) stalled, NULL, NULL);
+    }
+}
+
+IOReturn REACDevice::stallAction(OSObject *owner, void *proto_, void *stalled, void*, void*) {
+    REACDevice *device = (REACDevice*) owner;
+    REACConnection *proto = (REACConnection*) proto_;
+    
+    // To the aggregate engine a stalled source is as good as disconnected
+    if (NULL != device->aggregateEngine) {
+        device->aggregateEngine->connectionChanged(proto, NULL == stalled);
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn REACDevice::connectionAction(OSObject *owner, void *proto_, void *cookieB_, void *deviceInfo_, void*) {
+    REACDevice *device = (REACDevice*) owner;
+    REACConnection *proto = (REACConnection*) proto_;
+    void **cookieB = (void**) cookieB_;
+    REACDeviceInfo *deviceInfo = (REACDeviceInfo*) deviceInfo_;
+    
+    device->scheduleTapsUpdate(proto, deviceInfo);
+    
+    if (device->isAggregate()) {
+        // The aggregate engine keeps running when its sources come and go
+        if (NULL != device->aggregateEngine) {
+            device->aggregateEngine->connectionChanged(proto, NULL != deviceInfo);
+        }
+        return kIOReturnSuccess;
+    }
 
     if (NULL == *cookieB) {
         *cookieB = (void*) device->createAudioEngine(proto);
     }
-    return; // TODO Debug
+    return kIOReturnSuccess; // TODO Debug
     
     REACAudioEngine *engine = (REACAudioEngine*) *cookieB;
     
@@ -181,33 +450,358 @@ void REACDevice::connectionCallback(REACConnection *proto, void **cookieA, void*
         
         *cookieB = (void*) device->createAudioEngine(proto);
     }
+    
+    return kIOReturnSuccess;
+}
+
+void REACDevice::scheduleTapsUpdate(REACConnection *proto, REACDeviceInfo *deviceInfo) {
+    TapsSlot *slot = NULL;
+    
+    IOLockLock(tapsLock);
+    if (tapsStopping) {
+        // The connections release their taps themselves when they are freed
+        IOLockUnlock(tapsLock);
+        return;
+    }
+    for (UInt32 i=0; i<numTapsSlots; i++) {
+        if (proto == tapsSlots[i].proto) {
+            slot = &tapsSlots[i];
+            break;
+        }
+    }
+    if (NULL == slot && numTapsSlots < REAC_MAX_TAPS_SLOTS) {
+        slot = &tapsSlots[numTapsSlots];
+        slot->device = this;
+        slot->proto = proto;
+        slot->deviceInfo = NULL;
+        slot->call = thread_call_allocate(&REACDevice::tapsCallMain, slot);
+        if (NULL == slot->call) {
+            slot = NULL;
+        }
+        else {
+            proto->retain();
+            numTapsSlots++;
+        }
+    }
+    if (NULL == slot) {
+        IOLockUnlock(tapsLock);
+        IOLog("REACDevice[%p]::scheduleTapsUpdate() - Error: Out of slots.\n", this);
+        return;
+    }
+    
+    // If the call is already pending, it picks up the latest state when it runs
+    slot->deviceInfo = deviceInfo;
+    thread_call_enter(slot->call);
+    IOLockUnlock(tapsLock);
+}
+
+void REACDevice::tapsCallMain(thread_call_param_t param0, thread_call_param_t) {
+    TapsSlot *slot = (TapsSlot *)param0;
+    REACDevice *device = slot->device;
+    
+    IOLockLock(device->tapsUpdateLock);
+    REACDeviceInfo *deviceInfo = slot->deviceInfo;
+    device->updateRecorder(slot->proto, deviceInfo);
+    device->updateCapture(slot->proto, deviceInfo);
+    device->updateSharedStream(slot->proto, deviceInfo);
+    device->updateRTPSender(slot->proto, deviceInfo);
+    IOLockUnlock(device->tapsUpdateLock);
+}
+
+void REACDevice::stopTaps() {
+    IOLockLock(tapsLock);
+    tapsStopping = true;
+    IOLockUnlock(tapsLock);
+    
+    // No slots are added from now on
+    for (UInt32 i=0; i<numTapsSlots; i++) {
+        thread_call_cancel_wait(tapsSlots[i].call);
+        thread_call_free(tapsSlots[i].call);
+        tapsSlots[i].proto->release();
+    }
+    numTapsSlots = 0;
+}
+
+void REACDevice::updateRecorder(REACConnection *proto, REACDeviceInfo *deviceInfo) {
+    OSString     *recordPath = OSDynamicCast(OSString, getProperty(RECORD_PATH_KEY));
+    OSString     *recordFormat = OSDynamicCast(OSString, getProperty(RECORD_FORMAT_KEY));
+    OSNumber     *recordRingSize = OSDynamicCast(OSNumber, getProperty(RECORD_RING_SIZE_KEY));
+    REACRecorder::FileFormat format = REACRecorder::FORMAT_CAF;
+    REACRecorder *recorder;
+    ifnet_t       interface = proto->getInterface();
+    char          path[1024];
+    
+    if (NULL == recordPath) {
+        return;
+    }
+    
+    // A disconnect ends the current recording, and a new connection starts a new file.
+    proto->setRecorder(NULL);
+    if (NULL == deviceInfo) {
+        return;
+    }
+    
+    if (NULL != recordFormat && recordFormat->isEqualTo("RF64")) {
+        format = REACRecorder::FORMAT_RF64;
+    }
+    
+    snprintf(path, sizeof(path), "%s-%s%d-%u.%s", recordPath->getCStringNoCopy(),
+             ifnet_name(interface), ifnet_unit(interface), (unsigned int)recordingNumber++,
+             (REACRecorder::FORMAT_RF64 == format ? "wav" : "caf"));
+    
+    recorder = REACRecorder::withPath(path, format, deviceInfo->in_channels, proto->getSampleRate(),
+                                      (NULL == recordRingSize ? REAC_DEFAULT_RECORD_RING_SIZE : recordRingSize->unsigned32BitValue()));
+    if (NULL == recorder) {
+        IOLog("REACDevice[%p]::updateRecorder() - Error: Failed to start recording to '%s'.\n", this, path);
+        return;
+    }
+    
+    proto->setRecorder(recorder);
+    recorder->release();
+}
+
+void REACDevice::updateCapture(REACConnection *proto, REACDeviceInfo *deviceInfo) {
+    OSString     *capturePath = OSDynamicCast(OSString, getProperty(CAPTURE_PATH_KEY));
+    OSNumber     *recordRingSize = OSDynamicCast(OSNumber, getProperty(RECORD_RING_SIZE_KEY));
+    REACCapture  *capture;
+    ifnet_t       interface = proto->getInterface();
+    UInt32        maxPacketLength;
+    char          path[1024];
+    
+    if (NULL == capturePath) {
+        return;
+    }
+    
+    proto->setCapture(NULL);
+    if (NULL == deviceInfo) {
+        return;
+    }
+    
+    snprintf(path, sizeof(path), "%s-%s%d-%u.reaccap", capturePath->getCStringNoCopy(),
+             ifnet_name(interface), ifnet_unit(interface), (unsigned int)recordingNumber++);
+    
+    // Big enough for both directions, including the slave data that a master forwards
+    maxPacketLength = sizeof(EthernetHeader)+sizeof(REACPacketHeader)+sizeof(REACConstants::ENDING)+
+        proto->getSamplesPerPacket()*REAC_RESOLUTION*(deviceInfo->in_channels+deviceInfo->out_channels);
+    
+    capture = REACCapture::withPath(path, maxPacketLength, deviceInfo->in_channels, deviceInfo->out_channels,
+                                    (NULL == recordRingSize ? REAC_DEFAULT_RECORD_RING_SIZE : recordRingSize->unsigned32BitValue()));
+    if (NULL == capture) {
+        IOLog("REACDevice[%p]::updateCapture() - Error: Failed to start capturing to '%s'.\n", this, path);
+        return;
+    }
+    
+    proto->setCapture(capture);
+    capture->release();
+}
+
+void REACDevice::updateSharedStream(REACConnection *proto, REACDeviceInfo *deviceInfo) {
+    OSNumber         *sharedStreamFrames = OSDynamicCast(OSNumber, getProperty(SHARED_STREAM_FRAMES_KEY));
+    REACSharedStream *sharedStream;
+    
+    if (NULL == sharedStreamFrames) {
+        return;
+    }
+    
+    // Readers that have the old stream mapped see that it is closed
+    proto->setSharedStream(NULL);
+    if (NULL == deviceInfo) {
+        return;
+    }
+    
+    sharedStream = REACSharedStream::withChannels(deviceInfo->in_channels, proto->getSampleRate(),
+                                                  sharedStreamFrames->unsigned32BitValue());
+    if (NULL == sharedStream) {
+        IOLog("REACDevice[%p]::updateSharedStream() - Error: Failed to create shared stream.\n", this);
+        return;
+    }
+    
+    proto->setSharedStream(sharedStream);
+    sharedStream->release();
+}
+
+void REACDevice::updateRTPSender(REACConnection *proto, REACDeviceInfo *deviceInfo) {
+    OSArray      *streamArray = OSDynamicCast(OSArray, getProperty(RTP_STREAMS_KEY));
+    REACRTPSender::StreamParams params[REAC_RTP_MAX_STREAMS];
+    UInt32        numStreams = 0;
+    REACRTPSender *rtpSender;
+    
+    if (NULL == streamArray) {
+        return;
+    }
+    
+    proto->setRTPSender(NULL);
+    if (NULL == deviceInfo) {
+        return;
+    }
+    
+    for (UInt32 i=0; i<streamArray->getCount(); i++) {
+        OSDictionary *streamDict = OSDynamicCast(OSDictionary, streamArray->getObject(i));
+        OSString     *address = NULL;
+        OSNumber     *port = NULL, *firstChannel = NULL, *channels = NULL, *packets = NULL, *payloadType = NULL;
+        
+        // params[numStreams] is written to while the entry is parsed
+        if (REAC_RTP_MAX_STREAMS == numStreams) {
+            IOLog("REACDevice[%p]::updateRTPSender() - Too many RTP streams.\n", this);
+            break;
+        }
+        
+        if (NULL != streamDict) {
+            address = OSDynamicCast(OSString, streamDict->getObject(RTP_ADDRESS_KEY));
+            port = OSDynamicCast(OSNumber, streamDict->getObject(RTP_PORT_KEY));
+            firstChannel = OSDynamicCast(OSNumber, streamDict->getObject(RTP_FIRST_CHANNEL_KEY));
+            channels = OSDynamicCast(OSNumber, streamDict->getObject(RTP_CHANNELS_KEY));
+            packets = OSDynamicCast(OSNumber, streamDict->getObject(RTP_PACKETS_KEY));
+            payloadType = OSDynamicCast(OSNumber, streamDict->getObject(RTP_PAYLOAD_TYPE_KEY));
+        }
+        
+        if (NULL == address || NULL == port || NULL == firstChannel || NULL == channels ||
+            0 == firstChannel->unsigned32BitValue() ||
+            !REACRTPSender::parseAddress(address->getCStringNoCopy(), &params[numStreams].address)) {
+            IOLog("REACDevice[%p]::updateRTPSender() - Ignoring invalid RTP stream %d.\n", this, (int)i);
+            continue;
+        }
+        
+        params[numStreams].port = port->unsigned16BitValue();
+        params[numStreams].firstChannel = firstChannel->unsigned32BitValue()-1;
+        params[numStreams].numChannels = channels->unsigned32BitValue();
+        params[numStreams].packetsPerRTPPacket = (NULL == packets) ? 0 : packets->unsigned32BitValue();
+        params[numStreams].payloadType = (NULL == payloadType) ? REAC_DEFAULT_RTP_PAYLOAD_TYPE : payloadType->unsigned8BitValue();
+        numStreams++;
+    }
+    
+    if (0 == numStreams) {
+        return;
+    }
+    
+    rtpSender = REACRTPSender::withStreams(deviceInfo->in_channels, proto->getSamplesPerPacket(), params, numStreams);
+    if (NULL == rtpSender) {
+        IOLog("REACDevice[%p]::updateRTPSender() - Error: Failed to start sending RTP streams.\n", this);
+        return;
+    }
+    
+    proto->setRTPSender(rtpSender);
+    rtpSender->release();
+}
+
+IOMemoryDescriptor *REACDevice::copySharedStreamMemory(UInt32 connectionIndex) {
+    IOCommandGate      *gate = getCommandGate();
+    REACConnection     *proto = NULL;
+    IOMemoryDescriptor *memory;
+    
+    // This runs on the user client's thread, and stop() can flush the connections
+    // meanwhile, so the connection is looked up within the gate and kept retained.
+    if (NULL == gate ||
+        kIOReturnSuccess != gate->runAction(&REACDevice::copyConnectionAction, (void*)(uintptr_t)connectionIndex, &proto)) {
+        return NULL;
+    }
+    memory = proto->copySharedStreamMemory();
+    proto->release();
+    return memory;
+}
+
+IOMemoryDescriptor *REACDevice::copyMeterMemory(UInt32 connectionIndex) {
+    IOCommandGate      *gate = getCommandGate();
+    IOMemoryDescriptor *memory = NULL;
+    
+    // The engines are created and stopped within the gate
+    if (NULL == gate ||
+        kIOReturnSuccess != gate->runAction(&REACDevice::copyMeterMemoryAction, (void*)(uintptr_t)connectionIndex, &memory)) {
+        return NULL;
+    }
+    return memory;
+}
+
+IOReturn REACDevice::copyMeterMemoryAction(OSObject *owner, void *connectionIndex, void *memory, void*, void*) {
+    REACDevice     *device = (REACDevice*) owner;
+    REACConnection *proto = OSDynamicCast(REACConnection, device->protocols->getObject((UInt32)(uintptr_t)connectionIndex));
+    
+    if (NULL == proto || NULL == device->audioEngines) {
+        return kIOReturnNotFound;
+    }
+    for (UInt32 i=0; i<device->audioEngines->getCount(); i++) {
+        REACAudioEngine *engine = OSDynamicCast(REACAudioEngine, device->audioEngines->getObject(i));
+        IOMemoryDescriptor *meterMemory = (NULL != engine) ? engine->copyMeterMemory(proto) : NULL;
+        if (NULL != meterMemory) {
+            *(IOMemoryDescriptor **)memory = meterMemory;
+            return kIOReturnSuccess;
+        }
+    }
+    return kIOReturnNotFound;
+}
+
+IOReturn REACDevice::copyConnectionAction(OSObject *owner, void *connectionIndex, void *proto, void*, void*) {
+    REACDevice     *device = (REACDevice*) owner;
+    REACConnection *connection = OSDynamicCast(REACConnection, device->protocols->getObject((UInt32)(uintptr_t)connectionIndex));
+    
+    if (NULL == connection) {
+        return kIOReturnNotFound;
+    }
+    connection->retain();
+    *(REACConnection **)proto = connection;
+    return kIOReturnSuccess;
+}
+
+IOReturn REACDevice::newUserClient(task_t owningTask, void *securityID, UInt32 type, IOUserClient **handler) {
+    REACUserClient *client = new REACUserClient;
+    
+    if (NULL == client || !client->initWithTask(owningTask, securityID, type)) {
+        goto Fail;
+    }
+    if (!client->attach(this)) {
+        goto Fail;
+    }
+    if (!client->start(this)) {
+        client->detach(this);
+        goto Fail;
+    }
+    
+    *handler = client;
+    return kIOReturnSuccess;
+    
+Fail:
+    if (NULL != client) {
+        client->release();
+    }
+    return kIOReturnNoResources;
 }
 
 void REACDevice::samplesCallback(REACConnection *proto, void **cookieA, void** cookieB, UInt8 **data, UInt32 *bufferSize) {
     // IOLog("REACDevice[%p]::samplesCallback()\n", *cookieA);
     
-    REACAudioEngine *engine = (REACAudioEngine *)*cookieB;
+    REACDevice *device = (REACDevice *)*cookieA;
+    REACAudioEngine *engine = (NULL != device->aggregateEngine) ? device->aggregateEngine : (REACAudioEngine *)*cookieB;
     if (NULL != engine) {
-        engine->gotSamples(data, bufferSize);
+        engine->gotSamples(proto, data, bufferSize);
     }
 }
 
 void REACDevice::getSamplesCallback(REACConnection *proto, void **cookieA, void** cookieB, UInt8 **data, UInt32 *bufferSize) {
     // IOLog("REACDevice[%p]::samplesCallback()\n", *cookieA);
     
-    REACAudioEngine *engine = (REACAudioEngine *)*cookieB;
+    REACDevice *device = (REACDevice *)*cookieA;
+    REACAudioEngine *engine = (NULL != device->aggregateEngine) ? device->aggregateEngine : (REACAudioEngine *)*cookieB;
     if (NULL != engine) {
-        engine->getSamples(data, bufferSize);
+        engine->getSamples(proto, data, bufferSize);
     }
 }
 
 REACAudioEngine* REACDevice::createAudioEngine(REACConnection *proto) {
+    REACAudioEngine *audioEngine;
+    OSArray *protos = OSArray::withObjects((const OSObject **)&proto, 1);
+    if (NULL == protos) {
+        return NULL;
+    }
+    
+    audioEngine = createAudioEngine(protos, NULL);
+    protos->release();
+    return audioEngine;
+}
+
+REACAudioEngine* REACDevice::createAudioEngine(OSArray *protos, OSArray *alignmentOffsets) {
     OSDictionary *originalAudioEngineParams = OSDynamicCast(OSDictionary, getProperty(AUDIO_ENGINE_PARAMS_KEY));
     OSDictionary *audioEngineParams = NULL;
-    
-    ifnet_t interface = proto->getInterface();
-    u_int32_t unitNumber = ifnet_unit(interface);
-    const char* ifname = ifnet_name(interface);
+    REACAudioEngine* audioEngine = NULL;
 	
     if (!originalAudioEngineParams) {
         IOLog("REACDevice[%p]::createAudioEngine() - Error: no AudioEngine parameters in personality.\n", this);
@@ -221,21 +815,35 @@ REACAudioEngine* REACDevice::createAudioEngine(REACConnection *proto) {
     
     OSString* desc = OSDynamicCast(OSString, audioEngineParams->getObject(DESCRIPTION_KEY));
     if (NULL != desc) {
+        // The description gets the names of the interfaces appended, like "REAC (en0+en1)"
         char buf[100];
-        snprintf(buf, sizeof(buf), "%s (%s%d)", desc->getCStringNoCopy(), ifname, unitNumber);
-        OSString* newName = OSString::withCStringNoCopy(buf);
+        int len = snprintf(buf, sizeof(buf), "%s (", desc->getCStringNoCopy());
+        for (UInt32 i=0; i<protos->getCount() && len < (int)sizeof(buf); i++) {
+            REACConnection *proto = (REACConnection *)protos->getObject(i);
+            ifnet_t interface = proto->getInterface();
+            len += snprintf(buf+len, sizeof(buf)-len, "%s%s%d", (0 == i ? "" : "+"), ifnet_name(interface), ifnet_unit(interface));
+        }
+        if (len < (int)sizeof(buf)) {
+            snprintf(buf+len, sizeof(buf)-len, ")");
+        }
+        
+        OSString* newName = OSString::withCString(buf);
         if (newName) {
             audioEngineParams->setObject(DESCRIPTION_KEY, newName);
             newName->release();
         }
     }
+    
+    if (NULL != alignmentOffsets) {
+        audioEngineParams->setObject(ALIGNMENT_OFFSETS_KEY, alignmentOffsets);
+    }
 
-    REACAudioEngine* audioEngine = new REACAudioEngine;
+    audioEngine = new REACAudioEngine;
     if (!audioEngine) {
         goto Done;
     }
     
-    if (!audioEngine->init(proto, audioEngineParams)) {
+    if (!audioEngine->init(protos, audioEngineParams)) {
         IOLog("REACDevice[%p]::createAudioEngine() - Error: Failed to init audio engine.\n", this);
         audioEngine->release();
         audioEngine = NULL;
@@ -27,12 +27,24 @@
 #define _REACAUDIODEVICE_H
 
 #include <IOKit/audio/IOAudioDevice.h>
+#include <kern/thread_call.h>
 
 #include "REACConnection.h"
+#include "REACBenchmark.h"
 
 #define AUDIO_ENGINE_PARAMS_KEY         "AudioEngineParams"
 #define INTERFACES_KEY                  "Interfaces"
 #define INTERFACE_NAME_KEY              "Name"
+#define WORK_LOOP_GROUP_KEY             "WorkLoopGroup"
+#define AFFINITY_TAG_KEY                "AffinityTag"
+#define REAL_TIME_WORK_LOOP_KEY         "RealTimeWorkLoop"
+#define PACING_SPIN_MICROSECONDS_KEY    "PacingSpinMicroseconds"
+#define MBUF_POOL_SIZE_KEY              "MbufPoolSize"
+#define TRAP_ALLOCATIONS_KEY            "TrapPacketPathAllocations"
+#define TRANSPORT_KEY                   "Transport"
+#define SOURCE_ADDRESSES_KEY            "SourceAddresses"
+#define SAMPLES_PER_PACKET_KEY          "SamplesPerPacket"
+#define ALIGNMENT_OFFSET_KEY            "AlignmentOffset"
 #define DESCRIPTION_KEY                 "Description"
 #define BLOCK_SIZE_KEY                  "BlockSize"
 #define NUM_BLOCKS_KEY                  "NumBlocks"
@@ -42,19 +54,77 @@
 #define SAMPLE_RATES_KEY				"SampleRates"
 #define SEPARATE_STREAM_BUFFERS_KEY     "SeparateStreamBuffers"
 #define SEPARATE_INPUT_BUFFERS_KEY      "SeparateInputBuffers"
+#define AGGREGATE_KEY                   "Aggregate"
+#define PLANAR_KEY                      "Planar"
+#define ALIGNMENT_OFFSETS_KEY           "AlignmentOffsets"
+#define ROUTES_KEY                      "Routes"
+#define ROUTE_IN_KEY                    "In"
+#define ROUTE_OUT_KEY                   "Out"
+#define ROUTE_GAIN_KEY                  "Gain"
+#define PATCHES_KEY                     "Patches"
+#define RECORD_PATH_KEY                 "RecordPath"
+#define RECORD_FORMAT_KEY               "RecordFormat"
+#define RECORD_RING_SIZE_KEY            "RecordRingSize"
+#define CAPTURE_PATH_KEY                "CapturePath"
+#define SHARED_STREAM_FRAMES_KEY        "SharedStreamFrames"
+#define RTP_STREAMS_KEY                 "RTPStreams"
+#define RTP_ADDRESS_KEY                 "Address"
+#define RTP_PORT_KEY                    "Port"
+#define RTP_FIRST_CHANNEL_KEY           "FirstChannel"
+#define RTP_CHANNELS_KEY                "Channels"
+#define RTP_PACKETS_KEY                 "Packets"
+#define RTP_PAYLOAD_TYPE_KEY            "PayloadType"
+#define BENCHMARK_KEY                   "Benchmark"
+#define BENCHMARK_STREAMS_KEY           "Streams"
+#define BENCHMARK_CHANNELS_KEY          "Channels"
+#define BENCHMARK_SAMPLES_KEY           "SamplesPerPacket"
+#define BENCHMARK_SECONDS_KEY           "Seconds"
+#define BENCHMARK_LOSS_INTERVAL_KEY     "LossInterval"
+#define BENCHMARK_BURST_PACKETS_KEY     "BurstPackets"
+
+#define REAC_DEFAULT_RTP_PAYLOAD_TYPE   97
+
+#define REAC_DEFAULT_RECORD_RING_SIZE   (16*1024*1024)
 
 #define REACDevice				com_pereckerdal_driver_REACDevice
 #define REACAudioEngine			com_pereckerdal_driver_REACAudioEngine
+#define REACUserClient			com_pereckerdal_driver_REACUserClient
 
 class REACAudioEngine;
+class REACUserClient;
 
 class REACDevice : public IOAudioDevice
 {
     OSDeclareDefaultStructors(REACDevice)
     friend class REACAudioEngine;
+    friend class REACUserClient;
 	
 	// instance members
     OSArray *protocols;
+    // When the Aggregate audio engine parameter is set, all connections share this
+    // engine instead of getting one each.
+    REACAudioEngine *aggregateEngine;
+    // Is used to give each recording a file name of its own
+    UInt32 recordingNumber;
+    REACBenchmark *benchmark;
+    
+    // The recorder, capture, shared stream and RTP sender of a connection open
+    // files, allocate big buffers and wait for threads when they start and stop,
+    // so that is done on a thread call per connection rather than in the
+    // connection callback, which runs in the packet path. The slots are allocated
+    // as connections first report in, and are kept until the device stops.
+#   define REAC_MAX_TAPS_SLOTS 16
+    struct TapsSlot {
+        REACDevice     *device;
+        REACConnection *proto;          // Retained
+        REACDeviceInfo * volatile deviceInfo; // As of the latest connection callback. NULL when disconnected.
+        thread_call_t   call;
+    };
+    TapsSlot tapsSlots[REAC_MAX_TAPS_SLOTS];
+    UInt32 numTapsSlots;
+    IOLock *tapsLock;           // Protects the allocation of slots, and tapsStopping
+    IOLock *tapsUpdateLock;     // Keeps the thread calls from running at the same time
+    bool tapsStopping;
 
 	
 	// methods
@@ -64,10 +134,55 @@ class REACDevice : public IOAudioDevice
     virtual void stop(IOService *provider);
     virtual void free();
     virtual bool createProtocolListeners();
+    // Runs a REACBenchmark if the Benchmark property is set. It is a dictionary
+    // with the number of Streams, the Channels per stream, the number of Seconds
+    // to run, and optionally a LossInterval, BurstPackets and an AffinityTag.
+    virtual void startBenchmark();
+    // Returns the work loop that the connection for an interface should run on. It is
+    // either the device's work loop or one that is owned by workLoops.
+    virtual IOWorkLoop *workLoopForInterface(OSDictionary *interfaceDict, OSDictionary *workLoops);
     static void connectionCallback(REACConnection *proto, void **cookieA, void** cookieB, REACDeviceInfo *device);
+    static IOReturn connectionAction(OSObject *owner, void *proto, void *cookieB, void *deviceInfo, void*);
+    // Hands the clock of an aggregate engine over to another source as soon as the
+    // stream of the clock source stalls, before the engine runs out of samples.
+    static void stallCallback(REACConnection *proto, void **cookieA, void** cookieB, bool stalled);
+    static IOReturn stallAction(OSObject *owner, void *proto, void *stalled, void*, void*);
+    // Retains the connection at connectionIndex and stores it in proto
+    static IOReturn copyConnectionAction(OSObject *owner, void *connectionIndex, void *proto, void*, void*);
+    static IOReturn flushConnectionsAction(OSObject *owner, void*, void*, void*, void*);
+    static IOReturn copyMeterMemoryAction(OSObject *owner, void *connectionIndex, void *memory, void*, void*);
+    // Makes the thread call of the connection bring its taps up to date with deviceInfo.
+    void scheduleTapsUpdate(REACConnection *proto, REACDeviceInfo *deviceInfo);
+    static void tapsCallMain(thread_call_param_t slot, thread_call_param_t);
+    // Waits for the thread calls and frees the slots.
+    void stopTaps();
+    // The update methods are called on the thread call of the connection.
+    //
+    // Starts recording the connection to disk if the RecordPath property is set, and
+    // capturing its packets if CapturePath is set. Both are stopped when deviceInfo
+    // is NULL.
+    virtual void updateRecorder(REACConnection *proto, REACDeviceInfo *deviceInfo);
+    virtual void updateCapture(REACConnection *proto, REACDeviceInfo *deviceInfo);
+    // Publishes the input samples of the connection in shared memory if the
+    // SharedStreamFrames property is set. The stream is stopped when deviceInfo is NULL.
+    virtual void updateSharedStream(REACConnection *proto, REACDeviceInfo *deviceInfo);
+    // Returns the shared stream memory of the connection with the given index,
+    // retained, or NULL if it has none.
+    IOMemoryDescriptor *copySharedStreamMemory(UInt32 connectionIndex);
+    // Returns the memory that the audio engine of the connection with the given
+    // index publishes its meters in, retained, or NULL if it has no engine.
+    IOMemoryDescriptor *copyMeterMemory(UInt32 connectionIndex);
+    // Sends the input channels of the connection as the RTP streams in the
+    // RTPStreams property, if it is set. Each stream is a dictionary with an IPv4
+    // Address, a Port, the (1 based) FirstChannel and number of Channels, and
+    // optionally the number of REAC Packets per RTP packet and the PayloadType.
+    virtual void updateRTPSender(REACConnection *proto, REACDeviceInfo *deviceInfo);
+    virtual IOReturn newUserClient(task_t owningTask, void *securityID, UInt32 type, IOUserClient **handler);
     static void samplesCallback(REACConnection *proto, void **cookieA, void** cookieB, UInt8 **data, UInt32 *bufferSize);
     static void getSamplesCallback(REACConnection *proto, void **cookieA, void** cookieB, UInt8 **data, UInt32 *bufferSize);
     virtual REACAudioEngine* createAudioEngine(REACConnection *proto);
+    virtual REACAudioEngine* createAudioEngine(OSArray *protos, OSArray *alignmentOffsets);
+    bool isAggregate();
     virtual IOReturn performPowerStateChange(IOAudioDevicePowerState oldPowerState, 
                                              IOAudioDevicePowerState newPowerState,
                                              UInt32 *microsecondsUntilComplete);
@@ -30,31 +30,6 @@
 
 #include "REACConnection.h"
 
-OSDefineMetaClassAndStructors(REACSplitUnit, OSObject)
-
-bool REACSplitUnit::initAddress(UInt64 lastHeardFrom_, UInt8 identifier_, UInt32 addrLen, const UInt8 *addr) {
-    lastHeardFrom = lastHeardFrom_;
-    identifier = identifier_;
-    
-    if (sizeof(address) != addrLen) {
-        return false;
-    }
-    memcpy(address, addr, addrLen);
-    
-    return true;
-}
-
-REACSplitUnit *REACSplitUnit::withAddress(UInt64 lastHeardFrom, UInt8 identifier, UInt32 addrLen, const UInt8 *addr) {
-    REACSplitUnit *s = new REACSplitUnit;
-    if (NULL == s) return NULL;
-    bool result = s->initAddress(lastHeardFrom, identifier, addrLen, addr);
-    if (!result) {
-        s->release();
-        return NULL;
-    }
-    return s;
-}
-
 #define super REACDataStream
 
 OSDefineMetaClassAndStructors(REACMasterDataStream, super)
@@ -62,31 +37,20 @@ OSDefineMetaClassAndStructors(REACMasterDataStream, super)
 bool REACMasterDataStream::initConnection(REACConnection *conn) {
     lastCdeaTwoBytes[0] = lastCdeaTwoBytes[1] = 0;
     packetsUntilNextCdea = 0;
-    cdeaState = 0;
-    cdeaPacketsSinceStateChange = -1;
+    cdeaScheduleBuilt = false;
+    cdeaScheduleIndex = 0;
     cdeaAtChannel = 0;
     
-    splitUnits = OSArray::withCapacity(10);
-    if (NULL == splitUnits) {
-        goto Fail;
-    }
+    resetSplitUnits();
     masterGotSplitAnnounceState = GOT_SPLIT_NOT_INITIATED;
     
     slaveConnectionStatus = SLAVE_CONNECTION_NO_CONNECTION;
     gotSlaveAnnounce = false;
     
     return super::initConnection(conn);
-    
-Fail:
-    deinit();
-    return false;
 }
 
 void REACMasterDataStream::deinit() {
-    if (NULL != splitUnits) {
-        splitUnits->release();
-        splitUnits = NULL;
-    }
 }
 
 void REACMasterDataStream::free() {
@@ -122,15 +86,13 @@ IOReturn REACMasterDataStream::processPacket(REACPacketHeader *packet, UInt32 dh
         memcpy(sarp->unknown1, splitAnnounceResponse, sizeof(sarp->unknown1));
         memcpy(sarp->address,  masterSplitAnnounceAddr, sizeof(sarp->address));
         sarp->unknown2 = 0x00;
-        sarp->identifierAssignment = 0x60; // 0x04 and up seems to be fine
+        sarp->identifierAssignment = masterSplitAnnounceIdentifier;
         
         UInt8 *zeroPtr = packet->data+sizeof(splitAnnounceResponse)+sizeof(masterSplitAnnounceAddr)+2;
         memset(zeroPtr, 0, packet->data+sizeof(packet->data)-zeroPtr);
         
         setPacketTypeMacro(REAC_STREAM_MASTER_ANNOUNCE);
         REACDataStream::applyChecksum(packet);
-        
-        splitUnitConnected(sarp->identifierAssignment, sizeof(masterSplitAnnounceAddr), masterSplitAnnounceAddr);
     }
     else if (gotSlaveAnnounce) {
         gotSlaveAnnounce = false;
@@ -182,229 +144,25 @@ IOReturn REACMasterDataStream::processPacket(REACPacketHeader *packet, UInt32 dh
         disconnectObsoleteSplitUnits();
     }
     else if (0 >= packetsUntilNextCdea) {
-        /// It is more or less impossible to read this code and understand what it does.
-        /// It is because I don't understand it either. It basically attempts to output
-        /// something that looks like the output of a real REAC unit.
-        ///
-        /// To make the implementation of it somewhat sane, I expressed it as a state
-        /// machine.
-        
-#       define setCdeaStateMacro(state) \
-            { \
-                cdeaState = (state); \
-                cdeaPacketsSinceStateChange = -1; \
-            }
-        
-#       define incrementCdeaStateMacro() \
-                setCdeaStateMacro(cdeaState+1);
-        
-#       define incrementCdeaStateMacroAfterNPacketsMacro(n) \
-            if (cdeaPacketsSinceStateChange >= n-1) { \
-                incrementCdeaStateMacro(); \
-            }
-        
-#       define resetCdeaStateMacroAfterNPacketsMacro(n) \
-            if (cdeaPacketsSinceStateChange >= n-1) { \
-                setCdeaStateMacro(0); \
-            }
-        
-        // Used when analyzing how the slave responds when not sending all types of cdea packets
-#       define setCdeaStateMacroAfterNPacketsMacro(n, value) \
-            if (cdeaPacketsSinceStateChange >= n-1) { \
-                setCdeaStateMacro(value); \
-            }
-        
-#       define fillPayloadMacro(initialOffset_, number_) \
-            { \
-                const SInt32 distance = 10; /* Distance between numbers */ \
-                const UInt8 number = number_; \
-                const SInt32 initialOffset = initialOffset_; \
-                \
-                memset(payload, 0, PAYLOAD_SIZE); \
-                \
-                if (0 == cdeaPacketsSinceStateChange) { \
-                    cdeaCurrentOffset = initialOffset; \
-                } \
-                \
-                while (cdeaCurrentOffset < PAYLOAD_SIZE) { \
-                    payload[cdeaCurrentOffset] = number; \
-                    cdeaCurrentOffset += distance; \
-                } \
-                cdeaCurrentOffset = cdeaCurrentOffset % PAYLOAD_SIZE; \
-            }
-        
-        static const SInt32 PAYLOAD_SIZE = sizeof(packet->data)-REAC_STREAM_CONTROL_PACKET_TYPE_SIZE-1; // -2 for checksum
-        UInt8 *payload = packet->data+REAC_STREAM_CONTROL_PACKET_TYPE_SIZE;
-        
-        const UInt8 afterChannelInfoPayload[] = {
-            0x22, 0xc8, 0x31, 0x32, 0x33, 0x34, 0x01, 0x00, 0x00,
-            0x00, 0x02, 0x00, 0x01, 0x00, 0x02, 0x00, 0x01, 0x00,
-            0x01, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00
-        };
-        
-        const UInt8 afterAfterChannelInfoPayload[][PAYLOAD_SIZE] = {
-            {
-                0x00, 0x00, 0x02, 0x00, 0x19, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02,
-                0x00, 0x0e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x19, 0x00
-            },
-            {
-                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x17, 0x00, 0x00, 0x00, 0x00,
-                0x00, 0x00, 0x00, 0x02, 0x00, 0x0f, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00
-            },
-            {
-                0x02, 0x00, 0x1a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x18,
-                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x20, 0x00, 0x00, 0x00
-            }
-        };
-        
-        const UInt8 stuffWithMACAddress[][18] = {
-            { 0xc0, 0xa8, 0x01, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff },
-            { 0x17, 0x00, 0x00, 0x00, 0x1e, 0x4d, 0x00, 0x00, 0x53, 0x59, 0x53, 0x50, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00 },
-            { 0x58, 0x56, 0x53, 0x43, 0x45, 0x4e, 0x01, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }
-        };
-        
-        UInt32 cdeaPacketType = 0; // Default packet type
-        
-        ++cdeaPacketsSinceStateChange;
-        packetsUntilNextCdea = 8; // Default number of packets until next cdea
-        
-        switch (cdeaState) {
-            case 0: // Filler state
-                fillPayloadMacro(2, 0x03);
-                incrementCdeaStateMacroAfterNPacketsMacro(307);
-                break;
-                
-            case 1: // Packet before channel info state
-                cdeaPacketType = 1;
-                memset(payload, 0, PAYLOAD_SIZE);
-                payload[0]  = 0x03;
-                payload[10] = 0x07;
-                payload[11] = 0x65;
-                payload[16] = 0x03;
-                
-                incrementCdeaStateMacro();
-                packetsUntilNextCdea = 8018;
-                
-                break;
-                
-            case 2: // Channel info state
-                cdeaPacketType = 2;
-                for (int i=0; i<8; i++) {
-                    // The first byte of the channel data is the channel number
-                    if (cdeaAtChannel == 48) {
-                        payload[i*3+0] = 0xfe;
-                    }
-                    else {
-                        payload[i*3+0] = cdeaAtChannel;
-                    }
-                    
-                    // The second byte of the channel data seems to contain channel type flags
-                    // (input/output/none/terminator type + phantom)
-                    if (cdeaAtChannel == 48) {
-                        payload[i*3+1] = 0x01;
-                    }
-                    else if (cdeaAtChannel < connection->getInChannels()) {
-                        payload[i*3+1] = 0x20;
-                    }
-                    else if (cdeaAtChannel < connection->getInChannels()+connection->getOutChannels()) {
-                        payload[i*3+1] = 0x10;
-                    }
-                    else {
-                        payload[i*3+1] = 0x30;
-                    }
-                    
-                    // The third byte of the channel data is gain
-                    payload[i*3+2] = 0x00;
-                    
-                    cdeaAtChannel = (cdeaAtChannel+1)%49;
-                }
-                memset(payload+PAYLOAD_SIZE-2, 0, 2);
-                
-                if (0 == cdeaPacketsSinceStateChange) {
-                    packetsUntilNextCdea = 7947;
-                }
-                else {
-                    incrementCdeaStateMacro();
-                    packetsUntilNextCdea = 27;
-                }
-                
-                break;
-                
-            case 3: // Packet after channel info state
-                cdeaPacketType = 3;
-                memcpy(payload, afterChannelInfoPayload, PAYLOAD_SIZE);
-                
-                incrementCdeaStateMacro();
-                packetsUntilNextCdea = 4;
-                
-                break;
-                
-            case 4: // Stuff I don't understand after packet after channel info state
-                memcpy(payload, afterAfterChannelInfoPayload[cdeaPacketsSinceStateChange], PAYLOAD_SIZE);
-                incrementCdeaStateMacroAfterNPacketsMacro(3);
-                break;
-                
-            case 5: // Fillers with 2 state
-                fillPayloadMacro(4, 0x02);
-                incrementCdeaStateMacroAfterNPacketsMacro(3);
-                break;
-                
-            case 6: // Fillers with 1 state
-                fillPayloadMacro(6, 0x01);
-                incrementCdeaStateMacroAfterNPacketsMacro(3);
-                break;
-                
-            case 7: // Fillers with 3 state
-                fillPayloadMacro(8, 0x03);
-                incrementCdeaStateMacroAfterNPacketsMacro(21);
-                break;
-                
-            case 8: // Packet before stuff with MAC address state
-                memset(payload, 0, PAYLOAD_SIZE);
-                payload[2]  = 0x03;
-                payload[12] = 0x03;
-                payload[24] = 0xc0;
-                payload[25] = 0xa8;
-                
-                incrementCdeaStateMacro();
-                
-                break;
-                
-            case 9: // Stuff with MAC address state
-                memcpy(payload+PAYLOAD_SIZE-sizeof(stuffWithMACAddress[0]), 
-                       stuffWithMACAddress[cdeaPacketsSinceStateChange],
-                       sizeof(stuffWithMACAddress[0]));
-                
-                
-                if (0 == cdeaPacketsSinceStateChange) {
-                    payload[0] = payload[1] = 0x01;
-                    connection->getInterfaceAddr(ETHER_ADDR_LEN, payload+2);
-                    connection->getInterfaceAddr(ETHER_ADDR_LEN, payload+12);
-                }
-                else if (1 == cdeaPacketsSinceStateChange) {
-                    payload[0] = payload[1] = 0xff;
-                    memset(payload+2, 0, ETHER_ADDR_LEN);
-                }
-                else { // 3 == cdeaPacketsSinceStateChange
-                    payload[0] = payload[1] = 0x00;
-                    memset(payload+2, 0, ETHER_ADDR_LEN);
-                }
-                
-                resetCdeaStateMacroAfterNPacketsMacro(3);
-                
-                break;
-                
-            default: // Shouldn't happen. Reset.
-                setCdeaStateMacro(0);
-                packetsUntilNextCdea = 0;
-                cdeaAtChannel = 0;
-                break;
+        if (!cdeaScheduleIsCurrent()) {
+            buildCdeaSchedule();
         }
         
+        const CdeaScheduleEntry *entry = &cdeaSchedule[cdeaScheduleIndex];
+        
         setPacketTypeMacro(REAC_STREAM_CONTROL);
-        memcpy(packet->data, REAC_STREAM_CONTROL_PACKET_TYPE[cdeaPacketType], sizeof(REAC_STREAM_CONTROL_PACKET_TYPE[cdeaPacketType]));
+        if (entry->isChannelInfo) {
+            memcpy(packet->data, cdeaChannelInfo[cdeaAtChannel], sizeof(packet->data));
+            cdeaAtChannel = (cdeaAtChannel+8)%REAC_CDEA_CHANNEL_SLOTS;
+        }
+        else {
+            memcpy(packet->data, entry->data, sizeof(packet->data));
+        }
+        lastCdeaTwoBytes[0] = packet->data[sizeof(packet->data)-2];
+        lastCdeaTwoBytes[1] = packet->data[sizeof(packet->data)-1];
         
-        applyChecksumAndSaveLastChecksumMacro();
+        packetsUntilNextCdea = entry->packetsUntilNext;
+        cdeaScheduleIndex = (cdeaScheduleIndex+1)%REAC_CDEA_SCHEDULE_LENGTH;
     }
     else {
         setPacketTypeMacro(REAC_STREAM_FILLER);
@@ -419,6 +177,187 @@ IOReturn REACMasterDataStream::processPacket(REACPacketHeader *packet, UInt32 dh
     return kIOReturnSuccess;
 }
 
+bool REACMasterDataStream::cdeaScheduleIsCurrent() {
+    return cdeaScheduleBuilt &&
+        cdeaScheduleInChannels == connection->getInChannels() &&
+        cdeaScheduleOutChannels == connection->getOutChannels() &&
+        0 == connection->interfaceAddrCmp(sizeof(cdeaScheduleAddr), cdeaScheduleAddr);
+}
+
+// Number of bytes after the control packet type and before the checksum
+#define CDEA_PAYLOAD_SIZE (32-REAC_STREAM_CONTROL_PACKET_TYPE_SIZE-1)
+
+/// It is more or less impossible to read this code and understand what it does.
+/// It is because I don't understand it either. It basically attempts to output
+/// something that looks like the output of a real REAC unit.
+void REACMasterDataStream::buildCdeaSchedule() {
+    static const UInt8 afterChannelInfoPayload[CDEA_PAYLOAD_SIZE] = {
+        0x22, 0xc8, 0x31, 0x32, 0x33, 0x34, 0x01, 0x00, 0x00,
+        0x00, 0x02, 0x00, 0x01, 0x00, 0x02, 0x00, 0x01, 0x00,
+        0x01, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00
+    };
+    
+    static const UInt8 afterAfterChannelInfoPayload[][CDEA_PAYLOAD_SIZE] = {
+        {
+            0x00, 0x00, 0x02, 0x00, 0x19, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02,
+            0x00, 0x0e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x19, 0x00
+        },
+        {
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x17, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x02, 0x00, 0x0f, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00
+        },
+        {
+            0x02, 0x00, 0x1a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x18,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x20, 0x00, 0x00, 0x00
+        }
+    };
+    
+    static const UInt8 stuffWithMACAddress[][18] = {
+        { 0xc0, 0xa8, 0x01, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff },
+        { 0x17, 0x00, 0x00, 0x00, 0x1e, 0x4d, 0x00, 0x00, 0x53, 0x59, 0x53, 0x50, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00 },
+        { 0x58, 0x56, 0x53, 0x43, 0x45, 0x4e, 0x01, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }
+    };
+    
+    const UInt32 inChannels = connection->getInChannels();
+    const UInt32 outChannels = connection->getOutChannels();
+    UInt32 length = 0;
+    UInt8 *payload;
+    
+    // Filler state
+    appendCdeaFillers(&length, 307, 2, 0x03);
+    
+    // Packet before channel info state
+    payload = appendCdeaEntry(&length, CONTROL_PACKET_TYPE_TWO, 8018);
+    payload[0]  = 0x03;
+    payload[10] = 0x07;
+    payload[11] = 0x65;
+    payload[16] = 0x03;
+    
+    // Channel info state. The contents of these packets are taken from cdeaChannelInfo.
+    appendCdeaEntry(&length, CONTROL_PACKET_TYPE_THREE, 7947);
+    cdeaSchedule[length-1].isChannelInfo = true;
+    appendCdeaEntry(&length, CONTROL_PACKET_TYPE_THREE, 27);
+    cdeaSchedule[length-1].isChannelInfo = true;
+    
+    // Packet after channel info state
+    payload = appendCdeaEntry(&length, CONTROL_PACKET_TYPE_FOUR, 4);
+    memcpy(payload, afterChannelInfoPayload, CDEA_PAYLOAD_SIZE);
+    
+    // Stuff I don't understand after packet after channel info state
+    for (UInt32 i=0; i<3; i++) {
+        payload = appendCdeaEntry(&length, CONTROL_PACKET_TYPE_ONE, 8);
+        memcpy(payload, afterAfterChannelInfoPayload[i], CDEA_PAYLOAD_SIZE);
+    }
+    
+    appendCdeaFillers(&length, 3, 4, 0x02);  // Fillers with 2 state
+    appendCdeaFillers(&length, 3, 6, 0x01);  // Fillers with 1 state
+    appendCdeaFillers(&length, 21, 8, 0x03); // Fillers with 3 state
+    
+    // Packet before stuff with MAC address state
+    payload = appendCdeaEntry(&length, CONTROL_PACKET_TYPE_ONE, 8);
+    payload[2]  = 0x03;
+    payload[12] = 0x03;
+    payload[24] = 0xc0;
+    payload[25] = 0xa8;
+    
+    // Stuff with MAC address state
+    for (UInt32 i=0; i<3; i++) {
+        payload = appendCdeaEntry(&length, CONTROL_PACKET_TYPE_ONE, 8);
+        memcpy(payload+CDEA_PAYLOAD_SIZE-sizeof(stuffWithMACAddress[0]),
+               stuffWithMACAddress[i],
+               sizeof(stuffWithMACAddress[0]));
+        
+        if (0 == i) {
+            payload[0] = payload[1] = 0x01;
+            connection->getInterfaceAddr(ETHER_ADDR_LEN, payload+2);
+            connection->getInterfaceAddr(ETHER_ADDR_LEN, payload+12);
+        }
+        else if (1 == i) {
+            payload[0] = payload[1] = 0xff;
+        }
+    }
+    
+    if (REAC_CDEA_SCHEDULE_LENGTH != length) {
+        // This should never happen
+        IOLog("REACMasterDataStream::buildCdeaSchedule(): Internal error (schedule length %d).\n", (int)length);
+    }
+    
+    for (UInt32 i=0; i<REAC_CDEA_SCHEDULE_LENGTH; i++) {
+        REACDataStream::applyChecksum(cdeaSchedule[i].data);
+    }
+    
+    // Channel info packets, for each starting channel slot
+    for (UInt32 slot=0; slot<REAC_CDEA_CHANNEL_SLOTS; slot++) {
+        UInt8 *data = cdeaChannelInfo[slot];
+        memset(data, 0, sizeof(cdeaChannelInfo[slot]));
+        memcpy(data, REAC_STREAM_CONTROL_PACKET_TYPE[CONTROL_PACKET_TYPE_THREE], REAC_STREAM_CONTROL_PACKET_TYPE_SIZE);
+        payload = data+REAC_STREAM_CONTROL_PACKET_TYPE_SIZE;
+        
+        for (UInt32 i=0; i<8; i++) {
+            const UInt32 channel = (slot+i)%REAC_CDEA_CHANNEL_SLOTS;
+            
+            // The first byte of the channel data is the channel number
+            // The second byte of the channel data seems to contain channel type flags
+            // (input/output/none/terminator type + phantom)
+            if (REAC_CDEA_CHANNEL_SLOTS-1 == channel) {
+                payload[i*3+0] = 0xfe;
+                payload[i*3+1] = 0x01;
+            }
+            else {
+                payload[i*3+0] = channel;
+                if (channel < inChannels) {
+                    payload[i*3+1] = 0x20;
+                }
+                else if (channel < inChannels+outChannels) {
+                    payload[i*3+1] = 0x10;
+                }
+                else {
+                    payload[i*3+1] = 0x30;
+                }
+            }
+            
+            // The third byte of the channel data is gain
+            payload[i*3+2] = 0x00;
+        }
+        
+        REACDataStream::applyChecksum(data);
+    }
+    
+    cdeaScheduleInChannels = inChannels;
+    cdeaScheduleOutChannels = outChannels;
+    connection->getInterfaceAddr(sizeof(cdeaScheduleAddr), cdeaScheduleAddr);
+    cdeaScheduleBuilt = true;
+}
+
+// Appends a zeroed cdea packet of the given control packet type to the schedule,
+// and returns a pointer to its payload.
+UInt8 *REACMasterDataStream::appendCdeaEntry(UInt32 *length, REACStreamControlPacketType type, UInt16 packetsUntilNext) {
+    // Never write outside of the schedule, even if its length is wrong
+    CdeaScheduleEntry *entry = &cdeaSchedule[*length < REAC_CDEA_SCHEDULE_LENGTH ? *length : REAC_CDEA_SCHEDULE_LENGTH-1];
+    ++*length;
+    
+    memset(entry->data, 0, sizeof(entry->data));
+    memcpy(entry->data, REAC_STREAM_CONTROL_PACKET_TYPE[type], REAC_STREAM_CONTROL_PACKET_TYPE_SIZE);
+    entry->packetsUntilNext = packetsUntilNext;
+    entry->isChannelInfo = false;
+    
+    return entry->data+REAC_STREAM_CONTROL_PACKET_TYPE_SIZE;
+}
+
+void REACMasterDataStream::appendCdeaFillers(UInt32 *length, UInt32 count, SInt32 initialOffset, UInt8 number) {
+    const SInt32 distance = 10; // Distance between numbers
+    SInt32 offset = initialOffset;
+    
+    for (UInt32 i=0; i<count; i++) {
+        UInt8 *payload = appendCdeaEntry(length, CONTROL_PACKET_TYPE_ONE, 8);
+        while (offset < CDEA_PAYLOAD_SIZE) {
+            payload[offset] = number;
+            offset += distance;
+        }
+        offset = offset % CDEA_PAYLOAD_SIZE;
+    }
+}
+
 bool REACMasterDataStream::gotPacket(const REACPacketHeader *packet, const EthernetHeader *header) {
     if (super::gotPacket(packet, header)) {
         return true;
@@ -426,7 +365,8 @@ bool REACMasterDataStream::gotPacket(const REACPacketHeader *packet, const Ether
     
     if (isPacketType(packet, REAC_STREAM_SPLIT_ANNOUNCE)) {
         bool found = REACMasterDataStream::updateLastHeardFromSplitUnit(header, sizeof(header->shost), header->shost);
-        if (!found && GOT_SPLIT_NOT_INITIATED == masterGotSplitAnnounceState) {
+        if (!found && GOT_SPLIT_NOT_INITIATED == masterGotSplitAnnounceState &&
+            kIOReturnSuccess == splitUnitConnected(sizeof(header->shost), header->shost, &masterSplitAnnounceIdentifier)) {
             masterGotSplitAnnounceState = GOT_SPLIT_ANNOUNCE;
             memcpy(masterSplitAnnounceAddr, packet->data+9 /* sorry about the magic constant */, sizeof(masterSplitAnnounceAddr));
         }
@@ -447,63 +387,173 @@ bool REACMasterDataStream::isConnectedToSlave() const {
     return SLAVE_CONNECTION_GOT_SLAVE_ANNOUNCE == slaveConnectionStatus;
 }
 
-bool REACMasterDataStream::updateLastHeardFromSplitUnit(const EthernetHeader* header, UInt32 addrLen, const UInt8 *addr) {
-    const UInt32   arraySize = splitUnits->getCount();
-    bool           found = false;
+void REACMasterDataStream::resetSplitUnits() {
+    for (SInt32 i=0; i<REAC_MAX_SPLIT_UNITS; i++) {
+        splitUnits[i].inUse = false;
+        splitUnits[i].next = (i+1 < REAC_MAX_SPLIT_UNITS) ? i+1 : -1;
+        splitUnits[i].prev = -1;
+    }
+    freeSplitUnit = 0;
+    splitUnitCount = 0;
+    
+    memset(splitUnitTable, -1, sizeof(splitUnitTable));
+    memset(splitWheel, -1, sizeof(splitWheel));
+    splitWheelTick = 0;
+}
+
+UInt32 REACMasterDataStream::splitUnitHash(const UInt8 *addr) {
+    // The last bytes of a MAC address are the ones that differ between units
+    // from the same vendor, so they are mixed in with a multiplicative hash.
+    UInt32 low = ((UInt32)addr[2] << 24) | ((UInt32)addr[3] << 16) | ((UInt32)addr[4] << 8) | addr[5];
+    return ((low ^ ((UInt32)addr[0] << 8 | addr[1])) * 2654435761U) >> 16;
+}
+
+SInt32 REACMasterDataStream::findSplitUnit(const UInt8 *addr) const {
+    UInt32 i = splitUnitHash(addr) & (REAC_SPLIT_UNIT_TABLE_SIZE-1);
+    
+    // The table is never full, so this always terminates
+    while (-1 != splitUnitTable[i]) {
+        if (0 == memcmp(addr, splitUnits[(int)splitUnitTable[i]].address, ETHER_ADDR_LEN)) {
+            return i;
+        }
+        i = (i+1) & (REAC_SPLIT_UNIT_TABLE_SIZE-1);
+    }
+    
+    return -1;
+}
+
+void REACMasterDataStream::linkSplitUnitIntoWheel(SInt32 unit) {
+    SplitUnit *su = &splitUnits[unit];
+    // Round up, so that a unit is never expired early
+    UInt64 expiryTick = (su->lastHeardFrom+REAC_PACKETS_PER_SECOND+REAC_SPLIT_WHEEL_TICK-1)/REAC_SPLIT_WHEEL_TICK;
     
+    su->wheelSlot = expiryTick % REAC_SPLIT_WHEEL_SLOTS;
+    su->prev = -1;
+    su->next = splitWheel[su->wheelSlot];
+    if (-1 != su->next) {
+        splitUnits[(int)su->next].prev = unit;
+    }
+    splitWheel[su->wheelSlot] = unit;
+}
+
+void REACMasterDataStream::unlinkSplitUnitFromWheel(SInt32 unit) {
+    SplitUnit *su = &splitUnits[unit];
+    
+    if (-1 != su->prev) {
+        splitUnits[(int)su->prev].next = su->next;
+    }
+    else {
+        splitWheel[su->wheelSlot] = su->next;
+    }
+    if (-1 != su->next) {
+        splitUnits[(int)su->next].prev = su->prev;
+    }
+    su->prev = su->next = -1;
+}
+
+bool REACMasterDataStream::updateLastHeardFromSplitUnit(const EthernetHeader* header, UInt32 addrLen, const UInt8 *addr) {
     if (addrLen != sizeof(header->shost)) {
         return false;
     }
     
-    for (UInt32 i=0; i<arraySize; i++) {
-        REACSplitUnit *splitUnit = (REACSplitUnit *)splitUnits->getObject(i);
-        if (0 == memcmp(addr, splitUnit->address, addrLen)) {
-            found = true;
-            splitUnit->lastHeardFrom = counter;
-            break;
-        }
+    SInt32 tableIndex = findSplitUnit(addr);
+    if (-1 == tableIndex) {
+        return false;
     }
     
-    return found;
+    SInt32 unit = splitUnitTable[tableIndex];
+    unlinkSplitUnitFromWheel(unit);
+    splitUnits[unit].lastHeardFrom = counter;
+    linkSplitUnitIntoWheel(unit);
+    
+    return true;
 }
 
-IOReturn REACMasterDataStream::splitUnitConnected(UInt8 identifier, UInt32 addrLen, const UInt8 *addr) {
-    IOReturn ret = kIOReturnError;
-    REACSplitUnit *rsu = REACSplitUnit::withAddress(counter, identifier, addrLen, addr);
-    
-    if (NULL == rsu) {
-        goto Done;
+IOReturn REACMasterDataStream::splitUnitConnected(UInt32 addrLen, const UInt8 *addr, UInt8 *identifier) {
+    if (ETHER_ADDR_LEN != addrLen) {
+        return kIOReturnBadArgument;
     }
-    if (!splitUnits->setObject(rsu)) {
-        goto Done;
+    if (-1 == freeSplitUnit) {
+        return kIOReturnNoResources;
     }
     
+    SInt32 unit = freeSplitUnit;
+    SplitUnit *su = &splitUnits[unit];
+    freeSplitUnit = su->next;
+    
+    su->inUse = true;
+    su->lastHeardFrom = counter;
+    memcpy(su->address, addr, addrLen);
+    linkSplitUnitIntoWheel(unit);
+    
+    UInt32 i = splitUnitHash(addr) & (REAC_SPLIT_UNIT_TABLE_SIZE-1);
+    while (-1 != splitUnitTable[i]) {
+        i = (i+1) & (REAC_SPLIT_UNIT_TABLE_SIZE-1);
+    }
+    splitUnitTable[i] = unit;
+    ++splitUnitCount;
+    
+    *identifier = REAC_SPLIT_IDENTIFIER_BASE+unit;
+    
     IOLog("REACDataStream::splitUnitConnected(): Split connect: ");
-    for (UInt32 i=0; i<addrLen; i++) IOLog("%02x", addr[i]);
+    for (UInt32 j=0; j<addrLen; j++) IOLog("%02x", addr[j]);
+    IOLog("\n");
+    
+    return kIOReturnSuccess;
+}
+
+void REACMasterDataStream::splitUnitDisconnected(SInt32 tableIndex) {
+    SInt32 unit = splitUnitTable[tableIndex];
+    SplitUnit *su = &splitUnits[unit];
+    
+    IOLog("REACDataStream::disconnectObsoleteSplitUnits(): Split disconnect: ");
+    for (UInt32 j=0; j<sizeof(su->address); j++) IOLog("%02x", su->address[j]);
     IOLog("\n");
     
-    ret = kIOReturnSuccess;
+    unlinkSplitUnitFromWheel(unit);
+    su->inUse = false;
+    su->next = freeSplitUnit;
+    freeSplitUnit = unit;
+    --splitUnitCount;
     
-Done:
-    if (NULL != rsu) {
-        rsu->release();
+    // Remove the unit from the hash table with backward shift deletion, so that
+    // no tombstones are needed: Entries after the removed one that would be
+    // unreachable because of the hole are moved into it.
+    UInt32 hole = tableIndex;
+    UInt32 i = hole;
+    for (;;) {
+        i = (i+1) & (REAC_SPLIT_UNIT_TABLE_SIZE-1);
+        if (-1 == splitUnitTable[i]) {
+            break;
+        }
+        
+        UInt32 home = splitUnitHash(splitUnits[(int)splitUnitTable[i]].address) & (REAC_SPLIT_UNIT_TABLE_SIZE-1);
+        // Move the entry if its home slot is not cyclically within (hole, i]
+        if (((i-home) & (REAC_SPLIT_UNIT_TABLE_SIZE-1)) >= ((i-hole) & (REAC_SPLIT_UNIT_TABLE_SIZE-1))) {
+            splitUnitTable[hole] = splitUnitTable[i];
+            hole = i;
+        }
     }
-    return ret;
+    splitUnitTable[hole] = -1;
 }
 
 void REACMasterDataStream::disconnectObsoleteSplitUnits() {
-    UInt32 arraySize = splitUnits->getCount();
-    
-    for (UInt32 i=0; i<arraySize; i++) {
-        REACSplitUnit *splitUnit = (REACSplitUnit *)splitUnits->getObject(i);
-        if (counter-splitUnit->lastHeardFrom >= REAC_PACKETS_PER_SECOND) {
-            IOLog("REACDataStream::disconnectObsoleteSplitUnits(): Split disconnect: ");
-            for (UInt32 j=0; j<sizeof(splitUnit->address); j++) IOLog("%02x", splitUnit->address[j]);
-            IOLog("\n");
-            
-            splitUnits->removeObject(i);
-            --i;
-            --arraySize;
+    const UInt64 currentTick = counter/REAC_SPLIT_WHEEL_TICK;
+    
+    if (currentTick >= splitWheelTick+REAC_SPLIT_WHEEL_SLOTS) {
+        // Each slot only needs to be visited once
+        splitWheelTick = currentTick-REAC_SPLIT_WHEEL_SLOTS+1;
+    }
+    
+    for (; splitWheelTick <= currentTick; splitWheelTick++) {
+        SInt32 unit = splitWheel[splitWheelTick % REAC_SPLIT_WHEEL_SLOTS];
+        while (-1 != unit) {
+            SInt32 next = splitUnits[unit].next;
+            // A slot can hold units that time out one lap of the wheel later
+            if (counter-splitUnits[unit].lastHeardFrom >= REAC_PACKETS_PER_SECOND) {
+                splitUnitDisconnected(findSplitUnit(splitUnits[unit].address));
+            }
+            unit = next;
         }
     }
 }
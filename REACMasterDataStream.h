@@ -30,21 +30,13 @@
 #include "REACDataStream.h"
 #include "EthernetHeader.h"
 
-#define REACSplitUnit           com_pereckerdal_driver_REACSplitUnit
 #define REACMasterDataStream    com_pereckerdal_driver_REACMasterDataStream
 
-// Represents one connected REAC_SPLIT device
-class REACSplitUnit : public OSObject {
-    OSDeclareFinalStructors(REACSplitUnit);
-    
-public:
-    virtual bool initAddress(UInt64 lastHeardFrom, UInt8 identifier, UInt32 addrLen, const UInt8 *addr);
-    static REACSplitUnit *withAddress(UInt64 lastHeardFrom, UInt8 identifier, UInt32 addrLen, const UInt8 *addr);
-    
-    UInt64 lastHeardFrom;
-    UInt8  identifier;
-    UInt8  address[ETHER_ADDR_LEN];
-};
+// The maximum number of REAC_SPLIT devices that a master can serve at once
+#define REAC_MAX_SPLIT_UNITS 64
+// The identifier that is assigned to the first split unit. The others get the
+// identifiers after it. (0x04 and up seems to be fine)
+#define REAC_SPLIT_IDENTIFIER_BASE 0x60
 
 class REACMasterDataStream : public REACDataStream {
     OSDeclareDefaultStructors(REACMasterDataStream)
@@ -76,22 +68,81 @@ protected:
         GOT_SPLIT_ANNOUNCE,
         GOT_SPLIT_SENT_SPLIT_ANNOUNCE_RESPONSE
     };
-    OSArray               *splitUnits;
     GotSplitAnnounceState  masterGotSplitAnnounceState;
     UInt8                  masterSplitAnnounceAddr[ETHER_ADDR_LEN];
+    UInt8                  masterSplitAnnounceIdentifier;
+    
+    // Split unit registry
+    //
+    // Connected REAC_SPLIT devices are kept in a fixed size pool so that neither
+    // connecting nor disconnecting splits allocates memory. The units are found
+    // by MAC address through an open addressing hash table (linear probing),
+    // and they are expired using a timer wheel, where each unit is linked into
+    // the slot of the tick when it times out. A unit's identifier is derived
+    // from its index in the pool.
+#   define REAC_SPLIT_UNIT_TABLE_SIZE 128 // Must be a power of two, larger than REAC_MAX_SPLIT_UNITS
+#   define REAC_SPLIT_WHEEL_TICK (REAC_PACKETS_PER_SECOND/8) // In packets
+// Should span the timeout plus the time between calls to disconnectObsoleteSplitUnits
+#   define REAC_SPLIT_WHEEL_SLOTS 32
+    struct SplitUnit {
+        UInt64    lastHeardFrom;
+        UInt8     address[ETHER_ADDR_LEN];
+        bool      inUse;
+        SInt8     next;              // Next free unit, or next unit in the same wheel slot
+        SInt8     prev;              // Previous unit in the same wheel slot
+        UInt8     wheelSlot;
+    };
+    SplitUnit   splitUnits[REAC_MAX_SPLIT_UNITS];
+    SInt8       splitUnitTable[REAC_SPLIT_UNIT_TABLE_SIZE]; // Indices into splitUnits, -1 when empty
+    SInt8       splitWheel[REAC_SPLIT_WHEEL_SLOTS];         // Heads of the wheel slot lists, -1 when empty
+    UInt64      splitWheelTick;                             // The next tick to be expired
+    SInt8       freeSplitUnit;                              // Head of the free list, -1 when full
+    UInt32      splitUnitCount;
+    
+    void resetSplitUnits();
+    static UInt32 splitUnitHash(const UInt8 *addr);
+    SInt32 findSplitUnit(const UInt8 *addr) const; // Returns the index into splitUnitTable, or -1
+    void linkSplitUnitIntoWheel(SInt32 unit);
+    void unlinkSplitUnitFromWheel(SInt32 unit);
     
     bool updateLastHeardFromSplitUnit(const EthernetHeader *header, UInt32 addrLen, const UInt8 *addr);
-    IOReturn splitUnitConnected(UInt8 identifier, UInt32 addrLen, const UInt8 *addr);
+    IOReturn splitUnitConnected(UInt32 addrLen, const UInt8 *addr, UInt8 *identifier);
+    void splitUnitDisconnected(SInt32 tableIndex);
     void disconnectObsoleteSplitUnits();
     
     // Cdea state
+    //
+    // The cdea control stream is periodic, so instead of computing every packet
+    // when it is sent, one period of it is compiled into cdeaSchedule. The
+    // channel info packets are the exception: they walk through the channel slots
+    // eight at a time, so the packet for each starting slot is precomputed in
+    // cdeaChannelInfo instead.
+    //
+    // The schedule depends on the channel counts and the interface address. It is
+    // built lazily and rebuilt whenever any of them change.
+#   define REAC_CDEA_SCHEDULE_LENGTH 345
+#   define REAC_CDEA_CHANNEL_SLOTS 49
+    struct CdeaScheduleEntry {
+        UInt8     data[32];          // The complete packet data, including checksum
+        UInt16    packetsUntilNext;
+        bool      isChannelInfo;     // If true, data is taken from cdeaChannelInfo
+    };
+    CdeaScheduleEntry cdeaSchedule[REAC_CDEA_SCHEDULE_LENGTH];
+    UInt8     cdeaChannelInfo[REAC_CDEA_CHANNEL_SLOTS][32];
+    bool      cdeaScheduleBuilt;
+    UInt8     cdeaScheduleInChannels;
+    UInt8     cdeaScheduleOutChannels;
+    UInt8     cdeaScheduleAddr[ETHER_ADDR_LEN];
+    UInt32    cdeaScheduleIndex;
     UInt8     lastCdeaTwoBytes[2];
     SInt32    packetsUntilNextCdea;
-    SInt32    cdeaState;
-    SInt32    cdeaPacketsSinceStateChange;
     SInt32    cdeaAtChannel;     // Used when writing the cdea channel info packets
-    SInt32    cdeaCurrentOffset; // Used when writing the cdea filler packets
-    
+
+    bool cdeaScheduleIsCurrent();
+    void buildCdeaSchedule();
+    UInt8 *appendCdeaEntry(UInt32 *length, REACStreamControlPacketType type, UInt16 packetsUntilNext);
+    void appendCdeaFillers(UInt32 *length, UInt32 count, SInt32 initialOffset, UInt8 number);
+
     // Slave handshake state
     enum SlaveConnectionStatus {
         SLAVE_CONNECTION_NO_CONNECTION,
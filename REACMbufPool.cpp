@@ -0,0 +1,169 @@
+/*
+ *  REACMbufPool.cpp
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "REACMbufPool.h"
+
+#include <libkern/OSAtomic.h>
+
+#include "MbufUtils.h"
+
+#define super OSObject
+
+OSDefineMetaClassAndStructors(REACMbufPool, super)
+
+bool REACMbufPool::initWithSize(UInt32 numPackets, UInt32 maxPacketLength_, bool trapAllocations_) {
+    ring = NULL;
+    refillCall = NULL;
+    refillLock = NULL;
+    ringHead = ringTail = 0;
+    allocations = 0;
+    maxPacketLength = maxPacketLength_;
+    trapAllocations = trapAllocations_;
+
+    if (!super::init()) {
+        return false;
+    }
+
+    if (0 == numPackets || numPackets > REAC_MBUF_POOL_MAX_SIZE || 0 == maxPacketLength) {
+        goto Fail;
+    }
+
+    ringSize = 1;
+    while (ringSize < numPackets) {
+        ringSize <<= 1;
+    }
+
+    ring = (mbuf_t *)IOMalloc(ringSize*sizeof(mbuf_t));
+    refillLock = IOLockAlloc();
+    refillCall = thread_call_allocate(&REACMbufPool::refillCallMain, this);
+    if (NULL == ring || NULL == refillLock || NULL == refillCall) {
+        IOLog("REACMbufPool::initWithSize(): Failed to allocate pool.\n");
+        goto Fail;
+    }
+
+    refill();
+    if (ringHead != ringSize) {
+        IOLog("REACMbufPool::initWithSize(): Failed to fill pool.\n");
+        goto Fail;
+    }
+
+    return true;
+
+Fail:
+    deinit();
+    return false;
+}
+
+REACMbufPool *REACMbufPool::withSize(UInt32 numPackets, UInt32 maxPacketLength, bool trapAllocations) {
+    REACMbufPool *p = new REACMbufPool;
+    if (NULL == p) return NULL;
+    bool result = p->initWithSize(numPackets, maxPacketLength, trapAllocations);
+    if (!result) {
+        p->release();
+        return NULL;
+    }
+    return p;
+}
+
+void REACMbufPool::deinit() {
+    if (NULL != refillCall) {
+        thread_call_cancel_wait(refillCall);
+        thread_call_free(refillCall);
+        refillCall = NULL;
+    }
+
+    if (NULL != refillLock) {
+        IOLockFree(refillLock);
+        refillLock = NULL;
+    }
+
+    if (NULL != ring) {
+        while (ringTail != ringHead) {
+            mbuf_freem(ring[ringTail & (ringSize-1)]);
+            ringTail++;
+        }
+        IOFree(ring, ringSize*sizeof(mbuf_t));
+        ring = NULL;
+    }
+}
+
+void REACMbufPool::free() {
+    deinit();
+    super::free();
+}
+
+IOReturn REACMbufPool::getPacket(UInt32 length, mbuf_t *mbuf) {
+    const UInt32 head = ringHead;
+    OSMemoryBarrier();
+    const UInt32 available = head-ringTail;
+
+    if (available <= ringSize/2) {
+        thread_call_enter(refillCall);
+    }
+
+    if (0 == available || length > maxPacketLength) {
+        allocations++;
+        if (trapAllocations) {
+            panic("REACMbufPool::getPacket(): Allocated a packet in a packet path");
+        }
+        if (0 != mbuf_allocpacket(MBUF_DONTWAIT, length, NULL, mbuf)) {
+            return kIOReturnNoMemory;
+        }
+        if (kIOReturnSuccess != MbufUtils::setChainLength(*mbuf, length)) {
+            mbuf_freem(*mbuf);
+            *mbuf = NULL;
+            return kIOReturnNoMemory;
+        }
+        return kIOReturnSuccess;
+    }
+
+    *mbuf = ring[ringTail & (ringSize-1)];
+    // The mbuf has to be taken out before the refill can put another one in its place
+    OSMemoryBarrier();
+    ringTail++;
+
+    return MbufUtils::trimChainLength(*mbuf, length);
+}
+
+void REACMbufPool::refillCallMain(thread_call_param_t param0, thread_call_param_t param1) {
+    ((REACMbufPool *)param0)->refill();
+}
+
+void REACMbufPool::refill() {
+    IOLockLock(refillLock);
+    while (ringHead-ringTail < ringSize) {
+        mbuf_t mbuf;
+        if (0 != mbuf_allocpacket(MBUF_WAITOK, maxPacketLength, NULL, &mbuf)) {
+            break;
+        }
+
+        ring[ringHead & (ringSize-1)] = mbuf;
+        // The mbuf has to be in the ring before getPacket can see it
+        OSMemoryBarrier();
+        ringHead++;
+    }
+    IOLockUnlock(refillLock);
+}
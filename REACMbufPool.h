@@ -0,0 +1,90 @@
+/*
+ *  REACMbufPool.h
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REACMBUFPOOL_H
+#define _REACMBUFPOOL_H
+
+#include <libkern/OSTypes.h>
+#include <libkern/c++/OSObject.h>
+#include <IOKit/IOReturn.h>
+#include <IOKit/IOLib.h>
+#include <kern/thread_call.h>
+#include <sys/kpi_mbuf.h>
+
+#define REACMbufPool              com_pereckerdal_driver_REACMbufPool
+
+// Keeps packet mbufs allocated ahead of time, so that sending a packet doesn't
+// have to go to the mbuf allocator. The stack frees the mbufs that are sent, so
+// the pool is refilled from a thread call, outside of the packet paths, whenever
+// it gets below half full.
+//
+// When the pool runs dry, packets are allocated on the spot instead. Those
+// allocations are counted, and can be made to panic, so that allocations in the
+// packet paths can be found when benchmarking.
+class REACMbufPool : public OSObject {
+    OSDeclareDefaultStructors(REACMbufPool)
+
+public:
+    // numPackets is rounded up to a power of two. Packets of up to maxPacketLength
+    // bytes can be taken from the pool.
+    virtual bool initWithSize(UInt32 numPackets, UInt32 maxPacketLength, bool trapAllocations);
+    static REACMbufPool *withSize(UInt32 numPackets, UInt32 maxPacketLength, bool trapAllocations);
+
+protected:
+    // Object destruction method that is used by free, and the init method on failure.
+    virtual void deinit();
+    virtual void free();
+
+public:
+    // Returns a packet of length bytes. Is only to be called from one thread at a time.
+    IOReturn getPacket(UInt32 length, mbuf_t *mbuf);
+
+    UInt64 getAllocations() const { return allocations; }
+
+protected:
+#   define REAC_MBUF_POOL_MAX_SIZE 1024
+
+    UInt32              maxPacketLength;
+    bool                trapAllocations;
+    UInt64              allocations;     // Packets that were allocated on the spot
+
+    // Ring of free packets. ringHead is only written by the refill thread call and
+    // ringTail only by getPacket; they are free running counters.
+    mbuf_t             *ring;
+    UInt32              ringSize;
+    volatile UInt32     ringHead;
+    volatile UInt32     ringTail;
+
+    thread_call_t       refillCall;
+    IOLock             *refillLock;      // Keeps refills from running at the same time
+
+    static void refillCallMain(thread_call_param_t param0, thread_call_param_t param1);
+    // Fills the ring up. Can block, so it is never called from the packet paths.
+    void refill();
+};
+
+
+#endif
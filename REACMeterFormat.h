@@ -0,0 +1,71 @@
+/*
+ *  REACMeterFormat.h
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REACMETERFORMAT_H
+#define _REACMETERFORMAT_H
+
+// The layout of the shared memory through which the audio engines publish the
+// levels of their connections. This header is plain C and has no dependencies
+// on the rest of the driver, so that it can be used as is by the programs that
+// show the meters.
+//
+// The memory is mapped read only through the REAC user client (IOServiceOpen on
+// the REAC device, then IOConnectMapMemory with REAC_METER_MEMORY_TYPE plus the
+// index of the connection as memory type). It holds one REACMeterSnapshot, for
+// the connection's source of the audio engine that it belongs to. There are
+// meters only while the connection has an audio engine.
+//
+// The engine is the only writer, and publishes a new snapshot every 50 ms.
+// sequence is odd while the snapshot is being written: Readers copy the
+// snapshot and retry if sequence was odd or changed meanwhile.
+//
+// All integers are in the byte order of the host.
+
+#include <stdint.h>
+
+#define REAC_METER_MEMORY_TYPE      0x10000
+#define REAC_METER_MAX_CHANNELS     40
+
+// The levels of one channel over one meter interval, in 24 bit sample units
+// (0x7FFFFF is full scale).
+typedef struct {
+    uint32_t          peak;
+    uint32_t          rms;
+    uint32_t          clipCount;      // Since the engine was created
+    uint32_t          reserved;
+} REACMeterValue;
+
+typedef struct {
+    volatile uint32_t sequence;
+    uint32_t          inChannels;
+    uint32_t          outChannels;
+    uint32_t          reserved;
+    uint64_t          timestamp;      // Uptime in nanoseconds
+    REACMeterValue    inputs[REAC_METER_MAX_CHANNELS];
+    REACMeterValue    outputs[REAC_METER_MAX_CHANNELS];
+} REACMeterSnapshot;
+
+#endif
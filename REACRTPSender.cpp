@@ -0,0 +1,347 @@
+/*
+ *  REACRTPSender.cpp
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "REACRTPSender.h"
+
+#include <libkern/OSAtomic.h>
+#include <libkern/OSByteOrder.h>
+#include <libkern/libkern.h>
+
+#define super OSObject
+
+OSDefineMetaClassAndStructors(REACRTPSender, super)
+
+bool REACRTPSender::initWithStreams(UInt32 inChannels_, UInt32 samplesPerPacket_,
+                                    const StreamParams *params, UInt32 numStreams_) {
+    thread_t thread;
+
+    streams = NULL;
+    numStreams = 0;
+    ringSamples = NULL;
+    socket = NULL;
+    lock = NULL;
+    haveCounter = false;
+    lastCounter = 0;
+    timestamp = 0;
+    ringHead = ringTail = 0;
+    droppedPackets = 0;
+    sendErrors = 0;
+    senderSleeping = false;
+    senderShouldStop = false;
+    senderRunning = false;
+
+    if (!super::init()) {
+        return false;
+    }
+
+    if (0 == inChannels_ || inChannels_ > REAC_MAX_CHANNEL_COUNT ||
+        0 == samplesPerPacket_ || samplesPerPacket_ > REAC_MAX_SAMPLES_PER_PACKET ||
+        0 == numStreams_ || numStreams_ > REAC_RTP_MAX_STREAMS) {
+        goto Fail;
+    }
+    inChannels = inChannels_;
+    samplesPerPacket = samplesPerPacket_;
+    packetSize = samplesPerPacket*REAC_RESOLUTION*inChannels;
+
+    streams = (Stream *)IOMalloc(numStreams_*sizeof(Stream));
+    ringSamples = (UInt8 *)IOMalloc(REAC_RTP_RING_PACKETS*packetSize);
+    lock = IOLockAlloc();
+    if (NULL == streams || NULL == ringSamples || NULL == lock) {
+        IOLog("REACRTPSender::initWithStreams(): Failed to allocate buffers.\n");
+        goto Fail;
+    }
+    numStreams = numStreams_;
+
+    // The initial timestamp, sequence numbers and SSRCs are random, as RTP wants them to be
+    timestampOffset = (UInt32)random();
+
+    for (UInt32 i=0; i<numStreams; i++) {
+        Stream *stream = &streams[i];
+        stream->params = params[i];
+        stream->channelBytes = REAC_RESOLUTION*params[i].numChannels;
+        stream->filledPackets = 0;
+        stream->sequence = (UInt16)random();
+
+        if (0 == params[i].numChannels || params[i].firstChannel+params[i].numChannels > inChannels ||
+            params[i].packetsPerRTPPacket > REAC_RTP_MAX_PACKETS_PER_RTP_PACKET) {
+            IOLog("REACRTPSender::initWithStreams(): Invalid stream %d.\n", (int)i);
+            goto Fail;
+        }
+        if (0 == stream->params.packetsPerRTPPacket) {
+            stream->params.packetsPerRTPPacket = REAC_RTP_MAX_PACKETS_PER_RTP_PACKET;
+            while (stream->params.packetsPerRTPPacket > 1 &&
+                   stream->params.packetsPerRTPPacket*samplesPerPacket*stream->channelBytes > REAC_RTP_MAX_PAYLOAD) {
+                stream->params.packetsPerRTPPacket--;
+            }
+        }
+        if (stream->params.packetsPerRTPPacket*samplesPerPacket*stream->channelBytes > REAC_RTP_MAX_PAYLOAD) {
+            IOLog("REACRTPSender::initWithStreams(): Stream %d has too many channels for one packet.\n", (int)i);
+            goto Fail;
+        }
+
+        memset(&stream->address, 0, sizeof(stream->address));
+        stream->address.sin_len = sizeof(stream->address);
+        stream->address.sin_family = AF_INET;
+        stream->address.sin_port = OSSwapHostToBigInt16(params[i].port);
+        stream->address.sin_addr.s_addr = params[i].address;
+
+        stream->header[0] = 0x80; // Version 2, no padding, extensions or CSRCs
+        stream->header[1] = params[i].payloadType & 0x7f;
+        OSWriteBigInt16(stream->header, 2, 0);
+        OSWriteBigInt32(stream->header, 4, 0);
+        OSWriteBigInt32(stream->header, 8, (UInt32)random());
+    }
+
+    if (0 != sock_socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, NULL, &socket)) {
+        IOLog("REACRTPSender::initWithStreams(): Failed to create socket.\n");
+        socket = NULL;
+        goto Fail;
+    }
+
+    senderRunning = true;
+    if (KERN_SUCCESS != kernel_thread_start(&REACRTPSender::senderThreadMain, this, &thread)) {
+        IOLog("REACRTPSender::initWithStreams(): Failed to start sender thread.\n");
+        senderRunning = false;
+        goto Fail;
+    }
+    thread_deallocate(thread);
+
+    return true;
+
+Fail:
+    deinit();
+    return false;
+}
+
+REACRTPSender *REACRTPSender::withStreams(UInt32 inChannels, UInt32 samplesPerPacket,
+                                          const StreamParams *params, UInt32 numStreams) {
+    REACRTPSender *s = new REACRTPSender;
+    if (NULL == s) return NULL;
+    bool result = s->initWithStreams(inChannels, samplesPerPacket, params, numStreams);
+    if (!result) {
+        s->release();
+        return NULL;
+    }
+    return s;
+}
+
+bool REACRTPSender::parseAddress(const char *string, UInt32 *address) {
+    UInt8 bytes[4];
+
+    for (int i=0; i<4; i++) {
+        UInt32 value = 0;
+        int digits = 0;
+        while (*string >= '0' && *string <= '9' && digits < 3) {
+            value = value*10 + (*string-'0');
+            string++;
+            digits++;
+        }
+        if (0 == digits || value > 255 || *string != (3 == i ? '\0' : '.')) {
+            return false;
+        }
+        bytes[i] = value;
+        string++;
+    }
+
+    memcpy(address, bytes, sizeof(bytes));
+    return true;
+}
+
+void REACRTPSender::stopSender() {
+    if (senderRunning) {
+        senderShouldStop = true;
+        OSMemoryBarrier();
+        IOLockLock(lock);
+        IOLockWakeup(lock, (void *)&ringHead, true);
+        IOLockUnlock(lock);
+        while (senderRunning) {
+            IOSleep(1);
+        }
+    }
+}
+
+void REACRTPSender::deinit() {
+    stopSender();
+
+    if (NULL != socket) {
+        sock_close(socket);
+        socket = NULL;
+    }
+
+    if (NULL != lock) {
+        IOLockFree(lock);
+        lock = NULL;
+    }
+
+    if (NULL != ringSamples) {
+        IOFree(ringSamples, REAC_RTP_RING_PACKETS*packetSize);
+        ringSamples = NULL;
+    }
+
+    if (NULL != streams) {
+        IOFree(streams, numStreams*sizeof(Stream));
+        streams = NULL;
+    }
+}
+
+void REACRTPSender::free() {
+    deinit();
+    super::free();
+}
+
+void REACRTPSender::writePacket(UInt16 counter, const UInt8 *samples) {
+    const UInt32 head = ringHead;
+
+    // Extend the counter. Lost packets are accounted for as long as less than
+    // 65536 of them are lost in a row.
+    if (haveCounter) {
+        timestamp += (UInt16)(counter-lastCounter)*samplesPerPacket;
+    }
+    else {
+        timestamp = counter*samplesPerPacket;
+        haveCounter = true;
+    }
+    lastCounter = counter;
+
+    if (head-ringTail >= REAC_RTP_RING_PACKETS) {
+        // The sender thread can't keep up
+        droppedPackets++;
+        return;
+    }
+
+    const UInt32 index = head & (REAC_RTP_RING_PACKETS-1);
+    ringTimestamps[index] = timestamp;
+    memcpy(ringSamples+index*packetSize, samples, packetSize);
+
+    // The packet has to be in the ring before the sender thread can see it, and
+    // ringHead has to be visible before senderSleeping is checked.
+    OSMemoryBarrier();
+    ringHead = head+1;
+    OSMemoryBarrier();
+
+    if (senderSleeping) {
+        IOLockLock(lock);
+        IOLockWakeup(lock, (void *)&ringHead, true);
+        IOLockUnlock(lock);
+    }
+}
+
+void REACRTPSender::senderThreadMain(void *param, wait_result_t waitResult) {
+    REACRTPSender *sender = (REACRTPSender *)param;
+
+    for (;;) {
+        sender->drainRing();
+        if (sender->senderShouldStop) {
+            break;
+        }
+
+        IOLockLock(sender->lock);
+        sender->senderSleeping = true;
+        OSMemoryBarrier();
+        if (sender->ringHead == sender->ringTail && !sender->senderShouldStop) {
+            IOLockSleep(sender->lock, (void *)&sender->ringHead, THREAD_UNINT);
+        }
+        sender->senderSleeping = false;
+        IOLockUnlock(sender->lock);
+    }
+
+    OSMemoryBarrier();
+    sender->senderRunning = false;
+    // The sender might be freed from here on
+
+    thread_terminate(current_thread());
+}
+
+void REACRTPSender::drainRing() {
+    for (;;) {
+        const UInt32 head = ringHead;
+        OSMemoryBarrier();
+        if (head == ringTail) {
+            return;
+        }
+
+        const UInt32 index = ringTail & (REAC_RTP_RING_PACKETS-1);
+        for (UInt32 i=0; i<numStreams; i++) {
+            addToStream(&streams[i], ringTimestamps[index], ringSamples+index*packetSize);
+        }
+
+        // The packet has to be used before the producer can overwrite it
+        OSMemoryBarrier();
+        ringTail++;
+    }
+}
+
+void REACRTPSender::addToStream(Stream *stream, UInt32 packetTimestamp, const UInt8 *samples) {
+    const UInt32 frameSize = REAC_RESOLUTION*inChannels;
+    const UInt8 *in = samples+REAC_RESOLUTION*stream->params.firstChannel;
+
+    // A gap in the REAC packets ends the RTP packet that is being put together
+    if (0 != stream->filledPackets && packetTimestamp != stream->nextTimestamp) {
+        stream->filledPackets = 0;
+    }
+    if (0 == stream->filledPackets) {
+        stream->packetTimestamp = packetTimestamp;
+    }
+
+    // The REAC samples are 24 bit big endian interleaved already, like L24
+    UInt8 *out = stream->payload+stream->filledPackets*samplesPerPacket*stream->channelBytes;
+    for (UInt32 i=0; i<samplesPerPacket; i++) {
+        memcpy(out, in, stream->channelBytes);
+        out += stream->channelBytes;
+        in += frameSize;
+    }
+    stream->filledPackets++;
+    stream->nextTimestamp = packetTimestamp+samplesPerPacket;
+
+    if (stream->params.packetsPerRTPPacket == stream->filledPackets) {
+        sendStream(stream);
+        stream->filledPackets = 0;
+    }
+}
+
+void REACRTPSender::sendStream(Stream *stream) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t sentLength;
+
+    OSWriteBigInt16(stream->header, 2, stream->sequence++);
+    OSWriteBigInt32(stream->header, 4, stream->packetTimestamp+timestampOffset);
+
+    iov[0].iov_base = stream->header;
+    iov[0].iov_len = sizeof(stream->header);
+    iov[1].iov_base = stream->payload;
+    iov[1].iov_len = stream->filledPackets*samplesPerPacket*stream->channelBytes;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &stream->address;
+    msg.msg_namelen = sizeof(stream->address);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (0 != sock_send(socket, &msg, MSG_DONTWAIT, &sentLength)) {
+        sendErrors++;
+    }
+}
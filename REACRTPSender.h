@@ -0,0 +1,141 @@
+/*
+ *  REACRTPSender.h
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REACRTPSENDER_H
+#define _REACRTPSENDER_H
+
+#include <libkern/OSTypes.h>
+#include <libkern/c++/OSObject.h>
+#include <IOKit/IOReturn.h>
+#include <IOKit/IOLib.h>
+#include <kern/thread.h>
+#include <sys/kpi_socket.h>
+#include <netinet/in.h>
+
+#include "REACConstants.h"
+
+#define REACRTPSender              com_pereckerdal_driver_REACRTPSender
+
+// Sends REAC input channels out as AES67 style RTP streams (L24, big endian
+// interleaved) over UDP, so that the console feed can be received by machines
+// that have no REAC interface of their own.
+//
+// The receive path hands each REAC packet over through a lock free ring, like
+// REACRecorder does, and a kernel thread of the sender's own puts the RTP packets
+// together and sends them. The RTP timestamps are derived from the REAC packet
+// counter, so lost REAC packets show up as gaps in the RTP timestamps.
+class REACRTPSender : public OSObject {
+    OSDeclareDefaultStructors(REACRTPSender)
+
+public:
+#   define REAC_RTP_MAX_STREAMS 16
+    // Ethernet MTU minus the IP, UDP and RTP headers
+#   define REAC_RTP_MAX_PAYLOAD (1500-20-8-12)
+
+    struct StreamParams {
+        UInt32  address;            // IPv4 address, in network byte order
+        UInt16  port;
+        UInt8   payloadType;
+        UInt32  firstChannel;       // Zero based
+        UInt32  numChannels;
+        UInt32  packetsPerRTPPacket; // REAC packets per RTP packet. 0 means as many as fit in 1ms.
+    };
+
+    virtual bool initWithStreams(UInt32 inChannels, UInt32 samplesPerPacket,
+                                 const StreamParams *params, UInt32 numStreams);
+    static REACRTPSender *withStreams(UInt32 inChannels, UInt32 samplesPerPacket,
+                                      const StreamParams *params, UInt32 numStreams);
+
+    // Parses a dotted decimal IPv4 address into network byte order.
+    static bool parseAddress(const char *string, UInt32 *address);
+
+protected:
+    // Object destruction method that is used by free, and the init method on failure.
+    virtual void deinit();
+    virtual void free();
+
+public:
+    // Hands over the samples of one REAC input packet. Is only to be called from one
+    // thread at a time. Never blocks.
+    void writePacket(UInt16 counter, const UInt8 *samples);
+
+    UInt64 getDroppedPackets() const { return droppedPackets; }
+    UInt64 getSendErrors() const { return sendErrors; }
+
+protected:
+#   define REAC_RTP_RING_PACKETS 256 // A power of two
+#   define REAC_RTP_MAX_PACKETS_PER_RTP_PACKET (REAC_PACKETS_PER_SECOND/1000)
+
+    struct Stream {
+        StreamParams        params;
+        struct sockaddr_in  address;
+        UInt8               header[12];     // Only the sequence number and timestamp change between packets
+        UInt16              sequence;
+        UInt32              channelBytes;   // The size of one frame of the stream
+        UInt32              filledPackets;  // The number of REAC packets in payload
+        UInt32              packetTimestamp;
+        UInt32              nextTimestamp;
+        UInt8               payload[REAC_RTP_MAX_PAYLOAD];
+    };
+
+    UInt32              inChannels;
+    UInt32              samplesPerPacket; // Of the REAC connection
+    UInt32              packetSize;      // Of a REAC input packet
+    Stream             *streams;
+    UInt32              numStreams;
+    UInt32              timestampOffset;
+
+    // Used by writePacket only, to extend the REAC counter
+    bool                haveCounter;
+    UInt16              lastCounter;
+    UInt32              timestamp;
+
+    // Ring buffer of REAC packets. ringHead is only written by the producer and
+    // ringTail only by the sender thread; they are free running packet counters.
+    UInt8              *ringSamples;
+    UInt32              ringTimestamps[REAC_RTP_RING_PACKETS];
+    volatile UInt32     ringHead;
+    volatile UInt32     ringTail;
+    volatile UInt64     droppedPackets;
+
+    // Sender thread state
+    socket_t            socket;
+    IOLock             *lock;           // Protects the sleeping and waking of the sender thread
+    volatile bool       senderSleeping;
+    volatile bool       senderShouldStop;
+    volatile bool       senderRunning;
+    UInt64              sendErrors;
+
+    static void senderThreadMain(void *param, wait_result_t waitResult);
+    void drainRing();
+    void addToStream(Stream *stream, UInt32 packetTimestamp, const UInt8 *samples);
+    void sendStream(Stream *stream);
+    // Waits for the sender thread to exit.
+    void stopSender();
+};
+
+
+#endif
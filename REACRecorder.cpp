@@ -0,0 +1,436 @@
+/*
+ *  REACRecorder.cpp
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "REACRecorder.h"
+
+#include <IOKit/IOMultiMemoryDescriptor.h>
+#include <libkern/OSAtomic.h>
+#include <libkern/OSByteOrder.h>
+#include <mach/vm_param.h>
+#include <sys/fcntl.h>
+
+#include "REACConstants.h"
+
+// How long the writer thread sleeps when there is not enough data to write
+#define REAC_RECORDER_POLL_INTERVAL_MS 20
+// The largest ring buffer that can be requested
+#define REAC_RECORDER_MAX_RING_SIZE (64*1024*1024)
+
+#define super OSObject
+
+OSDefineMetaClassAndStructors(REACRecorder, super)
+
+bool REACRecorder::initWithPath(const char *path, FileFormat format_, UInt32 numChannels_,
+                                UInt32 sampleRate_, UInt32 ringSize_) {
+    if (0 == numChannels_ || 0 == sampleRate_) {
+        return false;
+    }
+    
+    format = format_;
+    numChannels = numChannels_;
+    sampleRate = sampleRate_;
+    
+    return initWriter(path, ringSize_, REAC_RECORDER_WRITE_SIZE);
+}
+
+bool REACRecorder::initWriter(const char *path, UInt32 ringSize_, UInt32 writeSize_) {
+    thread_t thread;
+
+    ring = NULL;
+    ringMemory = NULL;
+    ringMirror = NULL;
+    writeBuffer = NULL;
+    vnode = NULL;
+    context = NULL;
+    writerRunning = false;
+    writerShouldStop = false;
+    ringHead = ringTail = 0;
+    droppedBytes = 0;
+    dataBytes = 0;
+    writeSize = writeSize_;
+
+    if (NULL == path || 0 == writeSize || 0 != writeSize % PAGE_SIZE ||
+        ringSize_ < writeSize || ringSize_ > REAC_RECORDER_MAX_RING_SIZE) {
+        goto Fail;
+    }
+
+    ringSize = 1;
+    while (ringSize < ringSize_) {
+        ringSize <<= 1;
+    }
+
+    writeBuffer = (UInt8 *)IOMallocAligned(writeSize, PAGE_SIZE);
+    if (!allocateRing() || NULL == writeBuffer) {
+        IOLog("REACRecorder::initWriter(): Failed to allocate buffers.\n");
+        goto Fail;
+    }
+
+    context = vfs_context_create(NULL);
+    if (NULL == context) {
+        goto Fail;
+    }
+
+    if (0 != vnode_open(path, O_CREAT | O_TRUNC | FWRITE, 0644, 0, &vnode, context)) {
+        IOLog("REACRecorder::initWriter(): Failed to open '%s'.\n", path);
+        vnode = NULL;
+        goto Fail;
+    }
+
+    if (kIOReturnSuccess != writeHeader()) {
+        goto Fail;
+    }
+
+    writerRunning = true;
+    if (KERN_SUCCESS != kernel_thread_start(&REACRecorder::writerThreadMain, this, &thread)) {
+        IOLog("REACRecorder::initWriter(): Failed to start writer thread.\n");
+        writerRunning = false;
+        goto Fail;
+    }
+    thread_deallocate(thread);
+
+    return true;
+
+Fail:
+    deinit();
+    return false;
+}
+
+REACRecorder *REACRecorder::withPath(const char *path, FileFormat format, UInt32 numChannels,
+                                     UInt32 sampleRate, UInt32 ringSize) {
+    REACRecorder *r = new REACRecorder;
+    if (NULL == r) return NULL;
+    bool result = r->initWithPath(path, format, numChannels, sampleRate, ringSize);
+    if (!result) {
+        r->release();
+        return NULL;
+    }
+    return r;
+}
+
+void REACRecorder::stopWriter() {
+    if (writerRunning) {
+        // The writer thread writes whatever is left in the ring buffer before it stops
+        writerShouldStop = true;
+        while (writerRunning) {
+            IOSleep(REAC_RECORDER_POLL_INTERVAL_MS);
+        }
+    }
+}
+
+void REACRecorder::deinit() {
+    stopWriter();
+
+    if (NULL != vnode) {
+        vnode_close(vnode, FWRITE, context);
+        vnode = NULL;
+    }
+
+    if (NULL != context) {
+        vfs_context_rele(context);
+        context = NULL;
+    }
+
+    if (NULL != writeBuffer) {
+        IOFreeAligned(writeBuffer, writeSize);
+        writeBuffer = NULL;
+    }
+
+    ring = NULL;
+
+    if (NULL != ringMirror) {
+        ringMirror->release();
+        ringMirror = NULL;
+    }
+
+    if (NULL != ringMemory) {
+        ringMemory->release();
+        ringMemory = NULL;
+    }
+}
+
+void REACRecorder::free() {
+    deinit();
+    super::free();
+}
+
+bool REACRecorder::allocateRing() {
+    IOMemoryDescriptor *halves[2];
+    IOMultiMemoryDescriptor *mirror;
+
+    // ringSize is a power of two that is at least writeSize, so it is a multiple of the page size
+    ringMemory = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut, ringSize, PAGE_SIZE);
+    if (NULL == ringMemory) {
+        return false;
+    }
+
+    halves[0] = halves[1] = ringMemory;
+    mirror = IOMultiMemoryDescriptor::withDescriptors(halves, 2, kIODirectionInOut, false);
+    if (NULL != mirror) {
+        // The mapping keeps the descriptor alive
+        ringMirror = mirror->createMappingInTask(kernel_task, 0, kIOMapAnywhere);
+        mirror->release();
+    }
+
+    if (NULL != ringMirror) {
+        ring = (UInt8 *)ringMirror->getVirtualAddress();
+    }
+    else {
+        IOLog("REACRecorder::allocateRing(): Failed to mirror the ring buffer. Falling back to split copies.\n");
+        ring = (UInt8 *)ringMemory->getBytesNoCopy();
+    }
+    return NULL != ring;
+}
+
+void REACRecorder::writeSamples(const UInt8 *data, UInt32 size) {
+    const UInt32 head = ringHead;
+    const UInt32 tail = ringTail;
+
+    if (ringSize-(head-tail) < size) {
+        // The writer thread can't keep up. Drop the whole packet, so that the
+        // recording stays frame aligned.
+        droppedBytes += size;
+        return;
+    }
+
+    const UInt32 offset = head & (ringSize-1);
+    if (NULL != ringMirror) {
+        memcpy(ring+offset, data, size);
+    }
+    else {
+        const UInt32 firstPart = (size < ringSize-offset) ? size : ringSize-offset;
+        memcpy(ring+offset, data, firstPart);
+        memcpy(ring, data+firstPart, size-firstPart);
+    }
+
+    // The samples have to be in the ring before the writer thread can see them
+    OSMemoryBarrier();
+    ringHead = head+size;
+}
+
+void REACRecorder::writerThreadMain(void *param, wait_result_t waitResult) {
+    REACRecorder *recorder = (REACRecorder *)param;
+
+    while (!recorder->writerShouldStop) {
+        recorder->drainRing(false);
+        IOSleep(REAC_RECORDER_POLL_INTERVAL_MS);
+    }
+
+    recorder->drainRing(true);
+    recorder->finishHeader();
+
+    OSMemoryBarrier();
+    recorder->writerRunning = false;
+    // The recorder might be freed from here on
+
+    thread_terminate(current_thread());
+}
+
+IOReturn REACRecorder::drainRing(bool flush) {
+    for (;;) {
+        const UInt32 head = ringHead;
+        OSMemoryBarrier();
+        const UInt32 available = head-ringTail;
+        const UInt32 length = (available < writeSize) ? available : writeSize;
+
+        // Only full chunks are written while recording, so that the writes stay big
+        // and page aligned in the file.
+        if (0 == length || (!flush && writeSize != length)) {
+            return kIOReturnSuccess;
+        }
+
+        const UInt32 offset = ringTail & (ringSize-1);
+        UInt8 *chunk;
+        if (NULL != ringMirror) {
+            // The chunk is prepared and written in place. The producer can't touch
+            // it until ringTail has moved past it.
+            chunk = ring+offset;
+        }
+        else {
+            const UInt32 firstPart = (length < ringSize-offset) ? length : ringSize-offset;
+            memcpy(writeBuffer, ring+offset, firstPart);
+            memcpy(writeBuffer+firstPart, ring, length-firstPart);
+            chunk = writeBuffer;
+
+            // The samples have to be copied out before the producer can overwrite them
+            OSMemoryBarrier();
+            ringTail += length;
+        }
+
+        prepareChunk(chunk, length, REAC_RECORDER_HEADER_SIZE+dataBytes);
+
+        const IOReturn result = writeToFile(chunk, length, REAC_RECORDER_HEADER_SIZE+dataBytes);
+
+        if (NULL != ringMirror) {
+            // The chunk has to be written before the producer can overwrite it
+            OSMemoryBarrier();
+            ringTail += length;
+        }
+
+        if (kIOReturnSuccess != result) {
+            return kIOReturnIOError;
+        }
+        dataBytes += length;
+    }
+}
+
+void REACRecorder::prepareChunk(UInt8 *buffer, UInt32 length, UInt64 offset) {
+    if (FORMAT_RF64 == format) {
+        // WAV files are little endian. REAC_RECORDER_WRITE_SIZE is a multiple of
+        // the sample size, so no sample is split between two chunks.
+        for (UInt32 i=0; i+2<length; i+=REAC_RESOLUTION) {
+            const UInt8 msb = buffer[i];
+            buffer[i] = buffer[i+2];
+            buffer[i+2] = msb;
+        }
+    }
+}
+
+IOReturn REACRecorder::writeToFile(const void *buffer, UInt32 length, UInt64 offset) {
+    return writeToVnode(vnode, context, buffer, length, offset, IO_NOCACHE);
+}
+
+IOReturn REACRecorder::writeToVnode(vnode_t vp, vfs_context_t ctx, const void *buffer,
+                                    UInt32 length, UInt64 offset, int ioflags) {
+    int resid = 0;
+    int error = vn_rdwr(UIO_WRITE, vp, (caddr_t)buffer, length, (off_t)offset, UIO_SYSSPACE,
+                        ioflags | IO_UNIT, vfs_context_ucred(ctx), &resid, vfs_context_proc(ctx));
+    if (0 != error || 0 != resid) {
+        IOLog("REACRecorder::writeToVnode(): Failed to write %u bytes at offset %llu (error %d).\n",
+              (unsigned int)length, (unsigned long long)offset, error);
+        return kIOReturnIOError;
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn REACRecorder::writeHeader() {
+    static const UInt8 pcmSubFormat[] = {
+        0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+        0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+    };
+    const UInt32 bytesPerFrame = REAC_RESOLUTION*numChannels;
+    UInt8 *h = writeBuffer;
+
+    memset(h, 0, REAC_RECORDER_HEADER_SIZE);
+
+    if (FORMAT_CAF == format) {
+        // File header
+        memcpy(h+0, "caff", 4);
+        OSWriteBigInt16(h, 4, 1); // Version
+        OSWriteBigInt16(h, 6, 0); // Flags
+
+        // Audio description chunk
+        memcpy(h+8, "desc", 4);
+        OSWriteBigInt64(h, 12, 32);
+        OSWriteBigInt64(h, 20, float64BitsFromInteger(sampleRate));
+        memcpy(h+28, "lpcm", 4);
+        OSWriteBigInt32(h, 32, 0); // Format flags: Big endian signed integers
+        OSWriteBigInt32(h, 36, bytesPerFrame);
+        OSWriteBigInt32(h, 40, 1); // Frames per packet
+        OSWriteBigInt32(h, 44, numChannels);
+        OSWriteBigInt32(h, 48, REAC_RESOLUTION*8);
+
+        // Free chunk, to make the sample data start at REAC_RECORDER_HEADER_SIZE
+        memcpy(h+52, "free", 4);
+        OSWriteBigInt64(h, 56, REAC_RECORDER_HEADER_SIZE-16-52-12);
+
+        // Audio data chunk. The size is -1 (unknown) until finishHeader is called.
+        memcpy(h+REAC_RECORDER_HEADER_SIZE-16, "data", 4);
+        OSWriteBigInt64(h, REAC_RECORDER_HEADER_SIZE-12, (UInt64)-1);
+        OSWriteBigInt32(h, REAC_RECORDER_HEADER_SIZE-4, 0); // Edit count
+    }
+    else {
+        // RIFF header. The real sizes are in the ds64 chunk.
+        memcpy(h+0, "RF64", 4);
+        OSWriteLittleInt32(h, 4, 0xffffffff);
+        memcpy(h+8, "WAVE", 4);
+
+        // ds64 chunk. Filled in by finishHeader.
+        memcpy(h+12, "ds64", 4);
+        OSWriteLittleInt32(h, 16, 28);
+
+        // Format chunk (WAVE_FORMAT_EXTENSIBLE)
+        memcpy(h+48, "fmt ", 4);
+        OSWriteLittleInt32(h, 52, 40);
+        OSWriteLittleInt16(h, 56, 0xfffe);
+        OSWriteLittleInt16(h, 58, numChannels);
+        OSWriteLittleInt32(h, 60, sampleRate);
+        OSWriteLittleInt32(h, 64, sampleRate*bytesPerFrame);
+        OSWriteLittleInt16(h, 68, bytesPerFrame);
+        OSWriteLittleInt16(h, 70, REAC_RESOLUTION*8);
+        OSWriteLittleInt16(h, 72, 22); // Size of the extension
+        OSWriteLittleInt16(h, 74, REAC_RESOLUTION*8);
+        OSWriteLittleInt32(h, 76, 0); // Channel mask
+        memcpy(h+80, pcmSubFormat, sizeof(pcmSubFormat));
+
+        // Junk chunk, to make the sample data start at REAC_RECORDER_HEADER_SIZE
+        memcpy(h+96, "JUNK", 4);
+        OSWriteLittleInt32(h, 100, REAC_RECORDER_HEADER_SIZE-8-96-8);
+
+        // Data chunk
+        memcpy(h+REAC_RECORDER_HEADER_SIZE-8, "data", 4);
+        OSWriteLittleInt32(h, REAC_RECORDER_HEADER_SIZE-4, 0xffffffff);
+    }
+
+    return writeToFile(h, REAC_RECORDER_HEADER_SIZE, 0);
+}
+
+IOReturn REACRecorder::finishHeader() {
+    UInt8 buf[24];
+
+    if (FORMAT_CAF == format) {
+        // The data chunk size includes the edit count
+        OSWriteBigInt64(buf, 0, dataBytes+4);
+        return writeToFile(buf, 8, REAC_RECORDER_HEADER_SIZE-12);
+    }
+    else {
+        if (dataBytes & 1) {
+            // RIFF chunks are padded to an even size
+            buf[0] = 0;
+            if (kIOReturnSuccess != writeToFile(buf, 1, REAC_RECORDER_HEADER_SIZE+dataBytes)) {
+                return kIOReturnIOError;
+            }
+        }
+
+        OSWriteLittleInt64(buf, 0, REAC_RECORDER_HEADER_SIZE-8+dataBytes+(dataBytes & 1)); // RIFF size
+        OSWriteLittleInt64(buf, 8, dataBytes);                                            // Data size
+        OSWriteLittleInt64(buf, 16, dataBytes/(REAC_RESOLUTION*numChannels));              // Sample count
+        return writeToFile(buf, sizeof(buf), 20);
+    }
+}
+
+UInt64 REACRecorder::float64BitsFromInteger(UInt32 value) {
+    // The kernel can't use floating point, so the IEEE 754 representation is built by hand
+    if (0 == value) {
+        return 0;
+    }
+
+    UInt32 exponent = 31;
+    while (!(value & (1U << exponent))) {
+        exponent--;
+    }
+    const UInt64 mantissa = ((UInt64)value << (52-exponent)) & ((1ULL << 52)-1);
+    return ((UInt64)(1023+exponent) << 52) | mantissa;
+}
@@ -0,0 +1,142 @@
+/*
+ *  REACRecorder.h
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REACRECORDER_H
+#define _REACRECORDER_H
+
+#include <libkern/OSTypes.h>
+#include <libkern/c++/OSObject.h>
+#include <IOKit/IOReturn.h>
+#include <IOKit/IOLib.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <kern/thread.h>
+#include <sys/vnode.h>
+
+#define REACRecorder              com_pereckerdal_driver_REACRecorder
+
+// Records REAC input samples to a file, without going through CoreAudio.
+//
+// The samples are handed over from the receive path through a lock free single
+// producer/single consumer ring buffer, and written to disk by a kernel thread
+// of the recorder's own, in big chunks that are aligned to the page size and
+// bypass the buffer cache. The receive path never blocks on the disk: If the
+// writer can't keep up, samples are dropped and counted.
+//
+// The samples are expected to be 24 bit big endian interleaved, like they are
+// in the audio engine buffers. CAF files store them as they are, RF64 files
+// (64 bit WAV, for recordings bigger than 4GB) get them byte swapped by the
+// writer thread.
+//
+// When possible, the ring buffer is mapped twice in a row in the kernel's
+// address space, so that any range of up to ringSize bytes that starts in the
+// ring is contiguous in memory. Neither side then has to split its copies at
+// the end of the ring, and the writer thread can hand the ring memory straight
+// to the file system instead of copying it to a separate buffer first.
+class REACRecorder : public OSObject {
+    OSDeclareDefaultStructors(REACRecorder)
+
+public:
+    enum FileFormat {
+        FORMAT_CAF,
+        FORMAT_RF64
+    };
+
+    // ringSize is rounded up to a power of two.
+    virtual bool initWithPath(const char *path, FileFormat format, UInt32 numChannels,
+                              UInt32 sampleRate, UInt32 ringSize);
+    static REACRecorder *withPath(const char *path, FileFormat format, UInt32 numChannels,
+                                  UInt32 sampleRate, UInt32 ringSize);
+
+protected:
+    // Opens the file, writes its header and starts the writer thread. Is used by
+    // the init methods of this class and its subclasses once they have set up
+    // what writeHeader needs. writeSize must be a multiple of the page size.
+    bool initWriter(const char *path, UInt32 ringSize, UInt32 writeSize);
+    
+    // Object destruction method that is used by free, and the init methods on failure.
+    virtual void deinit();
+    // Writes out what is left in the ring buffer and waits for the writer thread
+    // to exit. Subclasses call this before tearing down anything the writer uses.
+    void stopWriter();
+    virtual void free();
+
+public:
+    // Is only to be called from one thread at a time. Never blocks.
+    void writeSamples(const UInt8 *data, UInt32 size);
+
+    UInt64 getDroppedBytes() const { return droppedBytes; }
+    UInt64 getRecordedBytes() const { return dataBytes; }
+
+protected:
+#   define REAC_RECORDER_HEADER_SIZE 4096 // The sample data starts at this offset in the file
+#   define REAC_RECORDER_WRITE_SIZE (3*256*1024) // A multiple of both the page size and REAC_RESOLUTION
+
+    FileFormat          format;
+    UInt32              numChannels;
+    UInt32              sampleRate;
+
+    // Ring buffer. ringHead is only written by the producer and ringTail only by
+    // the writer thread; they are free running byte counters.
+    UInt8              *ring;
+    UInt32              ringSize;
+    IOBufferMemoryDescriptor *ringMemory;
+    IOMemoryMap        *ringMirror;      // Maps ringMemory twice in a row. NULL if that failed.
+    volatile UInt32     ringHead;
+    volatile UInt32     ringTail;
+    volatile UInt64     droppedBytes;
+
+    // Writer thread state
+    UInt8              *writeBuffer;
+    UInt32              writeSize;       // The size of the chunks that are written while recording
+    volatile bool       writerShouldStop;
+    volatile bool       writerRunning;
+    vnode_t             vnode;
+    vfs_context_t       context;
+    UInt64              dataBytes;       // The number of sample bytes that have been written to the file
+
+    // Allocates the ring buffer, mirrored if possible.
+    bool allocateRing();
+    static void writerThreadMain(void *param, wait_result_t waitResult);
+    // Writes as much of the ring buffer as possible. Only writes full chunks unless flush is true.
+    IOReturn drainRing(bool flush);
+
+    // Is called by the writer thread on each chunk before it is written at offset
+    // in the file. The default implementation converts the samples to the byte
+    // order of the file format.
+    virtual void prepareChunk(UInt8 *buffer, UInt32 length, UInt64 offset);
+    
+    IOReturn writeToFile(const void *buffer, UInt32 length, UInt64 offset);
+    static IOReturn writeToVnode(vnode_t vp, vfs_context_t ctx, const void *buffer,
+                                 UInt32 length, UInt64 offset, int ioflags);
+    virtual IOReturn writeHeader();
+    // Fills in the sizes in the header that are unknown while recording
+    virtual IOReturn finishHeader();
+
+    static UInt64 float64BitsFromInteger(UInt32 value);
+};
+
+
+#endif
@@ -0,0 +1,583 @@
+/*
+ *  REACSampleKernels.cpp
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "REACSampleKernels.h"
+
+#include "PCMBlitterLib.h"
+
+#include <string.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#define REAC_SAMPLE_SIZE 3
+
+static inline void meterSample(const UInt8 *sample, REACChannelMeter *meter) {
+    SInt32 value = (SInt32)(((UInt32)sample[0] << 24) | ((UInt32)sample[1] << 16) | ((UInt32)sample[2] << 8)) >> 8;
+    UInt32 magnitude = (value < 0) ? (UInt32)-value : (UInt32)value;
+    
+    if (magnitude > meter->peak) {
+        meter->peak = magnitude;
+    }
+    if (magnitude >= REAC_CLIP_LEVEL) {
+        meter->clipCount++;
+    }
+    meter->sumOfSquares += (UInt64)magnitude*magnitude;
+}
+
+void REACMeterInt24(const UInt8 *samples, UInt32 numChannels, UInt32 numFrames, REACChannelMeter *meters) {
+    const UInt32 frameSize = numChannels*REAC_SAMPLE_SIZE;
+    const UInt32 totalSize = numFrames*frameSize;
+    UInt32 channel = 0;
+    
+#if defined(__SSSE3__)
+    // Four channels at a time, one 128 bit register per frame. The loads are 16
+    // bytes for 12 bytes of samples, so the last frames of the last group may have
+    // to be done one sample at a time to not read past the end of the buffer.
+    const __m128i shuffle = _mm_setr_epi8(-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9);
+    const __m128i clipThreshold = _mm_set1_epi32(REAC_CLIP_LEVEL-1);
+    
+    for (; channel+4 <= numChannels; channel += 4) {
+        __m128i peak = _mm_setzero_si128();
+        __m128i clipCount = _mm_setzero_si128();
+        __m128i sumEven = _mm_setzero_si128(); // Channels 0 and 2 of the group
+        __m128i sumOdd = _mm_setzero_si128();  // Channels 1 and 3 of the group
+        UInt32 offset = channel*REAC_SAMPLE_SIZE;
+        UInt32 frame = 0;
+        
+        for (; frame < numFrames && offset+16 <= totalSize; frame++, offset += frameSize) {
+            __m128i raw = _mm_loadu_si128((const __m128i *)(samples+offset));
+            // Put each sample in the top 24 bits of a lane, then sign extend it
+            __m128i value = _mm_srai_epi32(_mm_shuffle_epi8(raw, shuffle), 8);
+            __m128i magnitude = _mm_abs_epi32(value);
+            
+            // There is no 32 bit max before SSE4.1. The magnitudes are positive, so a signed compare works.
+            __m128i greater = _mm_cmpgt_epi32(magnitude, peak);
+            peak = _mm_or_si128(_mm_and_si128(greater, magnitude), _mm_andnot_si128(greater, peak));
+            
+            // The compare gives -1 for clipped lanes
+            clipCount = _mm_sub_epi32(clipCount, _mm_cmpgt_epi32(magnitude, clipThreshold));
+            
+            sumEven = _mm_add_epi64(sumEven, _mm_mul_epu32(magnitude, magnitude));
+            __m128i oddMagnitude = _mm_srli_epi64(magnitude, 32);
+            sumOdd = _mm_add_epi64(sumOdd, _mm_mul_epu32(oddMagnitude, oddMagnitude));
+        }
+        
+        UInt32 peaks[4], clips[4];
+        UInt64 evens[2], odds[2];
+        _mm_storeu_si128((__m128i *)peaks, peak);
+        _mm_storeu_si128((__m128i *)clips, clipCount);
+        _mm_storeu_si128((__m128i *)evens, sumEven);
+        _mm_storeu_si128((__m128i *)odds, sumOdd);
+        for (UInt32 i=0; i<4; i++) {
+            REACChannelMeter *meter = &meters[channel+i];
+            if (peaks[i] > meter->peak) {
+                meter->peak = peaks[i];
+            }
+            meter->clipCount += clips[i];
+            meter->sumOfSquares += (i & 1) ? odds[i/2] : evens[i/2];
+        }
+        
+        for (; frame < numFrames; frame++, offset += frameSize) {
+            for (UInt32 i=0; i<4; i++) {
+                meterSample(samples+offset+i*REAC_SAMPLE_SIZE, &meters[channel+i]);
+            }
+        }
+    }
+#endif
+    
+    for (; channel < numChannels; channel++) {
+        const UInt8 *sample = samples+channel*REAC_SAMPLE_SIZE;
+        for (UInt32 frame = 0; frame < numFrames; frame++, sample += frameSize) {
+            meterSample(sample, &meters[channel]);
+        }
+    }
+}
+
+float REACDecibelsToGain(float decibels) {
+    // 10^(dB/20) = 2^(dB*log2(10)/20). The kernel has no libm, so 2^x is computed
+    // as a power of two times a Taylor polynomial of 2^f, -0.5 <= f <= 0.5.
+    float exponent = decibels*0.166096404744368f;
+    if (exponent < -126.0f) {
+        return 0.0f;
+    }
+    if (exponent > 127.0f) {
+        exponent = 127.0f;
+    }
+    
+    const SInt32 whole = (SInt32)(exponent+(exponent >= 0 ? 0.5f : -0.5f));
+    const float f = exponent-(float)whole;
+    const float fraction = 1.0f+f*(0.693147181f+f*(0.240226507f+f*(0.0555041087f+
+                                  f*(0.00961812911f+f*(0.00133335581f+f*0.000154035304f)))));
+    
+    union {
+        UInt32 bits;
+        float  value;
+    } power;
+    power.bits = (UInt32)(whole+127) << 23;
+    return power.value*fraction;
+}
+
+static inline void floatToSample(float value, UInt8 *sample) {
+    value *= 8388608.0f;
+    if (value > 8388607.0f) value = 8388607.0f;
+    if (value < -8388608.0f) value = -8388608.0f;
+    const SInt32 integer = (SInt32)(value+(value >= 0 ? 0.5f : -0.5f));
+    sample[0] = (UInt8)(integer >> 16);
+    sample[1] = (UInt8)(integer >> 8);
+    sample[2] = (UInt8)integer;
+}
+
+static inline float sampleToFloat(const UInt8 *sample) {
+    const SInt32 value = (SInt32)(((UInt32)sample[0] << 24) | ((UInt32)sample[1] << 16) | ((UInt32)sample[2] << 8)) >> 8;
+    return (float)value*(1.0f/8388608.0f);
+}
+
+void REACFloat32ToInt24WithGain(const float *src, UInt8 *dst, UInt32 numChannels, UInt32 numFrames,
+                                float *gains, const float *targetGains) {
+    if (numChannels > REAC_GAIN_MAX_CHANNELS || 0 == numFrames) {
+        return;
+    }
+    
+    const float frames = (float)numFrames;
+    UInt32 channel = 0;
+    
+#if defined(__SSSE3__)
+    // Four channels at a time. Each sample is stored as 12 bytes, so that nothing
+    // after the last sample is touched.
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m128 scale = _mm_set1_ps(8388608.0f);
+    const __m128 maxValue = _mm_set1_ps(8388607.0f);
+    const __m128 minValue = _mm_set1_ps(-8388608.0f);
+    
+    for (; channel+4 <= numChannels; channel += 4) {
+        __m128 gain = _mm_loadu_ps(gains+channel);
+        const __m128 target = _mm_loadu_ps(targetGains+channel);
+        const __m128 step = _mm_div_ps(_mm_sub_ps(target, gain), _mm_set1_ps(frames));
+        const float *in = src+channel;
+        UInt8 *out = dst+channel*3;
+        
+        for (UInt32 frame = 0; frame < numFrames; frame++, in += numChannels, out += numChannels*3) {
+            __m128 value = _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(in), gain), scale);
+            value = _mm_max_ps(_mm_min_ps(value, maxValue), minValue);
+            const __m128i packed = _mm_shuffle_epi8(_mm_cvtps_epi32(value), pack);
+            const UInt32 last = (UInt32)_mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+            _mm_storel_epi64((__m128i *)out, packed);
+            memcpy(out+8, &last, sizeof(last));
+            gain = _mm_add_ps(gain, step);
+        }
+        
+        _mm_storeu_ps(gains+channel, target);
+    }
+#endif
+    
+    for (; channel < numChannels; channel++) {
+        const float step = (targetGains[channel]-gains[channel])/frames;
+        float gain = gains[channel];
+        for (UInt32 frame = 0; frame < numFrames; frame++) {
+            floatToSample(src[frame*numChannels+channel]*gain, dst+(frame*numChannels+channel)*3);
+            gain += step;
+        }
+        gains[channel] = targetGains[channel];
+    }
+}
+
+void REACInt24ToFloat32WithGain(const UInt8 *src, float *dst, UInt32 numChannels, UInt32 numFrames,
+                                float *gains, const float *targetGains) {
+    if (numChannels > REAC_GAIN_MAX_CHANNELS || 0 == numFrames) {
+        return;
+    }
+    
+    const float frames = (float)numFrames;
+    const UInt32 frameSize = numChannels*REAC_SAMPLE_SIZE;
+    const UInt32 totalSize = numFrames*frameSize;
+    UInt32 channel = 0;
+    
+#if defined(__SSSE3__)
+    const __m128i shuffle = _mm_setr_epi8(-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9);
+    const __m128 scale = _mm_set1_ps(1.0f/8388608.0f);
+    
+    for (; channel+4 <= numChannels; channel += 4) {
+        __m128 gain = _mm_loadu_ps(gains+channel);
+        const __m128 target = _mm_loadu_ps(targetGains+channel);
+        const __m128 step = _mm_div_ps(_mm_sub_ps(target, gain), _mm_set1_ps(frames));
+        UInt32 offset = channel*REAC_SAMPLE_SIZE;
+        float *out = dst+channel;
+        UInt32 frame = 0;
+        
+        // The loads are 16 bytes, so the last frames may have to be done one sample at a time
+        for (; frame < numFrames && offset+16 <= totalSize; frame++, offset += frameSize, out += numChannels) {
+            const __m128i raw = _mm_loadu_si128((const __m128i *)(src+offset));
+            const __m128i value = _mm_srai_epi32(_mm_shuffle_epi8(raw, shuffle), 8);
+            _mm_storeu_ps(out, _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(value), scale), gain));
+            gain = _mm_add_ps(gain, step);
+        }
+        
+        float remaining[4];
+        _mm_storeu_ps(remaining, gain);
+        const float *steps = (const float *)&step;
+        for (; frame < numFrames; frame++, offset += frameSize, out += numChannels) {
+            for (UInt32 i=0; i<4; i++) {
+                out[i] = sampleToFloat(src+offset+i*REAC_SAMPLE_SIZE)*remaining[i];
+                remaining[i] += steps[i];
+            }
+        }
+        
+        _mm_storeu_ps(gains+channel, target);
+    }
+#endif
+    
+    for (; channel < numChannels; channel++) {
+        const float step = (targetGains[channel]-gains[channel])/frames;
+        float gain = gains[channel];
+        for (UInt32 frame = 0; frame < numFrames; frame++) {
+            dst[frame*numChannels+channel] = sampleToFloat(src+frame*frameSize+channel*REAC_SAMPLE_SIZE)*gain;
+            gain += step;
+        }
+        gains[channel] = targetGains[channel];
+    }
+}
+
+void REACSetRouteGain(REACRoute *route, SInt32 decibels) {
+    route->gain = REACDecibelsToGain((float)decibels);
+}
+
+void REACMixInt24(const UInt8 *in, UInt32 inChannels, UInt8 *out, UInt32 outChannels, UInt32 numFrames,
+                  const REACRoute *routes, UInt32 numRoutes) {
+    // The mix is done one output channel at a time, with the frames in a row, so
+    // that it can be vectorized over the frames.
+    float sum[REAC_MIX_MAX_FRAMES] __attribute__((aligned(16)));
+    float samples[REAC_MIX_MAX_FRAMES] __attribute__((aligned(16)));
+    const UInt32 inFrameSize = inChannels*REAC_SAMPLE_SIZE;
+    const UInt32 outFrameSize = outChannels*REAC_SAMPLE_SIZE;
+    UInt32 i = 0;
+    
+    if (numFrames > REAC_MIX_MAX_FRAMES) {
+        return;
+    }
+    
+    while (i < numRoutes) {
+        const UInt32 output = routes[i].output;
+        if (output >= outChannels) {
+            i++;
+            continue;
+        }
+        
+        // Start with what is already in the output
+        UInt8 *outSample = out+output*REAC_SAMPLE_SIZE;
+        for (UInt32 frame = 0; frame < numFrames; frame++) {
+            sum[frame] = sampleToFloat(outSample+frame*outFrameSize);
+        }
+        
+        for (; i < numRoutes && routes[i].output == output; i++) {
+            if (routes[i].input >= inChannels) {
+                continue;
+            }
+            
+            const UInt8 *inSample = in+routes[i].input*REAC_SAMPLE_SIZE;
+            for (UInt32 frame = 0; frame < numFrames; frame++) {
+                samples[frame] = sampleToFloat(inSample+frame*inFrameSize);
+            }
+            
+            UInt32 frame = 0;
+#if defined(__SSSE3__)
+            const __m128 gain = _mm_set1_ps(routes[i].gain);
+            for (; frame+4 <= numFrames; frame += 4) {
+                _mm_store_ps(sum+frame, _mm_add_ps(_mm_load_ps(sum+frame), _mm_mul_ps(_mm_load_ps(samples+frame), gain)));
+            }
+#endif
+            for (; frame < numFrames; frame++) {
+                sum[frame] += samples[frame]*routes[i].gain;
+            }
+        }
+        
+        for (UInt32 frame = 0; frame < numFrames; frame++) {
+            floatToSample(sum[frame], outSample+frame*outFrameSize);
+        }
+    }
+}
+
+// The window that a byte of a frame belongs to. The last window is moved back so
+// that it ends with the frame; windows never reach outside of the frame.
+static inline UInt32 patchWindow(UInt32 byte, UInt32 frameSize) {
+    const UInt32 window = byte & ~15;
+    return (window+16 > frameSize) ? frameSize-16 : window;
+}
+
+UInt32 REACCompilePatches(const UInt16 *inputs, const UInt16 *outputs, UInt32 numPatches,
+                          UInt32 inChannels, UInt32 outChannels, REACPatchOp *ops, UInt32 maxOps) {
+    const UInt32 inFrameSize = inChannels*REAC_SAMPLE_SIZE;
+    const UInt32 outFrameSize = outChannels*REAC_SAMPLE_SIZE;
+    SInt16 sourceByte[REAC_PATCH_MAX_CHANNELS*REAC_SAMPLE_SIZE];
+    UInt32 numOps = 0;
+    
+    if (inFrameSize < 16 || outFrameSize < 16 ||
+        inChannels > REAC_PATCH_MAX_CHANNELS || outChannels > REAC_PATCH_MAX_CHANNELS) {
+        return 0;
+    }
+    
+    for (UInt32 i=0; i<outFrameSize; i++) {
+        sourceByte[i] = -1;
+    }
+    for (UInt32 i=0; i<numPatches; i++) {
+        if (inputs[i] >= inChannels || outputs[i] >= outChannels) {
+            continue;
+        }
+        for (UInt32 k=0; k<REAC_SAMPLE_SIZE; k++) {
+            sourceByte[outputs[i]*REAC_SAMPLE_SIZE+k] = inputs[i]*REAC_SAMPLE_SIZE+k;
+        }
+    }
+    
+    for (UInt32 window = 0; window < outFrameSize; window += 16) {
+        const UInt32 outOffset = patchWindow(window, outFrameSize);
+        const UInt32 firstOp = numOps;
+        
+        for (UInt32 byte = window; byte < window+16 && byte < outFrameSize; byte++) {
+            if (sourceByte[byte] < 0 || patchWindow(byte, outFrameSize) != outOffset) {
+                continue;
+            }
+            
+            const UInt32 inOffset = patchWindow(sourceByte[byte], inFrameSize);
+            UInt32 op = firstOp;
+            while (op < numOps && ops[op].inOffset != inOffset) {
+                op++;
+            }
+            if (op == numOps) {
+                if (numOps == maxOps) {
+                    return 0;
+                }
+                ops[op].outOffset = outOffset;
+                ops[op].inOffset = inOffset;
+                memset(ops[op].shuffle, 0x80, sizeof(ops[op].shuffle));
+                numOps++;
+            }
+            ops[op].shuffle[byte-outOffset] = (UInt8)(sourceByte[byte]-inOffset);
+        }
+    }
+    
+    return numOps;
+}
+
+void REACApplyPatches(const UInt8 *in, UInt32 inChannels, UInt8 *out, UInt32 outChannels, UInt32 numFrames,
+                      const REACPatchOp *ops, UInt32 numOps) {
+    const UInt32 inFrameSize = inChannels*REAC_SAMPLE_SIZE;
+    const UInt32 outFrameSize = outChannels*REAC_SAMPLE_SIZE;
+    
+    for (UInt32 frame = 0; frame < numFrames; frame++, in += inFrameSize, out += outFrameSize) {
+        UInt32 i = 0;
+        while (i < numOps) {
+            const UInt32 outOffset = ops[i].outOffset;
+#if defined(__SSSE3__)
+            const __m128i zero = _mm_setzero_si128();
+            __m128i value = _mm_loadu_si128((const __m128i *)(out+outOffset));
+            for (; i < numOps && ops[i].outOffset == outOffset; i++) {
+                const __m128i shuffle = _mm_loadu_si128((const __m128i *)ops[i].shuffle);
+                const __m128i keep = _mm_cmplt_epi8(shuffle, zero);
+                const __m128i patched = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in+ops[i].inOffset)), shuffle);
+                value = _mm_or_si128(_mm_and_si128(value, keep), patched);
+            }
+            _mm_storeu_si128((__m128i *)(out+outOffset), value);
+#else
+            for (; i < numOps && ops[i].outOffset == outOffset; i++) {
+                for (UInt32 j=0; j<16; j++) {
+                    if (!(ops[i].shuffle[j] & 0x80)) {
+                        out[outOffset+j] = in[ops[i].inOffset+(ops[i].shuffle[j] & 15)];
+                    }
+                }
+            }
+#endif
+        }
+    }
+}
+
+void REACCopyPatches(const UInt8 *in, UInt32 inChannels, UInt8 *out, UInt32 outChannels, UInt32 numFrames,
+                     const UInt16 *inputs, const UInt16 *outputs, UInt32 numPatches) {
+    for (UInt32 frame = 0; frame < numFrames; frame++, in += inChannels*REAC_SAMPLE_SIZE, out += outChannels*REAC_SAMPLE_SIZE) {
+        for (UInt32 i=0; i<numPatches; i++) {
+            if (inputs[i] < inChannels && outputs[i] < outChannels) {
+                memcpy(out+outputs[i]*REAC_SAMPLE_SIZE, in+inputs[i]*REAC_SAMPLE_SIZE, REAC_SAMPLE_SIZE);
+            }
+        }
+    }
+}
+
+// The filter design only runs when the engine is set up, so it goes for simple
+// rather than fast.
+static double sine(double x) {
+    const double pi = 3.14159265358979323846;
+    // Reduce to [-pi, pi]
+    const double turns = x/(2*pi);
+    x -= 2*pi*(double)(SInt64)(turns+(turns >= 0 ? 0.5 : -0.5));
+    
+    double term = x, sum = x;
+    for (int i=1; i<12; i++) {
+        term *= -x*x/((2*i)*(2*i+1));
+        sum += term;
+    }
+    return sum;
+}
+
+// The modified Bessel function of the first kind, for the Kaiser window
+static double besselI0(double x) {
+    double term = 1, sum = 1;
+    for (int i=1; i<32; i++) {
+        term *= (x/(2*i))*(x/(2*i));
+        sum += term;
+    }
+    return sum;
+}
+
+static double squareRoot(double x) {
+    double result = (x > 1) ? x : 1;
+    for (int i=0; i<64; i++) {
+        result = 0.5*(result+x/result);
+    }
+    return result;
+}
+
+void REACDesignResampler(REACResampler *resampler, float *coefficients, UInt32 up, UInt32 down) {
+    const double pi = 3.14159265358979323846;
+    const double beta = 8.0;      // Kaiser window parameter; about 80dB stop band attenuation
+    const UInt32 taps = REAC_RESAMPLER_TAPS;
+    const UInt32 length = up*taps;
+    // The cut off frequency, relative to the upsampled rate. It is a bit below
+    // the Nyquist frequency of the lower of the two rates.
+    const double cutoff = 0.45*((up < down) ? 1.0/down : 1.0/up);
+    const double center = (length-1)/2.0;
+    double sum = 0;
+    
+    for (UInt32 n=0; n<length; n++) {
+        const double x = n-center;
+        const double ratio = x/(center+1);
+        const double window = besselI0(beta*squareRoot(1-ratio*ratio))/besselI0(beta);
+        const double sinc = (0 == x) ? 2*cutoff : sine(2*pi*cutoff*x)/(pi*x);
+        const double value = sinc*window;
+        
+        // Phase by phase: Coefficient j of phase p is h[p+up*j]
+        coefficients[(n % up)*taps+n/up] = (float)value;
+        sum += value;
+    }
+    
+    // Normalize to unity gain at DC
+    for (UInt32 n=0; n<length; n++) {
+        coefficients[n] = (float)(coefficients[n]*up/sum);
+    }
+    
+    resampler->up = up;
+    resampler->down = down;
+    resampler->taps = taps;
+    resampler->coefficients = coefficients;
+}
+
+// in points to input frame 0, which is preceded by at least taps-1 frames.
+static void resampleFrames(const REACResampler *resampler, const float *in, UInt32 numChannels, UInt64 position,
+                           UInt8 *out, UInt32 frameStride, UInt32 channelStride, UInt32 numOutFrames) {
+    float sums[REAC_RESAMPLER_MAX_CHANNELS];
+    
+    for (UInt32 frame = 0; frame < numOutFrames; frame++, position += resampler->down, out += frameStride) {
+        const UInt32 base = (UInt32)(position/resampler->up);
+        const float *coefficients = resampler->coefficients + (position % resampler->up)*resampler->taps;
+        const float *input = in + base*numChannels;
+        
+        for (UInt32 channel = 0; channel < numChannels; channel++) {
+            sums[channel] = 0;
+        }
+        for (UInt32 tap = 0; tap < resampler->taps; tap++, input -= numChannels) {
+            const float coefficient = coefficients[tap];
+            UInt32 channel = 0;
+#if defined(__SSSE3__)
+            const __m128 c = _mm_set1_ps(coefficient);
+            for (; channel+4 <= numChannels; channel += 4) {
+                const __m128 sum = _mm_add_ps(_mm_loadu_ps(sums+channel), _mm_mul_ps(_mm_loadu_ps(input+channel), c));
+                _mm_storeu_ps(sums+channel, sum);
+            }
+#endif
+            for (; channel < numChannels; channel++) {
+                sums[channel] += input[channel]*coefficient;
+            }
+        }
+        
+        for (UInt32 channel = 0; channel < numChannels; channel++) {
+            floatToSample(sums[channel], out+channel*channelStride);
+        }
+    }
+}
+
+void REACResampleInt24(const REACResampler *resampler, const UInt8 *in, UInt32 numInFrames,
+                       UInt32 numChannels, float *history, UInt32 position,
+                       UInt8 *out, UInt32 frameStride, UInt32 channelStride, UInt32 numOutFrames) {
+    const UInt32 historyFrames = resampler->taps-1;
+    
+    if (numChannels > REAC_RESAMPLER_MAX_CHANNELS) {
+        return;
+    }
+    
+    float *input = history + historyFrames*numChannels;
+    for (UInt32 i=0; i<numInFrames*numChannels; i++) {
+        input[i] = sampleToFloat(in+i*REAC_SAMPLE_SIZE);
+    }
+    
+    resampleFrames(resampler, input, numChannels, position, out, frameStride, channelStride, numOutFrames);
+    
+    memmove(history, history+numInFrames*numChannels, historyFrames*numChannels*sizeof(float));
+}
+
+void REACResampleInt24FromRing(const REACResampler *resampler, const UInt8 *ring, UInt32 ringFrames,
+                               UInt32 frameStride, UInt32 channelStride, UInt32 numChannels,
+                               float *scratch, UInt64 position, UInt8 *out, UInt32 numOutFrames) {
+    if (numChannels > REAC_RESAMPLER_MAX_CHANNELS || 0 == numOutFrames) {
+        return;
+    }
+    
+    // Gather the input frames that the output frames depend on
+    const UInt32 historyFrames = resampler->taps-1;
+    const UInt64 firstBase = position/resampler->up;
+    const UInt64 lastBase = (position+(UInt64)(numOutFrames-1)*resampler->down)/resampler->up;
+    const UInt32 numInFrames = (UInt32)(lastBase-firstBase)+1+historyFrames;
+    UInt32 ringFrame = (UInt32)((firstBase+ringFrames-historyFrames % ringFrames) % ringFrames);
+    
+    for (UInt32 frame = 0; frame < numInFrames; frame++) {
+        const UInt8 *sample = ring + ringFrame*frameStride;
+        for (UInt32 channel = 0; channel < numChannels; channel++) {
+            scratch[frame*numChannels+channel] = sampleToFloat(sample+channel*channelStride);
+        }
+        if (++ringFrame == ringFrames) {
+            ringFrame = 0;
+        }
+    }
+    
+    resampleFrames(resampler, scratch+historyFrames*numChannels, numChannels, position-firstBase*resampler->up,
+                   out, numChannels*REAC_SAMPLE_SIZE, REAC_SAMPLE_SIZE, numOutFrames);
+}
+
+void REACDeinterleaveInt24(const UInt8 *in, UInt32 numChannels, UInt32 numFrames, UInt8 *planes, UInt32 planeSize) {
+    DeinterleaveInt24(in, numChannels, numFrames, planes, planeSize/REAC_SAMPLE_SIZE);
+}
+
+void REACInterleaveInt24(const UInt8 *planes, UInt32 planeSize, UInt32 numChannels, UInt32 numFrames, UInt8 *out) {
+    InterleaveInt24(planes, planeSize/REAC_SAMPLE_SIZE, numChannels, numFrames, out);
+}
@@ -0,0 +1,156 @@
+/*
+ *  REACSampleKernels.h
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REACSAMPLEKERNELS_H
+#define _REACSAMPLEKERNELS_H
+
+// Sample processing routines that work directly on the 24 bit big endian
+// interleaved samples of the REAC packets and engine buffers. They are part of
+// the REACFloatSupport library, because that is where SIMD instructions may be
+// used; the rest of the driver is built for the kernel and can't use them.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libkern/OSTypes.h>
+
+// The smallest absolute sample value that counts as clipped (24 bit full scale)
+#define REAC_CLIP_LEVEL 0x7FFFFF
+
+typedef struct {
+    UInt32 peak;          // The largest absolute sample value
+    UInt32 clipCount;     // The number of samples at REAC_CLIP_LEVEL or above
+    UInt64 sumOfSquares;
+} REACChannelMeter;
+
+// Accumulates the levels of numFrames frames of numChannels channels into
+// meters, which has one element per channel.
+void REACMeterInt24(const UInt8 *samples, UInt32 numChannels, UInt32 numFrames, REACChannelMeter *meters);
+
+// The largest number of channels that the gain functions can handle
+#define REAC_GAIN_MAX_CHANNELS 64
+
+float REACDecibelsToGain(float decibels);
+
+// Converts numFrames frames of numChannels channels between float and 24 bit
+// samples, multiplying each channel by its gain. The gains ramp linearly from
+// gains to targetGains over the frames, and gains is set to targetGains when
+// done. Output samples are clipped to 24 bits.
+void REACFloat32ToInt24WithGain(const float *src, UInt8 *dst, UInt32 numChannels, UInt32 numFrames,
+                                float *gains, const float *targetGains);
+void REACInt24ToFloat32WithGain(const UInt8 *src, float *dst, UInt32 numChannels, UInt32 numFrames,
+                                float *gains, const float *targetGains);
+
+// A route from an input channel to an output channel, for REACMixInt24.
+typedef struct {
+    UInt16 input;
+    UInt16 output;
+    float  gain;
+} REACRoute;
+
+// The largest number of frames that REACMixInt24 can handle at a time
+#define REAC_MIX_MAX_FRAMES 16
+
+// Sets the gain of route, in dB. Is for code that can't use floating point.
+void REACSetRouteGain(REACRoute *route, SInt32 decibels);
+
+// Adds input channels of in to output channels of out, as described by routes.
+// Routes to the same output must be next to each other. The sums are clipped
+// to 24 bits.
+void REACMixInt24(const UInt8 *in, UInt32 inChannels, UInt8 *out, UInt32 outChannels, UInt32 numFrames,
+                  const REACRoute *routes, UInt32 numRoutes);
+
+// Patches copy input channels to output channels as they are, without any
+// conversion. For frames of at least 16 bytes, they are compiled into a list of
+// byte shuffles between 16 byte windows of the input and output frames, so that
+// a patch bay of any size costs a few shuffles per frame.
+typedef struct {
+    UInt16 outOffset;     // The offset of a 16 byte window in the output frame
+    UInt16 inOffset;      // The offset of a 16 byte window in the input frame
+    UInt8  shuffle[16];   // For each output byte, the input byte to take, or 0x80 to leave it
+} REACPatchOp;
+
+// The largest frame size (in channels) that patches can be compiled for
+#define REAC_PATCH_MAX_CHANNELS 64
+
+// Compiles patches into ops, which is sorted by outOffset. If an output is patched
+// more than once, the last patch wins. Returns the number of ops, or 0 if the
+// patches can't be compiled (the frames are too small or there are more than
+// maxOps ops). Such patches can be applied with REACCopyPatches instead.
+UInt32 REACCompilePatches(const UInt16 *inputs, const UInt16 *outputs, UInt32 numPatches,
+                          UInt32 inChannels, UInt32 outChannels, REACPatchOp *ops, UInt32 maxOps);
+void REACApplyPatches(const UInt8 *in, UInt32 inChannels, UInt8 *out, UInt32 outChannels, UInt32 numFrames,
+                      const REACPatchOp *ops, UInt32 numOps);
+void REACCopyPatches(const UInt8 *in, UInt32 inChannels, UInt8 *out, UInt32 outChannels, UInt32 numFrames,
+                     const UInt16 *inputs, const UInt16 *outputs, UInt32 numPatches);
+
+// Polyphase sample rate converter. It converts from one rate to up/down times
+// that rate, with a windowed sinc low pass filter of taps taps per phase. The
+// position of an output frame is counted in units of 1/up input frames, and
+// increases by down for each output frame.
+typedef struct {
+    UInt32        up;
+    UInt32        down;
+    UInt32        taps;
+    const float  *coefficients;   // up*taps coefficients, phase by phase
+} REACResampler;
+
+#define REAC_RESAMPLER_TAPS 64
+#define REAC_RESAMPLER_MAX_CHANNELS 64
+// The number of frames of scratch space that the converters need for converting
+// to or from numFrames frames at a time (with up >= down or down >= up respectively)
+#define REAC_RESAMPLER_SCRATCH_FRAMES(numFrames) (REAC_RESAMPLER_TAPS+2*(numFrames)+2)
+
+// coefficients must have room for up*REAC_RESAMPLER_TAPS floats.
+void REACDesignResampler(REACResampler *resampler, float *coefficients, UInt32 up, UInt32 down);
+
+// Converts a block of numInFrames interleaved input frames to numOutFrames output
+// frames, of which the first is at position (relative to the first input frame).
+// history is scratch space that keeps the end of the input from one block to the
+// next; it must be zeroed before the first block. Sample c of output frame n is
+// written at out+n*frameStride+c*channelStride, so the output can be interleaved
+// or planar.
+void REACResampleInt24(const REACResampler *resampler, const UInt8 *in, UInt32 numInFrames,
+                       UInt32 numChannels, float *history, UInt32 position,
+                       UInt8 *out, UInt32 frameStride, UInt32 channelStride, UInt32 numOutFrames);
+// Converts from a ring buffer of ringFrames frames, which is laid out like the
+// output of REACResampleInt24, to numOutFrames interleaved output frames. The
+// first output frame is at position (relative to the start of the ring).
+void REACResampleInt24FromRing(const REACResampler *resampler, const UInt8 *ring, UInt32 ringFrames,
+                               UInt32 frameStride, UInt32 channelStride, UInt32 numChannels,
+                               float *scratch, UInt64 position, UInt8 *out, UInt32 numOutFrames);
+
+// Converts between interleaved 24 bit frames and planar 24 bit samples, with
+// each channel in a plane of its own. Plane c starts at planes+c*planeSize.
+void REACDeinterleaveInt24(const UInt8 *in, UInt32 numChannels, UInt32 numFrames, UInt8 *planes, UInt32 planeSize);
+void REACInterleaveInt24(const UInt8 *planes, UInt32 planeSize, UInt32 numChannels, UInt32 numFrames, UInt8 *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ *  REACSharedStream.cpp
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "REACSharedStream.h"
+
+#include <IOKit/IOMultiMemoryDescriptor.h>
+#include <libkern/OSAtomic.h>
+#include <kern/clock.h>
+#include <mach/vm_param.h>
+
+#include "REACConstants.h"
+
+#define super OSObject
+
+OSDefineMetaClassAndStructors(REACSharedStream, super)
+
+bool REACSharedStream::initWithChannels(UInt32 numChannels, UInt32 sampleRate, UInt32 ringFrames_) {
+    IOMemoryDescriptor *parts[3];
+    UInt32 headerSize;
+
+    headerMemory = NULL;
+    ringMemory = NULL;
+    memory = NULL;
+    header = NULL;
+    ring = NULL;
+    writeFrame = 0;
+    for (UInt32 i=0; i<REAC_SHARED_STREAM_MAX_READERS; i++) {
+        overrunReadFrames[i] = 0;
+    }
+
+    if (!super::init()) {
+        return false;
+    }
+
+    if (0 == numChannels || numChannels > REAC_MAX_CHANNEL_COUNT || 0 == sampleRate) {
+        goto Fail;
+    }
+    bytesPerFrame = REAC_RESOLUTION*numChannels;
+
+    // A power of two that is a multiple of the page size makes the ring size a
+    // multiple of the page size, whatever the frame size is
+    ringFrames = PAGE_SIZE;
+    while (ringFrames < ringFrames_) {
+        ringFrames <<= 1;
+    }
+    if ((UInt64)ringFrames*bytesPerFrame > REAC_SHARED_STREAM_MAX_RING_SIZE) {
+        IOLog("REACSharedStream::initWithChannels(): Too big ring.\n");
+        goto Fail;
+    }
+
+    headerSize = (sizeof(REACSharedStreamHeader)+PAGE_SIZE-1) & ~(PAGE_SIZE-1);
+    headerMemory = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                         headerSize, PAGE_SIZE);
+    ringMemory = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                       ringFrames*bytesPerFrame, PAGE_SIZE);
+    if (NULL == headerMemory || NULL == ringMemory) {
+        IOLog("REACSharedStream::initWithChannels(): Failed to allocate memory.\n");
+        goto Fail;
+    }
+    header = (REACSharedStreamHeader *)headerMemory->getBytesNoCopy();
+    ring = (UInt8 *)ringMemory->getBytesNoCopy();
+
+    parts[0] = headerMemory;
+    parts[1] = parts[2] = ringMemory;
+    memory = IOMultiMemoryDescriptor::withDescriptors(parts, 3, kIODirectionInOut, false);
+    if (NULL == memory) {
+        goto Fail;
+    }
+
+    memset(header, 0, headerSize);
+    memset(ring, 0, ringFrames*bytesPerFrame);
+    strncpy(header->magic, REAC_SHARED_STREAM_MAGIC, sizeof(header->magic));
+    header->version = REAC_SHARED_STREAM_VERSION;
+    header->headerSize = headerSize;
+    header->channels = numChannels;
+    header->bytesPerFrame = bytesPerFrame;
+    header->ringFrames = ringFrames;
+    header->sampleRate = sampleRate;
+
+    return true;
+
+Fail:
+    deinit();
+    return false;
+}
+
+REACSharedStream *REACSharedStream::withChannels(UInt32 numChannels, UInt32 sampleRate, UInt32 ringFrames) {
+    REACSharedStream *s = new REACSharedStream;
+    if (NULL == s) return NULL;
+    bool result = s->initWithChannels(numChannels, sampleRate, ringFrames);
+    if (!result) {
+        s->release();
+        return NULL;
+    }
+    return s;
+}
+
+void REACSharedStream::deinit() {
+    // Readers can keep the memory mapped after the stream is gone
+    if (NULL != header) {
+        header->closed = 1;
+        OSMemoryBarrier();
+        header = NULL;
+    }
+    ring = NULL;
+
+    if (NULL != memory) {
+        memory->release();
+        memory = NULL;
+    }
+
+    if (NULL != ringMemory) {
+        ringMemory->release();
+        ringMemory = NULL;
+    }
+
+    if (NULL != headerMemory) {
+        headerMemory->release();
+        headerMemory = NULL;
+    }
+}
+
+void REACSharedStream::free() {
+    deinit();
+    super::free();
+}
+
+void REACSharedStream::writeSamples(const UInt8 *data, UInt32 size) {
+    const UInt32 ringSize = ringFrames*bytesPerFrame;
+    const UInt32 offset = (UInt32)(writeFrame & (ringFrames-1))*bytesPerFrame;
+    const UInt32 firstPart = (size < ringSize-offset) ? size : ringSize-offset;
+    UInt64 now, ns;
+
+    memcpy(ring+offset, data, firstPart);
+    memcpy(ring, data+firstPart, size-firstPart);
+    writeFrame += size/bytesPerFrame;
+
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now, &ns);
+
+    // The samples have to be in the ring before the readers can see the new position
+    OSMemoryBarrier();
+    header->sequence++;
+    OSMemoryBarrier();
+    header->writeFrame = writeFrame;
+    header->timestamp = ns;
+    OSMemoryBarrier();
+    header->sequence++;
+
+    checkReaders();
+}
+
+void REACSharedStream::checkReaders() {
+    for (UInt32 i=0; i<REAC_SHARED_STREAM_MAX_READERS; i++) {
+        REACSharedStreamReader *reader = &header->readers[i];
+        if (0 == reader->owner) {
+            continue;
+        }
+
+        // readFrame is written by a user space program, so it is only ever compared
+        const UInt64 readFrame = reader->readFrame;
+        if (writeFrame-readFrame > ringFrames && readFrame != overrunReadFrames[i]) {
+            reader->overruns++;
+            overrunReadFrames[i] = readFrame;
+        }
+    }
+}
@@ -0,0 +1,86 @@
+/*
+ *  REACSharedStream.h
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REACSHAREDSTREAM_H
+#define _REACSHAREDSTREAM_H
+
+#include <libkern/OSTypes.h>
+#include <libkern/c++/OSObject.h>
+#include <IOKit/IOLib.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+#include "REACSharedStreamFormat.h"
+
+#define REACSharedStream              com_pereckerdal_driver_REACSharedStream
+
+// Publishes the input samples of a connection in memory that any number of user
+// space programs can map and read at the same time, without going through
+// CoreAudio. The layout of the memory and the rules for reading it are described
+// in REACSharedStreamFormat.h.
+class REACSharedStream : public OSObject {
+    OSDeclareDefaultStructors(REACSharedStream)
+
+public:
+    // ringFrames is rounded up to a power of two, and to at least a page worth of
+    // frames so that the ring can be mirrored.
+    virtual bool initWithChannels(UInt32 numChannels, UInt32 sampleRate, UInt32 ringFrames);
+    static REACSharedStream *withChannels(UInt32 numChannels, UInt32 sampleRate, UInt32 ringFrames);
+
+protected:
+    // Object destruction method that is used by free, and the init method on failure.
+    virtual void deinit();
+    virtual void free();
+
+public:
+    // Is only to be called from one thread at a time. Never blocks. size has to be
+    // a whole number of frames.
+    void writeSamples(const UInt8 *data, UInt32 size);
+
+    // The memory that readers map: The header, followed by the ring twice.
+    IOMemoryDescriptor *getMemory() const { return memory; }
+
+protected:
+#   define REAC_SHARED_STREAM_MAX_RING_SIZE (64*1024*1024)
+
+    IOBufferMemoryDescriptor *headerMemory;
+    IOBufferMemoryDescriptor *ringMemory;
+    IOMemoryDescriptor       *memory;
+    REACSharedStreamHeader   *header;
+    UInt8                    *ring;
+    UInt32                    ringFrames;
+    UInt32                    bytesPerFrame;
+    UInt64                    writeFrame;
+
+    // The readFrame of each reader slot when an overrun was last counted for it,
+    // so that each overrun is only counted once.
+    UInt64                    overrunReadFrames[REAC_SHARED_STREAM_MAX_READERS];
+
+    // Counts the overruns of the readers that have fallen behind.
+    void checkReaders();
+};
+
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ *  REACSharedStreamFormat.h
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REACSHAREDSTREAMFORMAT_H
+#define _REACSHAREDSTREAMFORMAT_H
+
+// The layout of the shared memory through which the driver publishes the live
+// input samples of a connection. This header is plain C and has no dependencies
+// on the rest of the driver, so that it can be used as is by the programs that
+// read the stream.
+//
+// The memory is mapped through the REAC user client (IOServiceOpen on the REAC
+// device, then IOConnectMapMemory with the index of the connection as memory
+// type). It starts with a REACSharedStreamHeader, padded to headerSize bytes.
+// After it comes the ring, ringFrames frames of 24 bit big endian interleaved
+// samples. The ring is mapped twice in a row, so a reader can use any range of
+// up to ringFrames frames in place without splitting it at the end of the ring.
+//
+// The driver is the only writer. It never waits for readers: It copies each
+// packet into the ring and then publishes the new writeFrame, together with the
+// time it got the packet. sequence is odd while they are being updated; readers
+// copy writeFrame and timestamp and retry if sequence was odd or changed
+// meanwhile. Frame n is at ring offset (n % ringFrames)*bytesPerFrame.
+//
+// Any number of readers can read the stream. Those that want the driver to
+// detect overruns for them claim a slot in readers by changing its owner from 0
+// to their pid with a compare and swap, and store the first frame they have not
+// read yet in readFrame as they go. When writeFrame gets more than ringFrames
+// ahead of readFrame, the frames in between are lost: The driver counts this in
+// overruns, and the reader should skip ahead. overruns is never reset, so readers
+// set readFrame right after claiming a slot and then use the overruns of that
+// moment as their starting point. Readers should also check that
+// writeFrame hasn't moved more than ringFrames past the start of what they read
+// once they are done reading it, since the ring can be overwritten while they
+// read. A reader frees its slot by setting owner back to 0.
+//
+// When the connection goes away, closed is set to a non-zero value and the
+// stream stops. Readers then have to map the memory again to get the stream of
+// the next connection.
+//
+// All integers are in the byte order of the host.
+
+#include <stdint.h>
+
+#define REAC_SHARED_STREAM_MAGIC        "REACSHM"
+#define REAC_SHARED_STREAM_VERSION      1
+#define REAC_SHARED_STREAM_MAX_READERS  32
+
+typedef struct {
+    volatile uint32_t owner;          // 0 when the slot is free, otherwise the pid of the reader
+    uint32_t          reserved;
+    volatile uint64_t readFrame;      // Written by the reader
+    volatile uint64_t overruns;       // Written by the driver
+    uint64_t          reserved2;
+} REACSharedStreamReader;
+
+typedef struct {
+    char              magic[8];       // REAC_SHARED_STREAM_MAGIC, zero terminated
+    uint32_t          version;        // REAC_SHARED_STREAM_VERSION
+    uint32_t          headerSize;     // The offset of the ring
+    uint32_t          channels;
+    uint32_t          bytesPerFrame;
+    uint32_t          ringFrames;     // A power of two
+    uint32_t          sampleRate;
+    volatile uint32_t closed;
+    volatile uint32_t sequence;
+    volatile uint64_t writeFrame;     // The number of frames that have been written
+    volatile uint64_t timestamp;      // Uptime in nanoseconds when the packet that ends at writeFrame arrived
+    REACSharedStreamReader readers[REAC_SHARED_STREAM_MAX_READERS];
+} REACSharedStreamHeader;
+
+#endif
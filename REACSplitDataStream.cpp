@@ -30,14 +30,24 @@
 
 #include "REACConnection.h"
 
+#include <kern/clock.h>
+
 OSDefineMetaClassAndStructors(REACSplitDataStream, super)
 
 bool REACSplitDataStream::initConnection(REACConnection *conn) {
     handshakeState = HANDSHAKE_NOT_INITIATED;
+    handshakeStartTime = 0;
     
     return super::initConnection(conn);
 }
 
+void REACSplitDataStream::resetHandshake() {
+    if (HANDSHAKE_NOT_INITIATED != handshakeState) {
+        IOLog("REACSplitDataStream::resetHandshake(): Disconnect.\n");
+        handshakeState = HANDSHAKE_NOT_INITIATED;
+    }
+}
+
 bool REACSplitDataStream::gotPacket(const REACPacketHeader *packet, const EthernetHeader *header) {
     if (super::gotPacket(packet, header)) {
         return true;
@@ -53,6 +63,7 @@ bool REACSplitDataStream::gotPacket(const REACPacketHeader *packet, const Ethern
                 masterDevice.in_channels = map->inChannels;
                 masterDevice.out_channels = map->outChannels;
                 handshakeState = HANDSHAKE_GOT_MASTER_ANNOUNCE;
+                clock_get_uptime(&handshakeStartTime);
             }
             result = true;
         }
@@ -106,6 +117,12 @@ bool REACSplitDataStream::prepareSplitAnnounce(REACPacketHeader *packet) {
         connection->getInterfaceAddr(ETHER_ADDR_LEN, packet->data+9 /* sorry about the magic constant */);
         ret = true;
         handshakeState = HANDSHAKE_CONNECTED;
+        
+        UInt64 now, ns;
+        clock_get_uptime(&now);
+        absolutetime_to_nanoseconds(now-handshakeStartTime, &ns);
+        IOLog("REACSplitDataStream::prepareSplitAnnounce(): Handshake done in %llu us.\n",
+              (unsigned long long)(ns/1000));
     }
     else if (HANDSHAKE_CONNECTED == handshakeState) {
         memset(packet->data, 0, sizeof(packet->data));
@@ -43,6 +43,15 @@ public:
     
     // Returns true if a packet should be sent
     bool prepareSplitAnnounce(REACPacketHeader *packet);
+    // Returns true if the master has answered and the handshake waits for our next
+    // announce. The connection then sends it right away, instead of on the next
+    // periodic announce.
+    bool isAnnounceDue() const {
+        return HANDSHAKE_GOT_MASTER_ANNOUNCE == handshakeState ||
+               HANDSHAKE_GOT_SECOND_MASTER_ANNOUNCE == handshakeState;
+    }
+    // Starts over with waiting for a master announce. Is used when the connection is lost.
+    void resetHandshake();
     
 protected:
     enum HandshakeState {
@@ -56,6 +65,7 @@ protected:
     REACDeviceInfo      masterDevice;
     UInt8               splitIdentifier;
     UInt64              counterAtLastSplitAnnounce;
+    UInt64              handshakeStartTime; // Uptime when the first master announce arrived
 };
 
 
@@ -0,0 +1,70 @@
+/*
+ *  REACStageProfile.cpp
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "REACStageProfile.h"
+
+#ifdef REAC_STAGE_PROFILING
+
+#include <IOKit/IOLib.h>
+
+static const char *stageNames[REAC_STAGE_COUNT] = {
+    "classify",
+    "header",
+    "ring",
+    "sample copy",
+    "taps",
+    "convert",
+    "build",
+    "send"
+};
+
+void REACStageProfile::reset() {
+    memset(this, 0, sizeof(*this));
+    startCycles = REACReadCycles();
+    startTime = mach_absolute_time();
+}
+
+void REACStageProfile::log(const char *owner, const void *object) {
+    const UInt64 elapsedCycles = REACReadCycles()-startCycles;
+    UInt64 elapsedNS, cyclesPerMS;
+    
+    absolutetime_to_nanoseconds(mach_absolute_time()-startTime, &elapsedNS);
+    cyclesPerMS = elapsedCycles/(elapsedNS/1000000+1);
+    
+    for (int i=0; i<REAC_STAGE_COUNT; i++) {
+        if (0 == counts[i]) {
+            continue;
+        }
+        // The slowest run, in ns, to compare with the 125000 ns a packet has
+        const UInt64 maxNS = (0 == cyclesPerMS) ? 0 : maxCycles[i]*1000000/cyclesPerMS;
+        IOLog("%s[%p]: %-12s %llu runs, %llu cycles on average, %llu cycles (%llu ns) at most\n",
+              owner, object, stageNames[i], counts[i], cycles[i]/counts[i], maxCycles[i], maxNS);
+    }
+    
+    reset();
+}
+
+#endif
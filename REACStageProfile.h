@@ -0,0 +1,102 @@
+/*
+ *  REACStageProfile.h
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REACSTAGEPROFILE_H
+#define _REACSTAGEPROFILE_H
+
+#include <libkern/OSTypes.h>
+
+// Optional cycle counts for the stages of the packet paths, to find out which
+// stage eats into the 125 us that each packet has on a given machine. It is
+// compiled in when REAC_STAGE_PROFILING is defined in the build settings, of
+// both the driver and REACFloatSupport since it changes the layout of the
+// classes that have profiles. When it isn't, the macros below expand to nothing.
+//
+// A stage is timed by putting it between REAC_STAGE_BEGIN and REAC_STAGE_END,
+// with a variable that is declared by REAC_STAGE_DECLARE at the top of the
+// function (so that the gotos of the function don't jump over it).
+// The times are in time stamp counter cycles on Intel and in absolute time
+// units elsewhere. Each profile is only to be updated by one thread per stage.
+
+enum REACStage {
+    REAC_STAGE_CLASSIFY,      // The checks of the input filter
+    REAC_STAGE_HEADER,        // Fetching and checking the REAC header
+    REAC_STAGE_RING,          // Handing the packet to the engine, which updates its buffers
+    REAC_STAGE_SAMPLE_COPY,   // Copying the samples out of the mbuf
+    REAC_STAGE_TAPS,          // The recorder, shared stream and RTP sender
+    REAC_STAGE_CONVERT,       // Converting samples to float for CoreAudio
+    REAC_STAGE_BUILD,         // Putting an outgoing packet together
+    REAC_STAGE_SEND,          // Handing it to the interface
+    REAC_STAGE_COUNT
+};
+
+#ifdef REAC_STAGE_PROFILING
+
+#include <kern/clock.h>
+
+static inline UInt64 REACReadCycles() {
+#if defined(__i386__) || defined(__x86_64__)
+    UInt32 lo, hi;
+    // lfence keeps rdtsc from running ahead of the code that is timed
+    __asm__ __volatile__ ("lfence; rdtsc" : "=a" (lo), "=d" (hi));
+    return ((UInt64)hi << 32) | lo;
+#else
+    return mach_absolute_time();
+#endif
+}
+
+struct REACStageProfile {
+    UInt64  cycles[REAC_STAGE_COUNT];
+    UInt64  maxCycles[REAC_STAGE_COUNT];
+    UInt64  counts[REAC_STAGE_COUNT];
+    UInt64  startCycles;    // For converting cycles to time when logging
+    UInt64  startTime;
+    
+    void reset();
+    void add(REACStage stage, UInt64 stageCycles) {
+        cycles[stage] += stageCycles;
+        counts[stage]++;
+        if (stageCycles > maxCycles[stage]) {
+            maxCycles[stage] = stageCycles;
+        }
+    }
+    // Logs the average and slowest run of each stage that has run, and resets the profile.
+    void log(const char *owner, const void *object);
+};
+
+#define REAC_STAGE_DECLARE(var) UInt64 var
+#define REAC_STAGE_BEGIN(var) var = REACReadCycles()
+#define REAC_STAGE_END(profile, stage, var) (profile).add((stage), REACReadCycles()-(var))
+
+#else
+
+#define REAC_STAGE_DECLARE(var)
+#define REAC_STAGE_BEGIN(var)
+#define REAC_STAGE_END(profile, stage, var)
+
+#endif
+
+#endif
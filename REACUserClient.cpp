@@ -0,0 +1,77 @@
+/*
+ *  REACUserClient.cpp
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "REACUserClient.h"
+
+#include "REACMeterFormat.h"
+
+#define super IOUserClient
+
+OSDefineMetaClassAndStructors(REACUserClient, super)
+
+bool REACUserClient::initWithTask(task_t owningTask, void *securityID, UInt32 type) {
+    if (kIOReturnSuccess != clientHasPrivilege(securityID, kIOClientPrivilegeAdministrator)) {
+        IOLog("REACUserClient::initWithTask(): The client is not an administrator.\n");
+        return false;
+    }
+    return super::initWithTask(owningTask, securityID, type);
+}
+
+bool REACUserClient::start(IOService *provider) {
+    device = OSDynamicCast(REACDevice, provider);
+    if (NULL == device) {
+        return false;
+    }
+    return super::start(provider);
+}
+
+IOReturn REACUserClient::clientClose() {
+    terminate();
+    return kIOReturnSuccess;
+}
+
+IOReturn REACUserClient::clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) {
+    // The caller releases the memory descriptor
+    if (type >= REAC_METER_MEMORY_TYPE) {
+        IOMemoryDescriptor *meterMemory = device->copyMeterMemory(type-REAC_METER_MEMORY_TYPE);
+        if (NULL == meterMemory) {
+            return kIOReturnNotFound;
+        }
+        
+        *options = kIOMapReadOnly;
+        *memory = meterMemory;
+        return kIOReturnSuccess;
+    }
+    
+    IOMemoryDescriptor *sharedStreamMemory = device->copySharedStreamMemory(type);
+    if (NULL == sharedStreamMemory) {
+        return kIOReturnNotFound;
+    }
+    
+    *options = 0;
+    *memory = sharedStreamMemory;
+    return kIOReturnSuccess;
+}
@@ -0,0 +1,57 @@
+/*
+ *  REACUserClient.h
+ *  REAC
+ *
+ *  Created by Per Eckerdal on 18/10/2026.
+ *  Copyright 2026 Per Eckerdal. All rights reserved.
+ *
+ *
+ *  This file is part of the OS X REAC driver.
+ *
+ *  The OS X REAC driver is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  The OS X REAC driver is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OS X REAC driver.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REACUSERCLIENT_H
+#define _REACUSERCLIENT_H
+
+#include <IOKit/IOUserClient.h>
+
+#include "REACDevice.h"
+
+#define REACUserClient              com_pereckerdal_driver_REACUserClient
+
+// Lets user space programs map the shared input streams and the meters of the
+// REAC device. The memory type that is passed to IOConnectMapMemory is the index
+// of the connection among those that the device has started, plus
+// REAC_METER_MEMORY_TYPE for the meters (see REACMeterFormat.h). That is the order
+// of the Interfaces property, except that interfaces that failed to start are left out.
+// Since the streams carry live audio and readers write to them, only
+// administrators can open the user client.
+class REACUserClient : public IOUserClient {
+    OSDeclareDefaultStructors(REACUserClient)
+
+public:
+    virtual bool initWithTask(task_t owningTask, void *securityID, UInt32 type);
+    virtual bool start(IOService *provider);
+    virtual IOReturn clientClose();
+    virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory);
+
+protected:
+    REACDevice         *device;
+};
+
+
+#endif